@@ -0,0 +1,627 @@
+/*
+ * NFC Event Daemon
+ * Access decisions
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file acl.c
+ * @brief Allow/deny decisions on the cards that are tapped
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nfc/nfc.h>
+
+#include "acl.h"
+#include "mifare.h"
+#include "nfc-utils.h"
+#include "debug.h"
+
+/* A UID as a key: its length, then the UID zero padded, so that memcmp orders by length first */
+#define ACL_KEY 11
+#define ACL_BLOOM_MIN 256       /* single UIDs from which the Bloom filter pays off */
+#define ACL_BLOOM_BITS 16       /* per UID, about 0.2% false positives with 4 hashes */
+#define ACL_BLOOM_HASHES 4
+#define ACL_MAX_DATA 16         /* bytes compared by a sector rule */
+
+typedef struct {
+  uint8_t key[ACL_KEY];
+  uint8_t verdict;
+} acl_uid;
+
+typedef struct {
+  uint8_t lo[ACL_KEY];
+  uint8_t hi[ACL_KEY];
+  uint8_t reach[ACL_KEY];       /* highest end of this range and those sorted before it */
+  uint8_t verdict;
+} acl_range;
+
+typedef struct {
+  bool    any;                  /* any UID, otherwise those from lo to hi */
+  uint8_t lo[ACL_KEY];
+  uint8_t hi[ACL_KEY];
+  uint8_t sector;
+  uint8_t offset;
+  uint8_t len;
+  uint8_t data[ACL_MAX_DATA];
+  uint8_t mask[ACL_MAX_DATA];
+  uint8_t verdict;
+} acl_sector_rule;
+
+typedef struct {
+  acl_uid *uids;
+  size_t  num_uids;
+  acl_range *ranges;
+  size_t  num_ranges;
+  acl_sector_rule *rules;
+  size_t  num_rules;
+  uint64_t *bloom;              /* NULL below ACL_BLOOM_MIN UIDs */
+  uint32_t bloom_mask;          /* bits - 1 */
+  acl_verdict fallback;
+} acl_index;
+
+typedef struct {
+  char   *path;
+  unsigned generation;
+} acl_request;
+
+/* Only the poll loop uses the list in use; loaders hand theirs over in next_index */
+static acl_index *current = NULL;
+static acl_index *next_index = NULL;
+static acl_index no_index;      /* in next_index: drop the list in use */
+
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned requested = 0;  /* generation of the last reload requested */
+
+static const char *verdict_names[] = {
+  [ACL_NONE]    = "none",
+  [ACL_ALLOW]   = "allow",
+  [ACL_DENY]    = "deny",
+  [ACL_PENDING] = "pending",
+};
+
+static void
+acl_free(acl_index *idx)
+{
+  if ((idx == NULL) || (idx == &no_index))
+    return;
+  free(idx->uids);
+  free(idx->ranges);
+  free(idx->rules);
+  free(idx->bloom);
+  free(idx);
+}
+
+static int
+key_cmp(const void *a, const void *b)
+{
+  return memcmp(a, b, ACL_KEY);
+}
+
+static void
+target_key(const nfc_target *pnt, uint8_t key[ACL_KEY])
+{
+  memset(key, 0, ACL_KEY);
+  if ((pnt != NULL) && (pnt->nm.nmt == NMT_ISO14443A) && (pnt->nti.nai.szUidLen < ACL_KEY)) {
+    key[0] = pnt->nti.nai.szUidLen;
+    memcpy(key + 1, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen);
+  }
+}
+
+/**
+ * @brief Parse hex digits (':' separators allowed) into at most @a max bytes
+ * @return Number of bytes, -1 if @a s is not whole bytes of hex
+ */
+static int
+parse_hex(const char *s, uint8_t *out, size_t max)
+{
+  size_t  nibbles = 0;
+
+  for (; *s; s++) {
+    int     v;
+
+    if (*s == ':')
+      continue;
+    if (!isxdigit((unsigned char) *s) || (nibbles == 2 * max))
+      return -1;
+    v = isdigit((unsigned char) *s) ? *s - '0' : tolower((unsigned char) *s) - 'a' + 10;
+    if (nibbles % 2 == 0)
+      out[nibbles / 2] = v << 4;
+    else
+      out[nibbles / 2] |= v;
+    nibbles++;
+  }
+  if ((nibbles == 0) || (nibbles % 2))
+    return -1;
+  return nibbles / 2;
+}
+
+static int
+parse_key(const char *s, uint8_t key[ACL_KEY])
+{
+  int     len;
+
+  memset(key, 0, ACL_KEY);
+  if ((len = parse_hex(s, key + 1, ACL_KEY - 1)) < 0)
+    return -1;
+  key[0] = len;
+  return 0;
+}
+
+/**
+ * @brief Parse "UID", "UID-UID" or "*" (@a any set) into @a lo and @a hi
+ */
+static int
+parse_uids(char *s, bool *any, uint8_t lo[ACL_KEY], uint8_t hi[ACL_KEY])
+{
+  char   *dash;
+
+  *any = !strcmp(s, "*");
+  if (*any)
+    return 0;
+  if ((dash = strchr(s, '-')) != NULL)
+    *dash++ = '\0';
+  if (parse_key(s, lo) < 0)
+    return -1;
+  if (dash == NULL) {
+    memcpy(hi, lo, ACL_KEY);
+    return 0;
+  }
+  if ((parse_key(dash, hi) < 0) || (hi[0] != lo[0]) || (key_cmp(lo, hi) > 0))
+    return -1;
+  return 0;
+}
+
+static bool
+parse_byte(const char *s, int max, uint8_t *value)
+{
+  char   *end;
+  long    v;
+
+  errno = 0;
+  v = strtol(s, &end, 0);
+  if (errno || (end == s) || *end || (v < 0) || (v > max))
+    return false;
+  *value = v;
+  return true;
+}
+
+/**
+ * @brief Parse "sector N offset O data HEX[/MASK]" from the remaining tokens
+ */
+static int
+parse_sector_rule(char **saveptr, acl_sector_rule *r)
+{
+  const char *kw_sector = strtok_r(NULL, " \t\r\n", saveptr);
+  const char *sector = strtok_r(NULL, " \t\r\n", saveptr);
+  const char *kw_offset = strtok_r(NULL, " \t\r\n", saveptr);
+  const char *offset = strtok_r(NULL, " \t\r\n", saveptr);
+  const char *kw_data = strtok_r(NULL, " \t\r\n", saveptr);
+  char   *data = strtok_r(NULL, " \t\r\n", saveptr);
+  char   *mask;
+  int     len;
+
+  if (!kw_sector || strcmp(kw_sector, "sector") || !sector || !parse_byte(sector, 39, &r->sector) ||
+      !kw_offset || strcmp(kw_offset, "offset") || !offset || !parse_byte(offset, NFCD_SECTOR_DATA - 1, &r->offset) ||
+      !kw_data || strcmp(kw_data, "data") || !data || strtok_r(NULL, " \t\r\n", saveptr))
+    return -1;
+  if ((mask = strchr(data, '/')) != NULL)
+    *mask++ = '\0';
+  if ((len = parse_hex(data, r->data, ACL_MAX_DATA)) < 0)
+    return -1;
+  r->len = len;
+  memset(r->mask, 0xff, sizeof(r->mask));
+  if (mask && (parse_hex(mask, r->mask, ACL_MAX_DATA) != len))
+    return -1;
+  if (r->offset + r->len > NFCD_SECTOR_DATA)
+    return -1;
+  return 0;
+}
+
+static bool
+grow(void **array, size_t *cap, size_t n, size_t size)
+{
+  void   *p;
+
+  if (n < *cap)
+    return true;
+  if ((p = realloc(*array, (*cap ? 2 * *cap : 64) * size)) == NULL)
+    return false;
+  *array = p;
+  *cap = *cap ? 2 * *cap : 64;
+  return true;
+}
+
+static void
+bloom_hashes(const uint8_t key[ACL_KEY], uint32_t *h1, uint32_t *h2)
+{
+  const uint64_t h = state_image_hash(key, ACL_KEY);
+
+  *h1 = (uint32_t) h;
+  *h2 = (uint32_t) (h >> 32) | 1;
+}
+
+static bool
+bloom_test(const acl_index *idx, const uint8_t key[ACL_KEY])
+{
+  uint32_t h1, h2, bit;
+  int     i;
+
+  bloom_hashes(key, &h1, &h2);
+  for (i = 0; i < ACL_BLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) & idx->bloom_mask;
+    if (!(idx->bloom[bit / 64] & ((uint64_t) 1 << (bit % 64))))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Sort and merge the UIDs and ranges, and build the Bloom filter
+ */
+static int
+acl_build(acl_index *idx)
+{
+  size_t  i, n;
+
+  if (idx->num_uids) {
+    qsort(idx->uids, idx->num_uids, sizeof(idx->uids[0]), key_cmp);
+    // A UID listed twice is denied if either line denies it
+    for (i = 1, n = 1; i < idx->num_uids; i++) {
+      if (!key_cmp(idx->uids[i].key, idx->uids[n - 1].key)) {
+        if (idx->uids[i].verdict == ACL_DENY)
+          idx->uids[n - 1].verdict = ACL_DENY;
+      } else {
+        idx->uids[n++] = idx->uids[i];
+      }
+    }
+    idx->num_uids = n;
+  }
+
+  if (idx->num_ranges) {
+    qsort(idx->ranges, idx->num_ranges, sizeof(idx->ranges[0]), key_cmp);
+    memcpy(idx->ranges[0].reach, idx->ranges[0].hi, ACL_KEY);
+    for (i = 1; i < idx->num_ranges; i++) {
+      const uint8_t *prev = idx->ranges[i - 1].reach;
+
+      memcpy(idx->ranges[i].reach, (key_cmp(prev, idx->ranges[i].hi) > 0) ? prev : idx->ranges[i].hi, ACL_KEY);
+    }
+  }
+
+  if (idx->num_uids >= ACL_BLOOM_MIN) {
+    uint32_t bits = 64;
+
+    while (bits < idx->num_uids * ACL_BLOOM_BITS)
+      bits <<= 1;
+    if ((idx->bloom = calloc(bits / 64, sizeof(uint64_t))) == NULL)
+      return -1;
+    idx->bloom_mask = bits - 1;
+    for (i = 0; i < idx->num_uids; i++) {
+      uint32_t h1, h2, bit;
+      int     k;
+
+      bloom_hashes(idx->uids[i].key, &h1, &h2);
+      for (k = 0; k < ACL_BLOOM_HASHES; k++) {
+        bit = (h1 + k * h2) & idx->bloom_mask;
+        idx->bloom[bit / 64] |= (uint64_t) 1 << (bit % 64);
+      }
+    }
+  }
+  return 0;
+}
+
+static acl_index *
+acl_parse(const char *path)
+{
+  acl_index *idx;
+  FILE   *pf;
+  char   *line = NULL;
+  size_t  line_size = 0;
+  size_t  cap_uids = 0, cap_ranges = 0, cap_rules = 0;
+  int     iLine = 0;
+  bool    ok = true;
+
+  if ((pf = fopen(path, "r")) == NULL) {
+    ERR("Could not open access list %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  if ((idx = calloc(1, sizeof(*idx))) == NULL) {
+    fclose(pf);
+    return NULL;
+  }
+  idx->fallback = ACL_DENY;
+
+  while (ok && (getline(&line, &line_size, pf) > 0)) {
+    char   *saveptr, *action, *uids, *p;
+    acl_verdict verdict;
+    acl_sector_rule rule;
+
+    iLine++;
+    if ((p = strchr(line, '#')) != NULL)
+      *p = '\0';
+    if ((action = strtok_r(line, " \t\r\n", &saveptr)) == NULL)
+      continue;
+    uids = strtok_r(NULL, " \t\r\n", &saveptr);
+
+    if (!strcmp(action, "default")) {
+      if (uids && !strcmp(uids, "allow"))
+        idx->fallback = ACL_ALLOW;
+      else if (uids && !strcmp(uids, "deny"))
+        idx->fallback = ACL_DENY;
+      else
+        ok = false;
+      if (strtok_r(NULL, " \t\r\n", &saveptr))
+        ok = false;
+      continue;
+    }
+    if (!strcmp(action, "allow"))
+      verdict = ACL_ALLOW;
+    else if (!strcmp(action, "deny"))
+      verdict = ACL_DENY;
+    else {
+      ok = false;
+      break;
+    }
+
+    memset(&rule, 0, sizeof(rule));
+    rule.verdict = verdict;
+    if (!uids || (parse_uids(uids, &rule.any, rule.lo, rule.hi) < 0)) {
+      ok = false;
+      break;
+    }
+    p = saveptr + strspn(saveptr, " \t\r\n");
+    if (*p) {
+      if (!(ok = (parse_sector_rule(&saveptr, &rule) == 0)))
+        break;
+      if (!(ok = grow((void **) &idx->rules, &cap_rules, idx->num_rules, sizeof(rule))))
+        break;
+      idx->rules[idx->num_rules++] = rule;
+    } else if (rule.any) {
+      ok = false;               // that is what default is for
+    } else if (!key_cmp(rule.lo, rule.hi)) {
+      if (!(ok = grow((void **) &idx->uids, &cap_uids, idx->num_uids, sizeof(idx->uids[0]))))
+        break;
+      memcpy(idx->uids[idx->num_uids].key, rule.lo, ACL_KEY);
+      idx->uids[idx->num_uids++].verdict = verdict;
+    } else {
+      if (!(ok = grow((void **) &idx->ranges, &cap_ranges, idx->num_ranges, sizeof(idx->ranges[0]))))
+        break;
+      memcpy(idx->ranges[idx->num_ranges].lo, rule.lo, ACL_KEY);
+      memcpy(idx->ranges[idx->num_ranges].hi, rule.hi, ACL_KEY);
+      idx->ranges[idx->num_ranges++].verdict = verdict;
+    }
+  }
+  free(line);
+  fclose(pf);
+
+  if (!ok) {
+    ERR("%s:%d: invalid rule", path, iLine);
+    acl_free(idx);
+    return NULL;
+  }
+  if (acl_build(idx) < 0) {
+    ERR("Out of memory loading access list %s", path);
+    acl_free(idx);
+    return NULL;
+  }
+  INFO("Access list %s: %zu UIDs, %zu ranges, %zu sector rules, default %s", path,
+       idx->num_uids, idx->num_ranges, idx->num_rules, verdict_names[idx->fallback]);
+  return idx;
+}
+
+/**
+ * @brief The list in use, switching to the one loaded last if any
+ */
+static const acl_index *
+acl_current(void)
+{
+  acl_index *idx = __atomic_exchange_n(&next_index, NULL, __ATOMIC_ACQ_REL);
+
+  if (idx) {
+    acl_free(current);
+    current = (idx == &no_index) ? NULL : idx;
+  }
+  return current;
+}
+
+/**
+ * @brief Hand a list over to the poll loop, dropping one it did not take yet
+ */
+static void
+acl_publish(acl_index *idx)
+{
+  acl_free(__atomic_exchange_n(&next_index, idx, __ATOMIC_ACQ_REL));
+}
+
+int
+acl_load(const char *path)
+{
+  acl_index *idx = &no_index;
+
+  if (path[0] && ((idx = acl_parse(path)) == NULL))
+    return -1;
+  __atomic_add_fetch(&requested, 1, __ATOMIC_ACQ_REL);
+  acl_publish(idx);
+  acl_current();
+  return 0;
+}
+
+static void *
+acl_loader(void *arg)
+{
+  acl_request *req = arg;
+  acl_index *idx;
+
+  pthread_mutex_lock(&load_lock);
+  idx = acl_parse(req->path);
+  // A later request wins, even if it was parsed first
+  if (idx && (req->generation == __atomic_load_n(&requested, __ATOMIC_ACQUIRE)))
+    acl_publish(idx);
+  else
+    acl_free(idx);
+  pthread_mutex_unlock(&load_lock);
+  free(req->path);
+  free(req);
+  return NULL;
+}
+
+int
+acl_reload(const char *path)
+{
+  acl_request *req;
+  pthread_t thread;
+  int     res;
+
+  if (path[0] == '\0') {
+    __atomic_add_fetch(&requested, 1, __ATOMIC_ACQ_REL);
+    acl_publish(&no_index);
+    return 0;
+  }
+  if ((req = malloc(sizeof(*req))) == NULL)
+    return -1;
+  if ((req->path = strdup(path)) == NULL) {
+    free(req);
+    return -1;
+  }
+  req->generation = __atomic_add_fetch(&requested, 1, __ATOMIC_ACQ_REL);
+  if ((res = pthread_create(&thread, NULL, acl_loader, req)) != 0) {
+    ERR("pthread_create: %s", strerror(res));
+    free(req->path);
+    free(req);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+static const acl_uid *
+find_uid(const acl_index *idx, const uint8_t key[ACL_KEY])
+{
+  if (idx->bloom && !bloom_test(idx, key))
+    return NULL;
+  return bsearch(key, idx->uids, idx->num_uids, sizeof(idx->uids[0]), key_cmp);
+}
+
+static acl_verdict
+find_range(const acl_index *idx, const uint8_t key[ACL_KEY])
+{
+  acl_verdict verdict = ACL_NONE;
+  size_t  lo = 0, hi = idx->num_ranges;
+
+  // First range starting after the key, then back while one may still reach it
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+
+    if (key_cmp(idx->ranges[mid].lo, key) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  while ((lo > 0) && (key_cmp(idx->ranges[lo - 1].reach, key) >= 0)) {
+    const acl_range *r = &idx->ranges[--lo];
+
+    if (key_cmp(r->hi, key) >= 0) {
+      if (r->verdict == ACL_DENY)
+        return ACL_DENY;
+      verdict = r->verdict;
+    }
+  }
+  return verdict;
+}
+
+static bool
+rule_covers(const acl_sector_rule *r, const uint8_t key[ACL_KEY])
+{
+  return r->any || ((key_cmp(r->lo, key) <= 0) && (key_cmp(r->hi, key) >= 0));
+}
+
+acl_verdict
+acl_check(const nfc_target *pnt)
+{
+  const acl_index *idx = acl_current();
+  const acl_uid *u;
+  uint8_t key[ACL_KEY];
+  acl_verdict verdict;
+  size_t  i;
+
+  if (idx == NULL)
+    return ACL_NONE;
+  target_key(pnt, key);
+  if (key[0] && (u = find_uid(idx, key)) != NULL)
+    return u->verdict;
+  if (key[0] && ((verdict = find_range(idx, key)) != ACL_NONE))
+    return verdict;
+  for (i = 0; i < idx->num_rules; i++) {
+    if (rule_covers(&idx->rules[i], key))
+      return ACL_PENDING;
+  }
+  return idx->fallback;
+}
+
+acl_verdict
+acl_check_sector(const nfc_target *pnt, const nfcd_sector *sector)
+{
+  const acl_index *idx = acl_current();
+  uint8_t key[ACL_KEY];
+  size_t  i, j;
+
+  if (idx == NULL)
+    return ACL_NONE;
+  if (sector->status != MC_SECTOR_OK)
+    return ACL_PENDING;
+  target_key(pnt, key);
+  for (i = 0; i < idx->num_rules; i++) {
+    const acl_sector_rule *r = &idx->rules[i];
+
+    if ((r->sector != sector->number) || (r->offset + r->len > sector->szData) || !rule_covers(r, key))
+      continue;
+    for (j = 0; j < r->len; j++) {
+      if ((sector->abtData[r->offset + j] ^ r->data[j]) & r->mask[j])
+        break;
+    }
+    if (j == r->len)
+      return r->verdict;
+  }
+  return ACL_PENDING;
+}
+
+acl_verdict
+acl_default(void)
+{
+  const acl_index *idx = acl_current();
+
+  return idx ? idx->fallback : ACL_NONE;
+}
+
+const char *
+acl_verdict_name(acl_verdict verdict)
+{
+  if (verdict > ACL_PENDING)
+    return "unknown";
+  return verdict_names[verdict];
+}
@@ -0,0 +1,97 @@
+/*
+ * NFC Event Daemon
+ * Access decisions
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file acl.h
+ * @brief Allow/deny decisions on the cards that are tapped
+ *
+ * The access list is a text file, one rule per line, '#' starting a comment:
+ *
+ *   allow 04a1b2c3d4e5f6               one UID
+ *   deny  04a1b200-04a1b2ff            a range of UIDs of the same length
+ *   allow * sector 1 offset 0 data 4e46/ffff
+ *                                      data of a sector (value/mask), for
+ *                                      the UIDs given, or all of them
+ *   default deny                       when nothing matches (the default)
+ *
+ * A UID listed on its own decides first, then the ranges containing it (deny
+ * wins when several do).  Otherwise the sector rules for the UID, if any,
+ * decide in file order as the sectors are read, and the verdict is pending
+ * until then.  The default applies to the other cards, and to those whose
+ * sector rules all missed once the read is over.
+ *
+ * Single UIDs are kept in a sorted array, behind a Bloom filter when there
+ * are many of them; ranges in an array sorted by their start.  A list is
+ * loaded by a thread of its own and swapped in by the poll loop on its next
+ * decision, so polling never waits for a large list to be parsed.  Apart
+ * from acl_reload(), the functions are only called from the poll loop.
+ */
+
+#ifndef __ACL_H__
+#define __ACL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nfc/nfc-types.h>
+
+#include "state.h"
+
+typedef enum {
+  ACL_NONE,                     /* no access list */
+  ACL_ALLOW,
+  ACL_DENY,
+  ACL_PENDING,                  /* up to the data of sectors not read yet */
+} acl_verdict;
+
+/**
+ * @brief Load the access list in @a path, empty string for none
+ *
+ * Replaces the list in use only if @a path loads without error.
+ *
+ * @return 0 on success, -1 on error
+ */
+int     acl_load(const char *path);
+
+/**
+ * @brief Load @a path in the background, like acl_load()
+ * @return 0 if the load was started, -1 on error
+ */
+int     acl_reload(const char *path);
+
+/**
+ * @brief Decide on a card as it is detected
+ */
+acl_verdict acl_check(const nfc_target *pnt);
+
+/**
+ * @brief Decide on a pending card from one of its sectors
+ * @return The verdict, still ACL_PENDING if no rule on this sector matched
+ */
+acl_verdict acl_check_sector(const nfc_target *pnt, const nfcd_sector *sector);
+
+/**
+ * @brief Verdict of a card still pending once it has been read
+ */
+acl_verdict acl_default(void);
+
+const char *acl_verdict_name(acl_verdict verdict);
+
+#endif /* __ACL_H__ */
@@ -0,0 +1,195 @@
+/*
+ * NFC Event Daemon
+ * AES-128 block cipher and CMAC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file aes.c
+ * @brief AES-128 encryption (FIPS-197) and AES-CMAC (RFC 4493)
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <string.h>
+
+#include "aes.h"
+
+static const uint8_t sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t
+xtime(uint8_t b)
+{
+  return (b << 1) ^ ((b & 0x80) ? 0x1b : 0x00);
+}
+
+void
+aes128_init(aes128_ctx *pctx, const uint8_t abtKey[16])
+{
+  uint8_t *rk = pctx->abtRoundKeys;
+  uint8_t rcon = 0x01;
+  int     i;
+
+  memcpy(rk, abtKey, 16);
+  for (i = 16; i < 11 * 16; i += 4) {
+    uint8_t t[4] = { rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1] };
+
+    if ((i % 16) == 0) {
+      // RotWord, SubWord, Rcon
+      uint8_t t0 = t[0];
+
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[t0];
+      rcon = xtime(rcon);
+    }
+    rk[i]     = rk[i - 16] ^ t[0];
+    rk[i + 1] = rk[i - 15] ^ t[1];
+    rk[i + 2] = rk[i - 14] ^ t[2];
+    rk[i + 3] = rk[i - 13] ^ t[3];
+  }
+}
+
+void
+aes128_encrypt(const aes128_ctx *pctx, const uint8_t abtIn[16], uint8_t abtOut[16])
+{
+  const uint8_t *rk = pctx->abtRoundKeys;
+  uint8_t s[16];
+  int     round, i;
+
+  for (i = 0; i < 16; i++)
+    s[i] = abtIn[i] ^ rk[i];
+
+  for (round = 1; round <= 10; round++) {
+    uint8_t t[16];
+
+    // SubBytes and ShiftRows; the state is column major
+    for (i = 0; i < 16; i++)
+      t[i] = sbox[s[(i + 4 * (i % 4)) % 16]];
+
+    if (round < 10) {
+      // MixColumns
+      for (i = 0; i < 16; i += 4) {
+        uint8_t a0 = t[i], a1 = t[i + 1], a2 = t[i + 2], a3 = t[i + 3];
+        uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+
+        t[i]     ^= all ^ xtime(a0 ^ a1);
+        t[i + 1] ^= all ^ xtime(a1 ^ a2);
+        t[i + 2] ^= all ^ xtime(a2 ^ a3);
+        t[i + 3] ^= all ^ xtime(a3 ^ a0);
+      }
+    }
+
+    for (i = 0; i < 16; i++)
+      s[i] = t[i] ^ rk[16 * round + i];
+  }
+
+  memcpy(abtOut, s, 16);
+  aes_wipe(s, sizeof(s));
+}
+
+static void
+cmac_double(const uint8_t abtIn[16], uint8_t abtOut[16])
+{
+  const uint8_t msb = abtIn[0] & 0x80;
+  int     i;
+
+  for (i = 0; i < 15; i++)
+    abtOut[i] = (abtIn[i] << 1) | (abtIn[i + 1] >> 7);
+  abtOut[15] = (abtIn[15] << 1) ^ (msb ? 0x87 : 0x00);
+}
+
+void
+aes128_cmac_subkeys(const aes128_ctx *pctx, uint8_t abtK1[16], uint8_t abtK2[16])
+{
+  uint8_t l[16] = { 0 };
+
+  aes128_encrypt(pctx, l, l);
+  cmac_double(l, abtK1);
+  cmac_double(abtK1, abtK2);
+  aes_wipe(l, sizeof(l));
+}
+
+void
+aes128_cmac(const aes128_ctx *pctx, const uint8_t *pbtMsg, size_t szLen, uint8_t abtMac[16])
+{
+  uint8_t k1[16], k2[16];
+  uint8_t x[16] = { 0 };
+  uint8_t last[16];
+  size_t  szBlocks = (szLen + 15) / 16;
+  size_t  i, j;
+
+  aes128_cmac_subkeys(pctx, k1, k2);
+
+  // The last block is xored with K1 when complete, padded and xored with K2 otherwise
+  if ((szBlocks > 0) && ((szLen % 16) == 0)) {
+    for (j = 0; j < 16; j++)
+      last[j] = pbtMsg[16 * (szBlocks - 1) + j] ^ k1[j];
+  } else {
+    size_t  szRem = szLen % 16;
+
+    if (szBlocks == 0)
+      szBlocks = 1;
+    memset(last, 0, sizeof(last));
+    memcpy(last, pbtMsg + 16 * (szBlocks - 1), szRem);
+    last[szRem] = 0x80;
+    for (j = 0; j < 16; j++)
+      last[j] ^= k2[j];
+  }
+
+  for (i = 0; i + 1 < szBlocks; i++) {
+    for (j = 0; j < 16; j++)
+      x[j] ^= pbtMsg[16 * i + j];
+    aes128_encrypt(pctx, x, x);
+  }
+  for (j = 0; j < 16; j++)
+    x[j] ^= last[j];
+  aes128_encrypt(pctx, x, abtMac);
+
+  aes_wipe(k1, sizeof(k1));
+  aes_wipe(k2, sizeof(k2));
+  aes_wipe(x, sizeof(x));
+  aes_wipe(last, sizeof(last));
+}
+
+void
+aes_wipe(void *p, size_t len)
+{
+  volatile uint8_t *v = p;
+
+  while (len--)
+    *v++ = 0;
+}
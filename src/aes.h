@@ -0,0 +1,60 @@
+/*
+ * NFC Event Daemon
+ * AES-128 block cipher and CMAC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file aes.h
+ * @brief AES-128 encryption (FIPS-197) and AES-CMAC (RFC 4493)
+ *
+ * Only what key diversification needs: encryption of single blocks and a
+ * one-shot CMAC.  Table based and not constant time, which is acceptable for
+ * a daemon that derives keys locally but must not be reused where an
+ * attacker can time the computation.
+ */
+
+#ifndef __AES_H__
+#define __AES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AES_BLOCK_SIZE 16
+
+typedef struct {
+  uint8_t abtRoundKeys[11 * AES_BLOCK_SIZE];
+} aes128_ctx;
+
+void    aes128_init(aes128_ctx *pctx, const uint8_t abtKey[16]);
+void    aes128_encrypt(const aes128_ctx *pctx, const uint8_t abtIn[16], uint8_t abtOut[16]);
+
+/**
+ * @brief Compute the CMAC subkeys K1 and K2 from an expanded key
+ */
+void    aes128_cmac_subkeys(const aes128_ctx *pctx, uint8_t abtK1[16], uint8_t abtK2[16]);
+
+/**
+ * @brief One-shot AES-CMAC of @a szLen bytes
+ */
+void    aes128_cmac(const aes128_ctx *pctx, const uint8_t *pbtMsg, size_t szLen, uint8_t abtMac[16]);
+
+/**
+ * @brief Clear key material so the compiler cannot optimise it away
+ */
+void    aes_wipe(void *p, size_t len);
+
+#endif /* __AES_H__ */
@@ -0,0 +1,433 @@
+/*
+ * NFC Event Daemon
+ * Reader traffic capture and replay
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file capture.c
+ * @brief Reader traffic capture and replay
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include "capture.h"
+#include "nfc-utils.h"
+#include "debug.h"
+
+#ifndef PATH_MAX
+#  define PATH_MAX 4096
+#endif
+
+#define CAPTURE_MAGIC "NFCDCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+  char    magic[8];
+  uint16_t version;
+  uint16_t target_size;
+  uint32_t reserved;
+} capture_header;
+
+typedef struct {
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t tx_len;
+  uint16_t rx_len;
+  uint16_t reserved2;
+  int32_t res;
+  uint32_t duration;
+} capture_record_header;
+
+typedef struct {
+  capture_op op;
+  int     res;
+  uint32_t duration;
+  const uint8_t *tx;
+  size_t  tx_len;
+  const uint8_t *rx;
+  size_t  rx_len;
+  bool    used;
+} replay_record;
+
+/* What the report counts: the card commands split by MIFARE command */
+typedef enum {
+  STAT_POLL,
+  STAT_SELECT,
+  STAT_DESELECT,
+  STAT_AUTH,
+  STAT_READ,
+  STAT_WRITE,
+  STAT_OTHER,
+  STAT_PROPERTY,
+  STAT_NUM,
+} replay_stat;
+
+typedef struct {
+  unsigned long calls[STAT_NUM];
+  unsigned long unmatched[STAT_NUM];
+  uint64_t us;                  /* device time, polls excluded */
+} replay_stats;
+
+static const char *stat_names[] = {
+  [STAT_POLL]     = "poll",
+  [STAT_SELECT]   = "select",
+  [STAT_DESELECT] = "deselect",
+  [STAT_AUTH]     = "auth",
+  [STAT_READ]     = "read",
+  [STAT_WRITE]    = "write",
+  [STAT_OTHER]    = "other",
+  [STAT_PROPERTY] = "property",
+};
+
+struct nfcd_capture {
+  FILE   *file;
+  size_t  size;
+  size_t  max;
+
+  char    replay_path[PATH_MAX];
+  uint8_t *replay_data;
+  replay_record *records;
+  size_t  num_records;
+  size_t  next_poll;                    /* first record not replayed yet */
+  size_t  tap_start, tap_end;           /* records of the current poll */
+  bool    ended;
+  replay_stats recorded, replayed;
+};
+
+static int64_t
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+nfcd_capture *
+capture_new(void)
+{
+  return calloc(1, sizeof(nfcd_capture));
+}
+
+void
+capture_free(nfcd_capture *pc)
+{
+  if (pc == NULL)
+    return;
+  capture_stop(pc);
+  free(pc->records);
+  free(pc->replay_data);
+  free(pc);
+}
+
+int
+capture_start(nfcd_capture *pc, const char *path, size_t max_size)
+{
+  capture_header ch;
+
+  capture_stop(pc);
+  if ((pc->file = fopen(path, "w")) == NULL) {
+    ERR("Unable to create capture %s: %s", path, strerror(errno));
+    return -1;
+  }
+  memset(&ch, 0, sizeof(ch));
+  memcpy(ch.magic, CAPTURE_MAGIC, 8);
+  ch.version = CAPTURE_VERSION;
+  ch.target_size = sizeof(nfc_target);
+  if (fwrite(&ch, sizeof(ch), 1, pc->file) != 1) {
+    ERR("Unable to write capture %s: %s", path, strerror(errno));
+    capture_stop(pc);
+    return -1;
+  }
+  pc->size = sizeof(ch);
+  pc->max = max_size;
+  INFO("Capturing reader traffic to %s", path);
+  return 0;
+}
+
+void
+capture_stop(nfcd_capture *pc)
+{
+  if (pc->file == NULL)
+    return;
+  if (fclose(pc->file) != 0)
+    ERR("Unable to write capture: %s", strerror(errno));
+  pc->file = NULL;
+}
+
+int64_t
+capture_begin(const nfcd_capture *pc)
+{
+  return (pc && pc->file) ? now() : 0;
+}
+
+void
+capture_record(nfcd_capture *pc, capture_op op, const void *tx, size_t tx_len, int res, const void *rx,
+               size_t rx_len, int64_t start)
+{
+  capture_record_header rh;
+  int64_t us;
+
+  if ((pc == NULL) || (pc->file == NULL) || (start == 0))
+    return;
+  if (pc->size + sizeof(rh) + tx_len + rx_len > pc->max) {
+    INFO("Capture reached %zu bytes, stopped", pc->size);
+    capture_stop(pc);
+    return;
+  }
+  us = now() - start;
+  memset(&rh, 0, sizeof(rh));
+  rh.op = op;
+  rh.tx_len = tx_len;
+  rh.rx_len = rx_len;
+  rh.res = res;
+  rh.duration = (us < 0) ? 0 : (us > UINT32_MAX) ? UINT32_MAX : (uint32_t) us;
+  if ((fwrite(&rh, sizeof(rh), 1, pc->file) != 1) ||
+      (tx_len && (fwrite(tx, tx_len, 1, pc->file) != 1)) ||
+      (rx_len && (fwrite(rx, rx_len, 1, pc->file) != 1))) {
+    ERR("Unable to write capture: %s", strerror(errno));
+    capture_stop(pc);
+    return;
+  }
+  pc->size += sizeof(rh) + tx_len + rx_len;
+  // Everything up to the previous tap reaches the file at each poll
+  if (op == CAPTURE_POLL)
+    fflush(pc->file);
+}
+
+static replay_stat
+stat_of(capture_op op, const uint8_t *tx, size_t tx_len)
+{
+  switch (op) {
+    case CAPTURE_POLL:
+      return STAT_POLL;
+    case CAPTURE_SELECT:
+      return STAT_SELECT;
+    case CAPTURE_DESELECT:
+      return STAT_DESELECT;
+    case CAPTURE_PROPERTY:
+      return STAT_PROPERTY;
+    default:
+      break;
+  }
+  if (tx_len == 0)
+    return STAT_OTHER;
+  switch (tx[0]) {
+    case 0x60:
+    case 0x61:
+      return STAT_AUTH;
+    case 0x30:
+      return STAT_READ;
+    case 0xa0:
+      return STAT_WRITE;
+    default:
+      return STAT_OTHER;
+  }
+}
+
+int
+replay_start(nfcd_capture *pc, const char *path)
+{
+  const capture_header *ch;
+  capture_record_header rh;
+  size_t  size = 0, off, n = 0;
+  FILE   *f;
+  long    len;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    ERR("Unable to open capture %s: %s", path, strerror(errno));
+    return -1;
+  }
+  if ((fseek(f, 0, SEEK_END) < 0) || ((len = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) < 0) ||
+      ((pc->replay_data = malloc(len ? len : 1)) == NULL) || (fread(pc->replay_data, 1, len, f) != (size_t) len)) {
+    ERR("Unable to read capture %s: %s", path, strerror(errno));
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  size = len;
+
+  ch = (const capture_header *) pc->replay_data;
+  if ((size < sizeof(*ch)) || memcmp(ch->magic, CAPTURE_MAGIC, 8) || (ch->version != CAPTURE_VERSION) ||
+      (ch->target_size != sizeof(nfc_target))) {
+    ERR("%s is not a capture of this nfcd build", path);
+    free(pc->replay_data);
+    pc->replay_data = NULL;
+    return -1;
+  }
+
+  // Count, then index the records; a truncated last one is ignored
+  for (off = sizeof(*ch); off + sizeof(rh) <= size; n++) {
+    memcpy(&rh, pc->replay_data + off, sizeof(rh));
+    if (off + sizeof(rh) + rh.tx_len + rh.rx_len > size)
+      break;
+    off += sizeof(rh) + rh.tx_len + rh.rx_len;
+  }
+  if ((pc->records = calloc(n ? n : 1, sizeof(*pc->records))) == NULL) {
+    ERR("%s", "Out of memory indexing the capture");
+    free(pc->replay_data);
+    pc->replay_data = NULL;
+    return -1;
+  }
+  memset(&pc->recorded, 0, sizeof(pc->recorded));
+  for (off = sizeof(*ch), pc->num_records = 0; pc->num_records < n; pc->num_records++) {
+    replay_record *r = &pc->records[pc->num_records];
+    replay_stat st;
+
+    memcpy(&rh, pc->replay_data + off, sizeof(rh));
+    r->op = rh.op;
+    r->res = rh.res;
+    r->duration = rh.duration;
+    r->tx = pc->replay_data + off + sizeof(rh);
+    r->tx_len = rh.tx_len;
+    r->rx = r->tx + rh.tx_len;
+    r->rx_len = rh.rx_len;
+    off += sizeof(rh) + rh.tx_len + rh.rx_len;
+
+    st = stat_of(r->op, r->tx, r->tx_len);
+    pc->recorded.calls[st]++;
+    if (st != STAT_POLL)
+      pc->recorded.us += r->duration;
+  }
+
+  snprintf(pc->replay_path, sizeof(pc->replay_path), "%s", path);
+  // Calls made before the first poll (opening the reader) form a segment of their own
+  pc->next_poll = pc->tap_start = pc->tap_end = 0;
+  while ((pc->tap_end < pc->num_records) && (pc->records[pc->tap_end].op != CAPTURE_POLL))
+    pc->tap_end++;
+  pc->ended = false;
+  memset(&pc->replayed, 0, sizeof(pc->replayed));
+  INFO("Replaying %zu device calls from %s", pc->num_records, path);
+  return 0;
+}
+
+bool
+replay_active(const nfcd_capture *pc)
+{
+  return pc && (pc->records != NULL);
+}
+
+bool
+replay_ended(const nfcd_capture *pc)
+{
+  return pc && pc->ended;
+}
+
+static int
+replay_answer(replay_record *r, void *rx, size_t rx_size)
+{
+  if (rx && r->rx_len)
+    memcpy(rx, r->rx, (r->rx_len < rx_size) ? r->rx_len : rx_size);
+  r->used = true;
+  return r->res;
+}
+
+/**
+ * @brief Move on to the next recorded poll
+ */
+static int
+replay_poll(nfcd_capture *pc, void *rx, size_t rx_size)
+{
+  size_t  i;
+
+  while ((pc->next_poll < pc->num_records) && (pc->records[pc->next_poll].op != CAPTURE_POLL))
+    pc->next_poll++;
+  if (pc->next_poll == pc->num_records) {
+    if (!pc->ended) {
+      INFO("%s", "End of the capture");
+      pc->ended = true;
+    }
+    // Until the caller stops, the poll loop finds no target
+    usleep(1000);
+    return 0;
+  }
+  pc->replayed.calls[STAT_POLL]++;
+  pc->tap_start = pc->next_poll + 1;
+  for (i = pc->tap_start; (i < pc->num_records) && (pc->records[i].op != CAPTURE_POLL); i++)
+    ;
+  pc->tap_end = i;
+  return replay_answer(&pc->records[pc->next_poll++], rx, rx_size);
+}
+
+int
+replay_call(nfcd_capture *pc, capture_op op, const void *tx, size_t tx_len, void *rx, size_t rx_size)
+{
+  const replay_stat st = stat_of(op, tx, tx_len);
+  replay_record *reuse = NULL;
+  size_t  i;
+
+  if (op == CAPTURE_POLL)
+    return replay_poll(pc, rx, rx_size);
+  pc->replayed.calls[st]++;
+
+  // The first unused call with that request, else the last one answered again
+  for (i = pc->tap_start; i < pc->tap_end; i++) {
+    replay_record *r = &pc->records[i];
+
+    if ((r->op != op) || (r->tx_len != tx_len) || (tx_len && memcmp(r->tx, tx, tx_len)))
+      continue;
+    if (!r->used) {
+      pc->replayed.us += r->duration;
+      return replay_answer(r, rx, rx_size);
+    }
+    reuse = r;
+  }
+  if (reuse) {
+    pc->replayed.us += reuse->duration;
+    return replay_answer(reuse, rx, rx_size);
+  }
+
+  pc->replayed.unmatched[st]++;
+  // A card does not answer what it was never asked; the reader accepts any property
+  return (op == CAPTURE_PROPERTY) ? NFC_SUCCESS : NFC_ETIMEOUT;
+}
+
+void
+replay_report(const nfcd_capture *pc)
+{
+  unsigned long total[2] = { 0, 0 };
+  int     i;
+
+  if (!replay_active(pc))
+    return;
+  printf("Replay of %s:\n", pc->replay_path);
+  printf("  %-10s %10s %10s %10s\n", "call", "captured", "replayed", "unmatched");
+  for (i = 0; i < STAT_NUM; i++) {
+    printf("  %-10s %10lu %10lu %10lu\n", stat_names[i], pc->recorded.calls[i], pc->replayed.calls[i], pc->replayed.unmatched[i]);
+    if ((i != STAT_POLL) && (i != STAT_PROPERTY)) {
+      total[0] += pc->recorded.calls[i];
+      total[1] += pc->replayed.calls[i];
+    }
+  }
+  printf("  round trips: %lu captured, %lu replayed\n", total[0], total[1]);
+  printf("  device time: %llu ms captured, %llu ms replayed\n",
+         (unsigned long long)(pc->recorded.us / 1000), (unsigned long long)(pc->replayed.us / 1000));
+}
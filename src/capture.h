@@ -0,0 +1,119 @@
+/*
+ * NFC Event Daemon
+ * Reader traffic capture and replay
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file capture.h
+ * @brief Reader traffic capture and replay
+ *
+ * The device calls of device.h (poll, select, deselect, transceive of bytes
+ * or bits and property writes) can be captured to a file, each with its request, its
+ * result, the bytes received and how long it took.  A capture is then
+ * replayed in place of the device: polls return the recorded targets in
+ * order, and every other call is answered by the recorded call with the same
+ * request made while that target was in the field, so a change to the read
+ * logic is measured against the same cards.  A request the capture has no
+ * answer for times out, as a card would.
+ *
+ * File format, host byte order (captures are replayed on the same kind of
+ * host):
+ *
+ *   header: char magic[8] "NFCDCAP", uint16 version, uint16 sizeof(nfc_target),
+ *           uint32 reserved
+ *   record: uint8 op, uint8 reserved, uint16 tx_len, uint16 rx_len,
+ *           uint16 reserved, int32 result, uint32 duration (us),
+ *           then tx_len request bytes and rx_len received bytes
+ *
+ * The received bytes of a poll or select are the nfc_target found, those of
+ * a list (captured as a poll) the nfc_target array.  The request of a bit
+ * transceive is the number of bits sent, then the bits.
+ *
+ * A capture belongs to the device whose calls it captures or replays
+ * (nfcd_device.pCapture), and is only used from the thread driving it.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  CAPTURE_POLL = 1,
+  CAPTURE_SELECT,
+  CAPTURE_DESELECT,
+  CAPTURE_TRANSCEIVE,
+  CAPTURE_PROPERTY,
+  CAPTURE_TRANSCEIVE_BITS,
+  CAPTURE_NUM_OPS,
+} capture_op;
+
+typedef struct nfcd_capture nfcd_capture;
+
+/**
+ * @brief A capture neither capturing nor replaying yet
+ * @return NULL when out of memory
+ */
+nfcd_capture *capture_new(void);
+void    capture_free(nfcd_capture *pc);
+
+/**
+ * @brief Start capturing to @a path, replacing a running capture
+ * @param max_size Stop capturing once the file reaches this many bytes
+ * @return 0 on success, -1 on error
+ */
+int     capture_start(nfcd_capture *pc, const char *path, size_t max_size);
+void    capture_stop(nfcd_capture *pc);
+
+/**
+ * @brief Start time of a device call, 0 when not capturing or @a pc is NULL
+ */
+int64_t capture_begin(const nfcd_capture *pc);
+
+/**
+ * @brief Capture a device call started at @a start
+ */
+void    capture_record(nfcd_capture *pc, capture_op op, const void *tx, size_t tx_len, int res, const void *rx,
+                       size_t rx_len, int64_t start);
+
+/**
+ * @brief Load a capture and answer the device calls from it from now on
+ * @return 0 on success, -1 on error
+ */
+int     replay_start(nfcd_capture *pc, const char *path);
+bool    replay_active(const nfcd_capture *pc);
+
+/**
+ * @brief Whether a poll went past the last one captured; polls then find no target
+ */
+bool    replay_ended(const nfcd_capture *pc);
+
+/**
+ * @brief Answer a device call from the capture
+ * @param rx Receives the recorded bytes, up to @a rx_size
+ * @return The recorded result
+ */
+int     replay_call(nfcd_capture *pc, capture_op op, const void *tx, size_t tx_len, void *rx, size_t rx_size);
+
+/**
+ * @brief Print the round trips of the replay next to those of the capture
+ */
+void    replay_report(const nfcd_capture *pc);
+
+#endif /* __CAPTURE_H__ */
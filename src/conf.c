@@ -0,0 +1,711 @@
+/*
+ * NFC Event Daemon
+ * Runtime configuration
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file conf.c
+ * @brief Command line and configuration file handling
+ *
+ * The configuration file may use either UCI syntax:
+ *
+ *   config nfcd 'main'
+ *       option poll_interval '500'
+ *       list modulation 'iso14443a'
+ *
+ * or plain INI syntax:
+ *
+ *   [nfcd]
+ *   poll_interval = 500
+ *   modulation = iso14443a, felica
+ *
+ * Section headers are accepted and ignored, nfcd only has one section.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <nfc/nfc.h>
+
+#include "conf.h"
+#include "mifare.h"
+#include "nfc-utils.h"
+
+#define DEF_POLLING 1000  /* 1 second between presence checks */
+#define DEF_EXPIRE 0      /* no expire */
+#define DEF_DEBOUNCE 0    /* report a removal on the first scan missing the card */
+#define DEF_READER_MAX_ERRORS 3
+#define DEF_READER_RETRY_MAX 5000 /* ms */
+#define DEF_SHUTDOWN 500  /* ms */
+#define DEF_TIMEOUT_PERCENTILE 99
+#define DEF_TIMEOUT_MARGIN 50     /* % */
+#define DEF_TIMEOUT_CEILING 100   /* ms */
+#define DEF_JOURNAL_SEGMENT_SIZE 1024   /* KiB */
+#define DEF_JOURNAL_SEGMENTS 8
+#define DEF_JOURNAL_SYNC 1000     /* ms */
+#define DEF_TRACE_BUFFER 8192
+#define DEF_POLL_MIN_INTERVAL 50
+#define DEF_POLL_MAX_INTERVAL 1000
+#define DEF_CAPTURE_MAX_SIZE 16384
+#define DEF_RING_SIZE 1024        /* records */
+
+#define MAX_OVERRIDES 64
+
+typedef struct {
+  const char *key;
+  const char *value;
+} conf_override;
+
+typedef struct {
+  const char *source;   /* file name or "command line" */
+  int     line;
+  bool    modulations_seen;
+  bool    sector_order_seen;
+} conf_parse_state;
+
+static const struct {
+  const char *name;
+  nfc_modulation nm;
+} modulation_names[] = {
+  { "iso14443a", { .nmt = NMT_ISO14443A, .nbr = NBR_106 } },
+  { "iso14443b", { .nmt = NMT_ISO14443B, .nbr = NBR_106 } },
+  { "felica",    { .nmt = NMT_FELICA,    .nbr = NBR_212 } },
+  { "jewel",     { .nmt = NMT_JEWEL,     .nbr = NBR_106 } },
+};
+
+static const char *poll_mode_names[] = {
+  [NFC_POLL_HARDWARE] = "hardware",
+  [NFC_POLL_SOFTWARE] = "software",
+};
+
+static const char *read_plan_names[] = {
+  [READ_PLAN_UID]      = "uid",
+  [READ_PLAN_PRIORITY] = "priority",
+  [READ_PLAN_FULL]     = "full",
+  [READ_PLAN_NDEF]     = "ndef",
+};
+
+/* Command line, kept so that a reload can replay it on top of the file */
+static conf_override overrides[MAX_OVERRIDES];
+static size_t num_overrides = 0;
+static char config_file[PATH_MAX] = NFCD_CONF_FILE;
+static bool config_file_required = false;
+static char debug_level[16];
+
+static void
+print_usage(const char *progname)
+{
+  printf("Usage: %s [OPTIONS]\n", progname);
+  printf("\n");
+  printf("  -c, --config FILE         configuration file (default %s)\n", NFCD_CONF_FILE);
+  printf("  -p, --poll-interval MS    delay between presence checks (default %d)\n", DEF_POLLING);
+  printf("  -e, --expire MS           emit an expire event after MS without tag (0: never)\n");
+  printf("  -D, --device CONNSTRING   libnfc device to open (default: first found)\n");
+  printf("  -m, --modulation LIST     modulations to poll: iso14443a,iso14443b,felica,jewel\n");
+  printf("  -k, --key-file FILE       MIFARE Classic key dictionary, one hex key per line\n");
+  printf("  -K, --master-key FILE     AES-128 master key for diversified MIFARE Classic keys\n");
+  printf("  -a, --acl FILE            allow/deny list the tapped cards are checked against\n");
+  printf("  -r, --read PLAN           what to read on tag insertion: uid, priority, full, ndef\n");
+  printf("  -S, --sector-order LIST   MIFARE Classic sectors to read first, e.g. 1,2\n");
+  printf("  -o, --output SINK         event output: '-' for stdout or a file path\n");
+  printf("  -C, --capture FILE        capture the reader traffic to FILE\n");
+  printf("  -R, --replay FILE         answer from a capture instead of a reader, then report\n");
+  printf("  -d, --daemon              go to background\n");
+  printf("  -v, --debug               increase debug level\n");
+  printf("  -h, --help                show this help\n");
+  printf("\n");
+  printf("The configuration file is re-read on SIGHUP, SIGUSR1 dumps the trace.\n");
+}
+
+static void
+conf_defaults(nfcd_conf *conf)
+{
+  memset(conf, 0, sizeof(*conf));
+  conf->poll_interval = DEF_POLLING;
+  conf->poll_mode = NFC_POLL_HARDWARE;
+  conf->poll_min_interval = DEF_POLL_MIN_INTERVAL;
+  conf->poll_max_interval = DEF_POLL_MAX_INTERVAL;
+  conf->expire_time = DEF_EXPIRE;
+  conf->debounce_time = DEF_DEBOUNCE;
+  conf->reader_max_errors = DEF_READER_MAX_ERRORS;
+  conf->reader_retry_max = DEF_READER_RETRY_MAX;
+  conf->shutdown_timeout = DEF_SHUTDOWN;
+  conf->modulations[0] = modulation_names[0].nm;
+  conf->num_modulations = 1;
+  conf->read_plan = READ_PLAN_FULL;
+  conf->tolerate_failures = true;
+  conf->timeout_percentile = DEF_TIMEOUT_PERCENTILE;
+  conf->timeout_margin = DEF_TIMEOUT_MARGIN;
+  conf->timeout_ceiling = DEF_TIMEOUT_CEILING;
+  conf->journal_segment_size = DEF_JOURNAL_SEGMENT_SIZE;
+  conf->journal_segments = DEF_JOURNAL_SEGMENTS;
+  conf->journal_sync_interval = DEF_JOURNAL_SYNC;
+  conf->trace_buffer = DEF_TRACE_BUFFER;
+  conf->capture_max_size = DEF_CAPTURE_MAX_SIZE;
+  conf->ring_size = DEF_RING_SIZE;
+  strcpy(conf->output, "-");
+  conf->ubus = true;
+}
+
+static char *
+trim(char *s)
+{
+  char   *end;
+
+  while (isspace((unsigned char) *s))
+    s++;
+  end = s + strlen(s);
+  while ((end > s) && isspace((unsigned char) end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+static char *
+unquote(char *s)
+{
+  size_t  len = strlen(s);
+
+  if ((len >= 2) && ((s[0] == '\'') || (s[0] == '"')) && (s[len - 1] == s[0])) {
+    s[len - 1] = '\0';
+    s++;
+  }
+  return s;
+}
+
+static int
+parse_int(const char *value, int min, int max, int *out)
+{
+  char   *end;
+  long    l;
+
+  errno = 0;
+  l = strtol(value, &end, 10);
+  if ((errno != 0) || (end == value) || (*trim(end) != '\0') || (l < min) || (l > max))
+    return -1;
+  *out = (int) l;
+  return 0;
+}
+
+static int
+parse_bool(const char *value, bool *out)
+{
+  if (!strcmp(value, "1") || !strcasecmp(value, "yes") || !strcasecmp(value, "on") || !strcasecmp(value, "true")) {
+    *out = true;
+  } else if (!strcmp(value, "0") || !strcasecmp(value, "no") || !strcasecmp(value, "off") || !strcasecmp(value, "false")) {
+    *out = false;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int
+parse_modulations(nfcd_conf *conf, const char *value, conf_parse_state *st)
+{
+  char    buf[256];
+  char   *tok, *saveptr;
+
+  if (!st->modulations_seen) {
+    conf->num_modulations = 0;
+    st->modulations_seen = true;
+  }
+
+  snprintf(buf, sizeof(buf), "%s", value);
+  for (tok = strtok_r(buf, " \t,", &saveptr); tok; tok = strtok_r(NULL, " \t,", &saveptr)) {
+    size_t  i;
+
+    for (i = 0; i < sizeof(modulation_names) / sizeof(modulation_names[0]); i++) {
+      if (!strcasecmp(tok, modulation_names[i].name))
+        break;
+    }
+    if (i == sizeof(modulation_names) / sizeof(modulation_names[0])) {
+      ERR("%s:%d: unknown modulation '%s'", st->source, st->line, tok);
+      return -1;
+    }
+    if (conf->num_modulations == NFCD_MAX_MODULATIONS) {
+      ERR("%s:%d: too many modulations", st->source, st->line);
+      return -1;
+    }
+    conf->modulations[conf->num_modulations++] = modulation_names[i].nm;
+  }
+  return 0;
+}
+
+static int
+parse_sector_order(nfcd_conf *conf, const char *value, conf_parse_state *st)
+{
+  char    buf[256];
+  char   *tok, *saveptr;
+
+  if (!st->sector_order_seen) {
+    conf->num_sector_order = 0;
+    st->sector_order_seen = true;
+  }
+
+  snprintf(buf, sizeof(buf), "%s", value);
+  for (tok = strtok_r(buf, " \t,", &saveptr); tok; tok = strtok_r(NULL, " \t,", &saveptr)) {
+    int     sector;
+
+    if (parse_int(tok, 0, NFCD_MAX_SECTORS - 1, &sector) < 0) {
+      ERR("%s:%d: invalid sector '%s'", st->source, st->line, tok);
+      return -1;
+    }
+    if (conf->num_sector_order == NFCD_MAX_SECTORS) {
+      ERR("%s:%d: too many sectors", st->source, st->line);
+      return -1;
+    }
+    conf->sector_order[conf->num_sector_order++] = sector;
+  }
+  return 0;
+}
+
+static int
+parse_apdu(nfcd_conf *conf, const char *value)
+{
+  size_t  len = 0;
+  unsigned int byte;
+
+  // Hex digits, bytes optionally apart
+  for (;;) {
+    while (isspace((unsigned char) *value))
+      value++;
+    if (*value == '\0')
+      break;
+    if ((len == NFCD_MAX_APDU) || !isxdigit((unsigned char) value[0]) || !isxdigit((unsigned char) value[1]) ||
+        (sscanf(value, "%2x", &byte) != 1))
+      return -1;
+    conf->apdu[len++] = byte;
+    value += 2;
+  }
+  // The shortest one is CLA INS P1 P2
+  if ((len > 0) && (len < 4))
+    return -1;
+  conf->apdu_len = len;
+  return 0;
+}
+
+static int
+conf_set(nfcd_conf *conf, const char *key, const char *value, conf_parse_state *st)
+{
+  int     res = 0;
+
+  if (!strcmp(key, "poll_interval")) {
+    res = parse_int(value, 0, 3600 * 1000, &conf->poll_interval);
+  } else if (!strcmp(key, "expire_time")) {
+    res = parse_int(value, 0, INT_MAX, &conf->expire_time);
+  } else if (!strcmp(key, "debounce_time")) {
+    res = parse_int(value, 0, 60 * 1000, &conf->debounce_time);
+  } else if (!strcmp(key, "reader_max_errors")) {
+    res = parse_int(value, 1, 1000, &conf->reader_max_errors);
+  } else if (!strcmp(key, "reader_retry_max")) {
+    res = parse_int(value, 50, 3600 * 1000, &conf->reader_retry_max);
+  } else if (!strcmp(key, "shutdown_timeout")) {
+    res = parse_int(value, 1, 60 * 1000, &conf->shutdown_timeout);
+  } else if (!strcmp(key, "daemonize")) {
+    res = parse_bool(value, &conf->daemonize);
+  } else if (!strcmp(key, "debug")) {
+    res = parse_int(value, 0, 16, &conf->debug);
+  } else if (!strcmp(key, "device")) {
+    if (strlen(value) >= sizeof(conf->device))
+      res = -1;
+    else
+      strcpy(conf->device, value);
+  } else if (!strcmp(key, "modulation")) {
+    return parse_modulations(conf, value, st);
+  } else if (!strcmp(key, "master_key_file")) {
+    if (strlen(value) >= sizeof(conf->master_key_file))
+      res = -1;
+    else
+      strcpy(conf->master_key_file, value);
+  } else if (!strcmp(key, "acl_file")) {
+    if (strlen(value) >= sizeof(conf->acl_file))
+      res = -1;
+    else
+      strcpy(conf->acl_file, value);
+  } else if (!strcmp(key, "key_file")) {
+    if (strlen(value) >= sizeof(conf->key_file))
+      res = -1;
+    else
+      strcpy(conf->key_file, value);
+  } else if (!strcmp(key, "poll_mode")) {
+    size_t  i;
+
+    res = -1;
+    for (i = 0; i < sizeof(poll_mode_names) / sizeof(poll_mode_names[0]); i++) {
+      if (!strcasecmp(value, poll_mode_names[i])) {
+        conf->poll_mode = (nfc_poll_mode) i;
+        res = 0;
+      }
+    }
+  } else if (!strcmp(key, "poll_min_interval")) {
+    res = parse_int(value, 1, 60 * 1000, &conf->poll_min_interval);
+  } else if (!strcmp(key, "poll_max_interval")) {
+    res = parse_int(value, 1, 60 * 1000, &conf->poll_max_interval);
+  } else if (!strcmp(key, "read")) {
+    size_t  i;
+
+    res = -1;
+    for (i = 0; i < sizeof(read_plan_names) / sizeof(read_plan_names[0]); i++) {
+      if (!strcasecmp(value, read_plan_names[i])) {
+        conf->read_plan = (nfcd_read_plan) i;
+        res = 0;
+      }
+    }
+  } else if (!strcmp(key, "sector_order")) {
+    res = parse_sector_order(conf, value, st);
+  } else if (!strcmp(key, "timeout_percentile")) {
+    res = parse_int(value, 50, 100, &conf->timeout_percentile);
+  } else if (!strcmp(key, "timeout_margin")) {
+    res = parse_int(value, 0, 1000, &conf->timeout_margin);
+  } else if (!strcmp(key, "timeout_ceiling")) {
+    res = parse_int(value, 0, 60 * 1000, &conf->timeout_ceiling);
+  } else if (!strcmp(key, "tolerate_failures")) {
+    res = parse_bool(value, &conf->tolerate_failures);
+  } else if (!strcmp(key, "debit_block")) {
+    res = parse_int(value, 0, 255, &conf->debit_block);
+  } else if (!strcmp(key, "debit_amount")) {
+    res = parse_int(value, 0, INT_MAX, &conf->debit_amount);
+  } else if (!strcmp(key, "debit_backup_block")) {
+    res = parse_int(value, 0, 255, &conf->debit_backup_block);
+  } else if (!strcmp(key, "apdu")) {
+    res = parse_apdu(conf, value);
+  } else if (!strcmp(key, "output")) {
+    if (strlen(value) >= sizeof(conf->output))
+      res = -1;
+    else
+      strcpy(conf->output, value);
+  } else if (!strcmp(key, "journal_dir")) {
+    if (strlen(value) >= sizeof(conf->journal_dir))
+      res = -1;
+    else
+      strcpy(conf->journal_dir, value);
+  } else if (!strcmp(key, "journal_segment_size")) {
+    res = parse_int(value, 64, 1024 * 1024, &conf->journal_segment_size);
+  } else if (!strcmp(key, "journal_segments")) {
+    res = parse_int(value, 2, 100000, &conf->journal_segments);
+  } else if (!strcmp(key, "journal_sync_interval")) {
+    res = parse_int(value, 1, 3600 * 1000, &conf->journal_sync_interval);
+  } else if (!strcmp(key, "journal_images")) {
+    res = parse_bool(value, &conf->journal_images);
+  } else if (!strcmp(key, "ubus")) {
+    res = parse_bool(value, &conf->ubus);
+  } else if (!strcmp(key, "ring_name")) {
+    if ((strlen(value) >= sizeof(conf->ring_name)) || (value[0] && ((value[0] != '/') || strchr(value + 1, '/'))))
+      res = -1;
+    else
+      strcpy(conf->ring_name, value);
+  } else if (!strcmp(key, "ring_size")) {
+    res = parse_int(value, 2, 65536, &conf->ring_size);
+    if ((res == 0) && (conf->ring_size & (conf->ring_size - 1)))
+      res = -1;
+  } else if (!strcmp(key, "metrics_socket")) {
+    if (strlen(value) >= sizeof(conf->metrics_socket))
+      res = -1;
+    else
+      strcpy(conf->metrics_socket, value);
+  } else if (!strcmp(key, "metrics_port")) {
+    res = parse_int(value, 0, 65535, &conf->metrics_port);
+  } else if (!strcmp(key, "trace_file")) {
+    if (strlen(value) >= sizeof(conf->trace_file))
+      res = -1;
+    else
+      strcpy(conf->trace_file, value);
+  } else if (!strcmp(key, "trace_buffer")) {
+    res = parse_int(value, 64, 1024 * 1024, &conf->trace_buffer);
+  } else if (!strcmp(key, "capture_file")) {
+    if (strlen(value) >= sizeof(conf->capture_file))
+      res = -1;
+    else
+      strcpy(conf->capture_file, value);
+  } else if (!strcmp(key, "capture_max_size")) {
+    res = parse_int(value, 1, 4 * 1024 * 1024, &conf->capture_max_size);
+  } else if (!strcmp(key, "replay_file")) {
+    if (strlen(value) >= sizeof(conf->replay_file))
+      res = -1;
+    else
+      strcpy(conf->replay_file, value);
+  } else {
+    WARN("%s:%d: ignoring unknown option '%s'", st->source, st->line, key);
+    return 0;
+  }
+
+  if (res < 0)
+    ERR("%s:%d: invalid value '%s' for option '%s'", st->source, st->line, value, key);
+  return res;
+}
+
+static int
+conf_parse_file(nfcd_conf *conf, const char *path, bool required)
+{
+  FILE   *f;
+  char    line[1024];                   /* a full APDU in spaced hex fits */
+  conf_parse_state st = { .source = path, .line = 0, .modulations_seen = false, .sector_order_seen = false };
+  int     res = 0;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    if (!required && (errno == ENOENT))
+      return 0;
+    ERR("Unable to open configuration file %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    char   *s = trim(line);
+    char   *key, *value, *eq;
+
+    st.line++;
+    if ((*s == '\0') || (*s == '#') || (*s == ';') || (*s == '['))
+      continue;
+
+    if (!strncmp(s, "config", 6) && ((s[6] == '\0') || isspace((unsigned char) s[6])))
+      continue;
+
+    if ((!strncmp(s, "option", 6) || !strncmp(s, "list", 4)) && isspace((unsigned char) s[s[0] == 'o' ? 6 : 4])) {
+      // UCI: option <key> <value>
+      key = trim(s + (s[0] == 'o' ? 6 : 4));
+      value = key;
+      while (*value && !isspace((unsigned char) *value))
+        value++;
+      if (*value)
+        *value++ = '\0';
+      value = unquote(trim(value));
+      key = unquote(key);
+    } else if ((eq = strchr(s, '=')) != NULL) {
+      // INI: key = value
+      *eq = '\0';
+      key = trim(s);
+      value = unquote(trim(eq + 1));
+    } else {
+      ERR("%s:%d: syntax error", path, st.line);
+      res = -1;
+      break;
+    }
+
+    if (conf_set(conf, key, value, &st) < 0) {
+      res = -1;
+      break;
+    }
+  }
+
+  fclose(f);
+  return res;
+}
+
+static int
+conf_resolve(nfcd_conf *conf)
+{
+  nfcd_conf tmp;
+  conf_parse_state st = { .source = "command line", .line = 0, .modulations_seen = false, .sector_order_seen = false };
+  size_t  i;
+
+  conf_defaults(&tmp);
+  strcpy(tmp.config_file, config_file);
+  tmp.config_file_required = config_file_required;
+
+  if (conf_parse_file(&tmp, tmp.config_file, tmp.config_file_required) < 0)
+    return -1;
+
+  for (i = 0; i < num_overrides; i++) {
+    if (conf_set(&tmp, overrides[i].key, overrides[i].value, &st) < 0)
+      return -1;
+  }
+
+  if ((tmp.read_plan == READ_PLAN_PRIORITY) && (tmp.num_sector_order == 0)) {
+    ERR("%s", "read plan 'priority' needs a sector_order");
+    return -1;
+  }
+  if (tmp.poll_min_interval > tmp.poll_max_interval) {
+    ERR("%s", "poll_min_interval is above poll_max_interval");
+    return -1;
+  }
+  if ((tmp.debit_block && (mifare_classic_block_group(tmp.debit_block) == 3)) ||
+      (tmp.debit_backup_block && ((mifare_classic_block_group(tmp.debit_backup_block) == 3) ||
+                                  (mifare_classic_block_sector(tmp.debit_backup_block) !=
+                                   mifare_classic_block_sector(tmp.debit_block)) ||
+                                  (tmp.debit_backup_block == tmp.debit_block)))) {
+    ERR("%s", "debit blocks must be two data blocks of one sector");
+    return -1;
+  }
+
+  *conf = tmp;
+  return 0;
+}
+
+int
+conf_load(nfcd_conf *conf, int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    { "config",        required_argument, NULL, 'c' },
+    { "poll-interval", required_argument, NULL, 'p' },
+    { "expire",        required_argument, NULL, 'e' },
+    { "device",        required_argument, NULL, 'D' },
+    { "modulation",    required_argument, NULL, 'm' },
+    { "key-file",      required_argument, NULL, 'k' },
+    { "master-key",    required_argument, NULL, 'K' },
+    { "acl",           required_argument, NULL, 'a' },
+    { "read",          required_argument, NULL, 'r' },
+    { "sector-order",  required_argument, NULL, 'S' },
+    { "output",        required_argument, NULL, 'o' },
+    { "capture",       required_argument, NULL, 'C' },
+    { "replay",        required_argument, NULL, 'R' },
+    { "daemon",        no_argument,       NULL, 'd' },
+    { "debug",         no_argument,       NULL, 'v' },
+    { "help",          no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int     opt;
+  int     verbosity = 0;
+
+  num_overrides = 0;
+  optind = 0;
+  while ((opt = getopt_long(argc, argv, "c:p:e:D:m:k:K:a:r:S:o:C:R:dvh", long_options, NULL)) != -1) {
+    const char *key = NULL;
+    const char *value = optarg;
+
+    switch (opt) {
+      case 'c':
+        snprintf(config_file, sizeof(config_file), "%s", optarg);
+        config_file_required = true;
+        continue;
+      case 'p': key = "poll_interval"; break;
+      case 'e': key = "expire_time"; break;
+      case 'D': key = "device"; break;
+      case 'm': key = "modulation"; break;
+      case 'k': key = "key_file"; break;
+      case 'K': key = "master_key_file"; break;
+      case 'a': key = "acl_file"; break;
+      case 'r': key = "read"; break;
+      case 'S': key = "sector_order"; break;
+      case 'o': key = "output"; break;
+      case 'C': key = "capture_file"; break;
+      case 'R': key = "replay_file"; break;
+      case 'd': key = "daemonize"; value = "1"; break;
+      case 'v':
+        snprintf(debug_level, sizeof(debug_level), "%d", ++verbosity);
+        key = "debug";
+        value = debug_level;
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        return 1;
+      default:
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (num_overrides == MAX_OVERRIDES) {
+      ERR("%s", "Too many command line options");
+      return -1;
+    }
+    overrides[num_overrides].key = key;
+    overrides[num_overrides].value = value;
+    num_overrides++;
+  }
+  if (optind < argc) {
+    ERR("Unexpected argument '%s'", argv[optind]);
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  return conf_resolve(conf);
+}
+
+int
+conf_reload(nfcd_conf *conf)
+{
+  return conf_resolve(conf);
+}
+
+const char *
+conf_poll_mode_name(nfc_poll_mode mode)
+{
+  return poll_mode_names[mode];
+}
+
+const char *
+conf_read_plan_name(nfcd_read_plan plan)
+{
+  return read_plan_names[plan];
+}
+
+void
+conf_print(const nfcd_conf *conf)
+{
+  size_t  i;
+
+  DBG("config file:   %s", conf->config_file);
+  DBG("poll interval: %d ms", conf->poll_interval);
+  if (conf->poll_mode == NFC_POLL_SOFTWARE)
+    DBG("poll mode:     software, %d to %d ms", conf->poll_min_interval, conf->poll_max_interval);
+  else
+    DBG("poll mode:     %s", conf_poll_mode_name(conf->poll_mode));
+  DBG("expire time:   %d ms", conf->expire_time);
+  DBG("debounce:      %d ms", conf->debounce_time);
+  DBG("reader health: reopen after %d errors, retry up to every %d ms", conf->reader_max_errors, conf->reader_retry_max);
+  DBG("shutdown:      %d ms", conf->shutdown_timeout);
+  DBG("device:        %s", conf->device[0] ? conf->device : "(default)");
+  for (i = 0; i < conf->num_modulations; i++)
+    DBG("modulation:    %s", str_nfc_modulation_type(conf->modulations[i].nmt));
+  DBG("key file:      %s", conf->key_file[0] ? conf->key_file : "(built-in)");
+  DBG("master key:    %s", conf->master_key_file[0] ? conf->master_key_file : "(none)");
+  DBG("access list:   %s", conf->acl_file[0] ? conf->acl_file : "(none)");
+  DBG("read plan:     %s", conf_read_plan_name(conf->read_plan));
+  for (i = 0; i < conf->num_sector_order; i++)
+    DBG("sector first:  %d", conf->sector_order[i]);
+  DBG("tolerate:      %s", conf->tolerate_failures ? "yes" : "no");
+  if (conf->debit_block)
+    DBG("debit:         %d from block %d, backup in block %d", conf->debit_amount, conf->debit_block,
+        conf->debit_backup_block);
+  if (conf->apdu_len) {
+    char    hex[2 * NFCD_MAX_APDU + 1];
+
+    for (i = 0; i < conf->apdu_len; i++)
+      sprintf(hex + 2 * i, "%02x", conf->apdu[i]);
+    DBG("apdu:          %s", hex);
+  }
+  if (conf->timeout_ceiling)
+    DBG("timeouts:      p%d + %d%%, up to %d ms", conf->timeout_percentile, conf->timeout_margin, conf->timeout_ceiling);
+  else
+    DBG("%s", "timeouts:      driver default");
+  DBG("output:        %s", conf->output);
+  if (conf->journal_dir[0])
+    DBG("journal:       %s, %d x %d KiB, sync %d ms%s", conf->journal_dir, conf->journal_segments,
+        conf->journal_segment_size, conf->journal_sync_interval, conf->journal_images ? ", images" : "");
+  DBG("ubus:          %s", conf->ubus ? "yes" : "no");
+  if (conf->ring_name[0])
+    DBG("event ring:    %s, %d records", conf->ring_name, conf->ring_size);
+  if (conf->metrics_socket[0])
+    DBG("metrics:       %s", conf->metrics_socket);
+  if (conf->metrics_port)
+    DBG("metrics http:  127.0.0.1:%d", conf->metrics_port);
+  if (conf->trace_file[0])
+    DBG("trace:         %s, %d spans per thread", conf->trace_file, conf->trace_buffer);
+  if (conf->capture_file[0])
+    DBG("capture:       %s, up to %d KiB", conf->capture_file, conf->capture_max_size);
+  if (conf->replay_file[0])
+    DBG("replay:        %s", conf->replay_file);
+}
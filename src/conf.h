@@ -0,0 +1,131 @@
+/*
+ * NFC Event Daemon
+ * Runtime configuration
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file conf.h
+ * @brief Command line and configuration file handling
+ *
+ * Settings are resolved in three layers: built-in defaults, then the
+ * configuration file (UCI or INI syntax), then the command line.  The same
+ * sequence is replayed on reload so command line overrides always win.
+ */
+
+#ifndef __CONF_H__
+#define __CONF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <nfc/nfc-types.h>
+
+#ifndef PATH_MAX
+#  define PATH_MAX 4096
+#endif
+
+#define NFCD_CONF_FILE "/etc/config/nfcd"
+
+#define NFCD_MAX_MODULATIONS 8
+#define NFCD_MAX_SECTORS 40
+#define NFCD_MAX_APDU 261         /* header, Lc, 255 data bytes, Le */
+
+typedef enum {
+  READ_PLAN_UID,        /* report the target only */
+  READ_PLAN_PRIORITY,   /* read the sector_order sectors only */
+  READ_PLAN_FULL,       /* dump the whole card */
+  READ_PLAN_NDEF,       /* read the NDEF application only, as the MAD lists it */
+} nfcd_read_plan;
+
+typedef enum {
+  NFC_POLL_HARDWARE,    /* the reader polls, until a card shows up */
+  NFC_POLL_SOFTWARE,    /* short selects, spaced by an adaptive interval */
+} nfc_poll_mode;
+
+typedef struct {
+  char    config_file[PATH_MAX];
+  bool    config_file_required;   /* given on the command line */
+
+  int     poll_interval;          /* ms between presence checks */
+  nfc_poll_mode poll_mode;
+  int     poll_min_interval;      /* software polling: ms between probes when busy... */
+  int     poll_max_interval;      /* ...and when idle */
+  int     expire_time;            /* ms, 0 means never expire */
+  int     debounce_time;          /* ms a card may go missing before it is removed */
+  int     reader_max_errors;      /* failed calls in a row before the reader is reopened */
+  int     reader_retry_max;       /* ms, longest wait between two reopen attempts */
+  bool    daemonize;
+  int     debug;
+  int     shutdown_timeout;       /* ms granted to a clean stop */
+
+  nfc_connstring device;          /* empty string: first available device */
+  nfc_modulation modulations[NFCD_MAX_MODULATIONS];
+  size_t  num_modulations;
+
+  char    key_file[PATH_MAX];     /* empty string: built-in dictionary */
+  char    master_key_file[PATH_MAX]; /* empty string: no key derivation */
+  char    acl_file[PATH_MAX];     /* empty string: no access decisions */
+  nfcd_read_plan read_plan;
+  uint8_t sector_order[NFCD_MAX_SECTORS]; /* MIFARE Classic sectors to read first */
+  size_t  num_sector_order;
+  bool    tolerate_failures;      /* keep reading past a failed sector */
+  int     debit_block;            /* MIFARE Classic value block debited once per tap, 0: none */
+  int     debit_amount;
+  int     debit_backup_block;     /* receives a copy of the new balance, 0: none */
+  uint8_t apdu[NFCD_MAX_APDU];    /* sent to ISO14443-4 cards */
+  size_t  apdu_len;               /* 0: activate them only */
+  int     timeout_percentile;     /* command timeouts: latency percentile... */
+  int     timeout_margin;         /* ...plus this many percent... */
+  int     timeout_ceiling;        /* ...capped to this many ms, 0: driver default */
+
+  char    output[PATH_MAX];       /* "-" for stdout, otherwise a file path */
+  char    journal_dir[PATH_MAX];  /* empty string: no journal */
+  int     journal_segment_size;   /* KiB */
+  int     journal_segments;       /* segments kept */
+  int     journal_sync_interval;  /* ms */
+  bool    journal_images;         /* store card images, not only their hash */
+  bool    ubus;                   /* publish the "nfcd" ubus object */
+  char    ring_name[NAME_MAX];    /* shared memory event ring, empty string: none */
+  int     ring_size;              /* records, a power of two */
+  char    metrics_socket[PATH_MAX]; /* empty string: no metrics socket */
+  int     metrics_port;           /* localhost HTTP port, 0: none */
+  char    trace_file[PATH_MAX];   /* written on SIGUSR1, empty string: no tracing */
+  int     trace_buffer;           /* spans kept per thread */
+  char    capture_file[PATH_MAX]; /* empty string: no reader traffic capture */
+  int     capture_max_size;       /* KiB */
+  char    replay_file[PATH_MAX];  /* capture to replay instead of opening a reader */
+} nfcd_conf;
+
+/**
+ * @brief Resolve the configuration from defaults, file and command line
+ * @return 0 on success, 1 if usage was printed and the caller should exit
+ * successfully, -1 on error
+ */
+int     conf_load(nfcd_conf *conf, int argc, char *argv[]);
+
+/**
+ * @brief Re-read the configuration file, keeping command line overrides
+ * @return 0 on success, -1 on error (in which case @a conf is untouched)
+ */
+int     conf_reload(nfcd_conf *conf);
+
+const char *conf_read_plan_name(nfcd_read_plan plan);
+const char *conf_poll_mode_name(nfc_poll_mode mode);
+void    conf_print(const nfcd_conf *conf);
+
+#endif /* __CONF_H__ */
@@ -0,0 +1,469 @@
+/*
+ * NFC Event Daemon
+ * NFC device session handling
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file device.c
+ * @brief Open, configure and reconfigure an NFC device without redundant I/O
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "device.h"
+#include "trace.h"
+#include "capture.h"
+#include "nfc-utils.h"
+#include "debug.h"
+
+#define MAX_DEVICES 8
+
+/* What nfc_initiator_init() leaves configured on the reader */
+static const struct {
+  nfc_property property;
+  bool    bValue;
+} initiator_defaults[] = {
+  { NP_ACTIVATE_FIELD,         true },
+  { NP_INFINITE_SELECT,        true },
+  { NP_AUTO_ISO14443_4,        true },
+  { NP_FORCE_ISO14443_A,       true },
+  { NP_FORCE_SPEED_106,        true },
+  { NP_ACCEPT_INVALID_FRAMES,  false },
+  { NP_ACCEPT_MULTIPLE_FRAMES, false },
+};
+
+/* What the daemon needs: a bounded select, CRC/parity handled by the chip, and ISO14443-4 left to isodep.h */
+static const struct {
+  nfc_property property;
+  bool    bValue;
+} daemon_profile[] = {
+  { NP_INFINITE_SELECT,        false },
+  { NP_HANDLE_CRC,             true },
+  { NP_HANDLE_PARITY,          true },
+  { NP_ACTIVATE_FIELD,         true },
+  { NP_AUTO_ISO14443_4,        false },
+};
+
+/* Each device is only used by the thread that opened it, the table is shared */
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static nfcd_device *devices[MAX_DEVICES];
+
+static long
+elapsed_ms(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static nfcd_device *
+device_lookup(const nfc_device *pnd)
+{
+  nfcd_device *dev = NULL;
+  size_t  i;
+
+  pthread_mutex_lock(&devices_lock);
+  for (i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i] && (devices[i]->pnd == pnd)) {
+      dev = devices[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&devices_lock);
+  return dev;
+}
+
+static void
+device_register(nfcd_device *dev)
+{
+  size_t  i;
+
+  pthread_mutex_lock(&devices_lock);
+  for (i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i] == NULL || devices[i] == dev) {
+      devices[i] = dev;
+      pthread_mutex_unlock(&devices_lock);
+      return;
+    }
+  }
+  pthread_mutex_unlock(&devices_lock);
+  WARN("%s", "Too many devices, property cache disabled");
+}
+
+static void
+device_unregister(nfcd_device *dev)
+{
+  size_t  i;
+
+  pthread_mutex_lock(&devices_lock);
+  for (i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i] == dev)
+      devices[i] = NULL;
+  }
+  pthread_mutex_unlock(&devices_lock);
+}
+
+/**
+ * @brief Account the result of a call for the health of the reader
+ * @param reader_cmd Only the reader is involved, so a timeout means it did not answer
+ */
+static void
+device_health(nfc_device *pnd, int res, bool reader_cmd)
+{
+  nfcd_device *dev = device_lookup(pnd);
+
+  if (dev == NULL)
+    return;
+  switch (res) {
+    case NFC_EIO:
+    case NFC_ENOTSUCHDEV:
+    case NFC_ECHIP:
+    case NFC_ESOFT:
+      dev->uiErrors++;
+      break;
+    case NFC_ETIMEOUT:
+      if (reader_cmd)
+        dev->uiTimeouts++;
+      break;
+    default:
+      if (res >= 0)
+        dev->uiErrors = dev->uiTimeouts = 0;
+      break;
+  }
+}
+
+bool
+nfcd_device_healthy(const nfcd_device *dev, unsigned int limit)
+{
+  return (dev->pnd != NULL) && (dev->uiErrors < limit) && (dev->uiTimeouts < limit);
+}
+
+/* What captures or replays the calls of a device, NULL for nothing */
+static nfcd_capture *
+device_capture(const nfc_device *pnd)
+{
+  nfcd_device *dev = device_lookup(pnd);
+
+  return dev ? dev->pCapture : NULL;
+}
+
+static int
+device_set_property_bool(nfc_device *pnd, const nfc_property property, const bool bEnable)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  const uint8_t abtTx[2] = { property, bEnable };
+  int64_t start;
+  int     res;
+
+  if (replay_active(pc))
+    return replay_call(pc, CAPTURE_PROPERTY, abtTx, sizeof(abtTx), NULL, 0);
+  start = capture_begin(pc);
+  res = nfc_device_set_property_bool(pnd, property, bEnable);
+  capture_record(pc, CAPTURE_PROPERTY, abtTx, sizeof(abtTx), res, NULL, 0, start);
+  return res;
+}
+
+int
+nfcd_device_set_property_bool(nfc_device *pnd, const nfc_property property, const bool bEnable)
+{
+  nfcd_device *dev = device_lookup(pnd);
+  int64_t t;
+  int     res;
+
+  if (dev && (dev->props[property] == (signed char) bEnable)) {
+    dev->uiSkipped++;
+    return NFC_SUCCESS;
+  }
+  t = trace_begin();
+  res = device_set_property_bool(pnd, property, bEnable);
+  trace_end(TRACE_LIBNFC, "nfc_device_set_property_bool", t, res);
+  device_health(pnd, res, true);
+  if (dev == NULL)
+    return res;
+
+  dev->uiWrites++;
+  if (res < 0) {
+    dev->props[property] = -1;
+    return res;
+  }
+  dev->props[property] = bEnable;
+  return res;
+}
+
+int
+nfcd_device_configure(nfcd_device *dev)
+{
+  struct timespec start;
+  size_t  i;
+  int     res;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < sizeof(daemon_profile) / sizeof(daemon_profile[0]); i++) {
+    if ((res = nfcd_device_set_property_bool(dev->pnd, daemon_profile[i].property, daemon_profile[i].bValue)) < 0) {
+      nfcd_device_perror(dev->pnd, "nfc_device_set_property_bool");
+      return res;
+    }
+  }
+  dev->lConfigureTime = elapsed_ms(&start);
+  return NFC_SUCCESS;
+}
+
+int
+nfcd_device_open(nfcd_device *dev, nfc_context *context, const char *connstring)
+{
+  nfcd_capture *pc = dev->pCapture;
+  struct timespec start;
+  int64_t t;
+  size_t  i;
+  int     res;
+
+  memset(dev, 0, sizeof(*dev));
+  dev->pCapture = pc;
+  memset(dev->props, -1, sizeof(dev->props));
+  if (connstring)
+    snprintf(dev->connstring, sizeof(dev->connstring), "%s", connstring);
+
+  if (replay_active(pc)) {
+    // Nothing to open, the capture answers every call; it stands for the device, never handed to libnfc
+    dev->pnd = (nfc_device *) pc;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    t = trace_begin();
+    dev->pnd = nfc_open(context, dev->connstring[0] ? dev->connstring : NULL);
+    trace_end(TRACE_LIBNFC, "nfc_open", t, dev->pnd ? 0 : NFC_ENOTSUCHDEV);
+    dev->lOpenTime = elapsed_ms(&start);
+    if (dev->pnd == NULL)
+      return NFC_ENOTSUCHDEV;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    t = trace_begin();
+    res = nfc_initiator_init(dev->pnd);
+    trace_end(TRACE_LIBNFC, "nfc_initiator_init", t, res);
+    if (res < 0) {
+      nfc_perror(dev->pnd, "nfc_initiator_init");
+      nfc_close(dev->pnd);
+      dev->pnd = NULL;
+      return res;
+    }
+    dev->lInitTime = elapsed_ms(&start);
+  }
+
+  // nfc_initiator_init() already cycled the field and set these
+  for (i = 0; i < sizeof(initiator_defaults) / sizeof(initiator_defaults[0]); i++)
+    dev->props[initiator_defaults[i].property] = initiator_defaults[i].bValue;
+
+  device_register(dev);
+
+  if ((res = nfcd_device_configure(dev)) < 0) {
+    nfcd_device_close(dev);
+    return res;
+  }
+
+  INFO("Device ready in %ld ms (open %ld ms, init %ld ms, configure %ld ms, %u property writes, %u skipped)",
+       dev->lOpenTime + dev->lInitTime + dev->lConfigureTime,
+       dev->lOpenTime, dev->lInitTime, dev->lConfigureTime, dev->uiWrites, dev->uiSkipped);
+  return NFC_SUCCESS;
+}
+
+int
+nfcd_device_reload(nfcd_device *dev, nfc_context *context, const char *connstring)
+{
+  if (connstring == NULL)
+    connstring = "";
+
+  if ((dev->pnd != NULL) && (strcmp(dev->connstring, connstring) == 0)) {
+    // Same reader: keep the session, only re-assert the profile
+    return nfcd_device_configure(dev);
+  }
+
+  INFO("Switching NFC device to %s", connstring[0] ? connstring : "(default)");
+  nfcd_device_close(dev);
+  return nfcd_device_open(dev, context, connstring);
+}
+
+void
+nfcd_device_close(nfcd_device *dev)
+{
+  if (dev->pnd == NULL)
+    return;
+  device_unregister(dev);
+  if (!replay_active(dev->pCapture))
+    nfc_close(dev->pnd);
+  dev->pnd = NULL;
+}
+
+int
+nfcd_device_poll(nfc_device *pnd, const nfc_modulation *pnmModulations, const size_t szModulations,
+                 const uint8_t uiPollNr, const uint8_t uiPeriod, nfc_target *pnt)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  const uint8_t abtTx[2] = { uiPollNr, uiPeriod };
+  int64_t start;
+  int     res;
+
+  if (replay_active(pc))
+    res = replay_call(pc, CAPTURE_POLL, abtTx, sizeof(abtTx), pnt, sizeof(*pnt));
+  else {
+    start = capture_begin(pc);
+    res = nfc_initiator_poll_target(pnd, pnmModulations, szModulations, uiPollNr, uiPeriod, pnt);
+    capture_record(pc, CAPTURE_POLL, abtTx, sizeof(abtTx), res, pnt, (res > 0) ? sizeof(*pnt) : 0, start);
+  }
+  device_health(pnd, res, true);
+  return res;
+}
+
+int
+nfcd_device_select(nfc_device *pnd, const nfc_modulation nm, const uint8_t *pbtInitData, const size_t szInitData,
+                   nfc_target *pnt)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  uint8_t abtTx[2 + 64];
+  const size_t szTx = 2 + ((szInitData < 64) ? szInitData : 64);
+  int64_t start;
+  int     res;
+
+  // The request is the modulation and the initiator data (the UID to select)
+  abtTx[0] = nm.nmt;
+  abtTx[1] = nm.nbr;
+  if (szInitData)
+    memcpy(abtTx + 2, pbtInitData, szTx - 2);
+  if (replay_active(pc))
+    res = replay_call(pc, CAPTURE_SELECT, abtTx, szTx, pnt, pnt ? sizeof(*pnt) : 0);
+  else {
+    start = capture_begin(pc);
+    res = nfc_initiator_select_passive_target(pnd, nm, pbtInitData, szInitData, pnt);
+    capture_record(pc, CAPTURE_SELECT, abtTx, szTx, res, pnt, (pnt && (res > 0)) ? sizeof(*pnt) : 0, start);
+  }
+  device_health(pnd, res, false);
+  return res;
+}
+
+int
+nfcd_device_list(nfc_device *pnd, const nfc_modulation nm, nfc_target ant[], const size_t szTargets)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  const uint8_t abtTx[2] = { nm.nmt, nm.nbr };
+  int64_t start;
+  int     res;
+
+  if (replay_active(pc))
+    res = replay_call(pc, CAPTURE_POLL, abtTx, sizeof(abtTx), ant, szTargets * sizeof(ant[0]));
+  else {
+    start = capture_begin(pc);
+    res = nfc_initiator_list_passive_targets(pnd, nm, ant, szTargets);
+    capture_record(pc, CAPTURE_POLL, abtTx, sizeof(abtTx), res, ant, (res > 0) ? res * sizeof(ant[0]) : 0, start);
+  }
+  device_health(pnd, res, true);
+  return res;
+}
+
+int
+nfcd_device_deselect(nfc_device *pnd)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  int64_t start;
+  int     res;
+
+  if (replay_active(pc))
+    return replay_call(pc, CAPTURE_DESELECT, NULL, 0, NULL, 0);
+  start = capture_begin(pc);
+  res = nfc_initiator_deselect_target(pnd);
+  capture_record(pc, CAPTURE_DESELECT, NULL, 0, res, NULL, 0, start);
+  return res;
+}
+
+int
+nfcd_device_transceive(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx, const size_t szRx,
+                       int timeout)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  int64_t start;
+  int     res;
+
+  if (replay_active(pc))
+    res = replay_call(pc, CAPTURE_TRANSCEIVE, pbtTx, szTx, pbtRx, szRx);
+  else {
+    start = capture_begin(pc);
+    res = nfc_initiator_transceive_bytes(pnd, pbtTx, szTx, pbtRx, szRx, timeout);
+    capture_record(pc, CAPTURE_TRANSCEIVE, pbtTx, szTx, res, pbtRx, (res > 0) ? (size_t) res : 0, start);
+  }
+  device_health(pnd, res, false);
+  return res;
+}
+
+int
+nfcd_device_transceive_bits(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTxBits, uint8_t *pbtRx,
+                            const size_t szRx)
+{
+  nfcd_capture *pc = device_capture(pnd);
+  uint8_t abtTx[1 + 8];
+  const size_t szTx = (szTxBits + 7) / 8;
+  int64_t start;
+  int     res;
+
+  if (szTx > sizeof(abtTx) - 1)
+    return NFC_EINVARG;
+  // The request is the number of bits, then the bits
+  abtTx[0] = szTxBits;
+  memcpy(abtTx + 1, pbtTx, szTx);
+  if (replay_active(pc))
+    res = replay_call(pc, CAPTURE_TRANSCEIVE_BITS, abtTx, 1 + szTx, pbtRx, szRx);
+  else {
+    start = capture_begin(pc);
+    res = nfc_initiator_transceive_bits(pnd, pbtTx, szTxBits, NULL, pbtRx, szRx, NULL);
+    capture_record(pc, CAPTURE_TRANSCEIVE_BITS, abtTx, 1 + szTx, res, pbtRx, (res > 0) ? (size_t) (res + 7) / 8 : 0, start);
+  }
+  device_health(pnd, res, false);
+  return res;
+}
+
+void
+nfcd_device_perror(nfc_device *pnd, const char *pcString)
+{
+  if (replay_active(device_capture(pnd)))
+    ERR("%s: replayed error", pcString);
+  else
+    nfc_perror(pnd, pcString);
+}
+
+const char *
+nfcd_device_get_name(nfc_device *pnd)
+{
+  return replay_active(device_capture(pnd)) ? "capture replay" : nfc_device_get_name(pnd);
+}
+
+int
+nfcd_device_get_supported_baud_rate(nfc_device *pnd, const nfc_modulation_type nmt, const nfc_baud_rate **const supported_br)
+{
+  static const nfc_baud_rate replay_rates[] = { NBR_106, 0 };
+
+  if (replay_active(device_capture(pnd))) {
+    *supported_br = replay_rates;
+    return NFC_SUCCESS;
+  }
+  return nfc_device_get_supported_baud_rate(pnd, nmt, supported_br);
+}
@@ -0,0 +1,110 @@
+/*
+ * NFC Event Daemon
+ * NFC device session handling
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file device.h
+ * @brief Open, configure and reconfigure an NFC device without redundant I/O
+ *
+ * Every nfc_device_set_property_bool() is a round trip to the reader.  The
+ * device layer remembers the last value written for each property (and the
+ * defaults nfc_initiator_init() leaves behind) so that a property is only
+ * sent when its value actually changes.
+ */
+
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include <stdbool.h>
+
+#include <nfc/nfc.h>
+
+#define NFCD_NUM_PROPERTIES (NP_FORCE_SPEED_106 + 1)
+
+typedef struct {
+  nfc_device *pnd;
+  nfc_connstring connstring;        /* as requested, empty for default */
+  signed char props[NFCD_NUM_PROPERTIES]; /* -1: unknown, otherwise last value written */
+  unsigned int uiWrites;            /* property writes sent to the reader */
+  unsigned int uiSkipped;           /* property writes avoided */
+  long    lOpenTime;                /* ms spent in nfc_open() */
+  long    lInitTime;                /* ms spent in nfc_initiator_init() */
+  long    lConfigureTime;           /* ms spent applying the property profile */
+  unsigned int uiErrors;            /* reader errors in a row */
+  unsigned int uiTimeouts;          /* reader timeouts in a row */
+  struct nfcd_capture *pCapture;    /* captures or replays its calls (capture.h), NULL for none; kept by nfcd_device_open() */
+} nfcd_device;
+
+/**
+ * @brief Open, initialise and configure a device as initiator
+ * @return 0 on success, a libnfc error code otherwise
+ */
+int     nfcd_device_open(nfcd_device *dev, nfc_context *context, const char *connstring);
+
+/**
+ * @brief Apply the daemon property profile, only sending what changed
+ */
+int     nfcd_device_configure(nfcd_device *dev);
+
+/**
+ * @brief Reconfigure in place; the device is only reopened if @a connstring changed
+ */
+int     nfcd_device_reload(nfcd_device *dev, nfc_context *context, const char *connstring);
+
+void    nfcd_device_close(nfcd_device *dev);
+
+/**
+ * @brief Whether the reader still answers: fewer than @a limit errors, or
+ * timeouts of reader commands, in a row
+ *
+ * Any call that went through resets the counts; card level failures (a
+ * card that left, an authentication refused) do not count.
+ */
+bool    nfcd_device_healthy(const nfcd_device *dev, unsigned int limit);
+
+/**
+ * @brief Cached nfc_device_set_property_bool() for any opened device
+ *
+ * Devices that were not opened through nfcd_device_open() are passed
+ * straight to libnfc.
+ */
+int     nfcd_device_set_property_bool(nfc_device *pnd, const nfc_property property, const bool bEnable);
+
+/*
+ * The libnfc calls the daemon makes on a device, captured or replayed by its
+ * pCapture; same arguments and results as their libnfc counterparts.
+ */
+int     nfcd_device_poll(nfc_device *pnd, const nfc_modulation *pnmModulations, const size_t szModulations,
+                         const uint8_t uiPollNr, const uint8_t uiPeriod, nfc_target *pnt);
+int     nfcd_device_select(nfc_device *pnd, const nfc_modulation nm, const uint8_t *pbtInitData,
+                           const size_t szInitData, nfc_target *pnt);
+int     nfcd_device_deselect(nfc_device *pnd);
+/* Every card of a modulation in the field, captured as a poll */
+int     nfcd_device_list(nfc_device *pnd, const nfc_modulation nm, nfc_target ant[], const size_t szTargets);
+int     nfcd_device_transceive(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx,
+                               const size_t szRx, int timeout);
+/* Short frames only, such as WUPA: up to 64 bits, without parity bits */
+int     nfcd_device_transceive_bits(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTxBits, uint8_t *pbtRx,
+                                    const size_t szRx);
+void    nfcd_device_perror(nfc_device *pnd, const char *pcString);
+const char *nfcd_device_get_name(nfc_device *pnd);
+/* Not captured: a replay only knows of 106 kbps */
+int     nfcd_device_get_supported_baud_rate(nfc_device *pnd, const nfc_modulation_type nmt,
+                                            const nfc_baud_rate **const supported_br);
+
+#endif /* __DEVICE_H__ */
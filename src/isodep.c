@@ -0,0 +1,328 @@
+/*
+ * NFC Event Daemon
+ * ISO14443-4 block transmission protocol
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file isodep.c
+ * @brief APDUs to ISO14443-4 type A cards (DESFire, smart cards), over raw frames
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include "isodep.h"
+#include "device.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define RATS 0xe0
+#define FSDI 8                    /* ISODEP_MAX_FRAME */
+
+/* Protocol control byte: I-blocks and R(ACK) carry a block number in bit 0 */
+#define PCB_I 0x02
+#define PCB_R_ACK 0xa2
+#define PCB_R_NAK 0xb2
+#define PCB_S_DESELECT 0xc2
+#define PCB_S_WTX 0xf2
+#define PCB_CHAIN 0x10
+#define PCB_BLOCK 0x01
+
+/* Without CID nor NAD, which we never ask for */
+#define IS_I_BLOCK(pcb) (((pcb) & 0xee) == PCB_I)
+#define IS_R_ACK(pcb) (((pcb) & 0xfe) == PCB_R_ACK)
+
+/* Format byte T0 of the ATS: which interface bytes follow, and FSCI */
+#define ATS_TA 0x10
+#define ATS_TB 0x20
+#define ATS_TC 0x40
+#define ATS_FSCI 0x0f
+
+#define FSCI_DEFAULT 2
+#define FWI_DEFAULT 4
+#define FWT_ACTIVATION 4833       /* us, 65536/fc for the ATS */
+#define FWT_DELTA 3625            /* us, 49152/fc the card may add */
+#define LINK_MARGIN 10            /* ms, host to reader and back */
+#define MAX_WTXM 59
+#define MAX_RETRIES 2
+
+/**
+ * @brief 256 * 16 / fc * 2^fwi, in us
+ */
+static int
+frame_wait_time(uint8_t fwi)
+{
+  return (int) (((int64_t) 4096 << fwi) * 1000 / 13560);
+}
+
+size_t
+isodep_frame_size(uint8_t fsci)
+{
+  static const uint16_t sizes[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+
+  // The larger ones of ISO14443-4:2016 are not used
+  return (fsci < sizeof(sizes) / sizeof(sizes[0])) ? sizes[fsci] : ISODEP_MAX_FRAME;
+}
+
+/**
+ * @brief Send a frame and receive the card's, waiting up to @a fwt us for it
+ */
+static int
+isodep_transceive(isodep_session *s, const uint8_t *tx, size_t tx_len, uint8_t *rx, int fwt)
+{
+  const int64_t start = latency_start();
+  const int64_t t = trace_begin();
+  int     res;
+
+  res = nfcd_device_transceive(s->pnd, tx, tx_len, rx, ISODEP_MAX_FRAME, (fwt + FWT_DELTA + 999) / 1000 + LINK_MARGIN);
+  trace_end(TRACE_LIBNFC, "nfc_initiator_transceive_bytes: block", t, res);
+  metrics_command(LAT_CMD_BLOCK, start, res > 0);
+  return res;
+}
+
+/**
+ * @brief An I-block of the current block number, or an R(ACK), within FSD
+ */
+static bool
+isodep_valid(const isodep_session *s, const uint8_t *rx, int res)
+{
+  if ((res < 1) || ((size_t) res > s->fsd - 2))
+    return false;
+  if (IS_I_BLOCK(rx[0]))
+    return (rx[0] & PCB_BLOCK) == s->block;
+  return IS_R_ACK(rx[0]);
+}
+
+/**
+ * @brief Send @a block, and return the card's answer to it
+ *
+ * Waiting time extensions are granted on the way.  A timeout or an invalid
+ * block is met with R(NAK), or with our R(ACK) again while the card chains,
+ * and an R(ACK) of the other block number asks for the block again.
+ *
+ * @return Length of the answer in @a rx, a libnfc error code otherwise
+ */
+static int
+isodep_transmit(isodep_session *s, const uint8_t *block, size_t len, uint8_t *rx)
+{
+  const uint8_t nak = PCB_R_NAK | s->block;
+  const uint8_t *tx = block;
+  size_t  tx_len = len;
+  uint8_t wtx[2];
+  unsigned int retries = 0;
+  int     fwt = s->fwt;
+  int     res;
+
+  for (;;) {
+    res = isodep_transceive(s, tx, tx_len, rx, fwt);
+    fwt = s->fwt;
+    if ((res == 2) && (rx[0] == PCB_S_WTX) && ((rx[1] & 0x3f) >= 1) && ((rx[1] & 0x3f) <= MAX_WTXM)) {
+      // Granted by sending it back; it holds for the next answer only
+      wtx[0] = PCB_S_WTX;
+      wtx[1] = rx[1] & 0x3f;
+      fwt = s->fwt * wtx[1];
+      tx = wtx;
+      tx_len = sizeof(wtx);
+      s->wtx++;
+      continue;
+    }
+    if (isodep_valid(s, rx, res)) {
+      if (!IS_R_ACK(rx[0]) || ((rx[0] & PCB_BLOCK) == s->block))
+        return res;
+      // The card acknowledges the block before ours: ours was lost
+      tx = block;
+    } else if ((res < 0) && (res != NFC_ETIMEOUT) && (res != NFC_ERFTRANS)) {
+      // The reader failed, not the card
+      return res;
+    } else {
+      tx = IS_R_ACK(block[0]) ? block : &nak;
+    }
+    if (++retries > MAX_RETRIES)
+      return (res < 0) ? res : NFC_ERFTRANS;
+    s->retries++;
+    tx_len = (tx == block) ? len : 1;
+  }
+}
+
+int
+isodep_activate(isodep_session *s, nfc_device *pnd, const nfc_target *pnt)
+{
+  static const struct {
+    nfc_baud_rate nbr;
+    uint8_t ta;                   /* DS and DR bits, both ways at that rate */
+  } ta_rates[] = {
+    { NBR_847, 0x44 },
+    { NBR_424, 0x22 },
+    { NBR_212, 0x11 },
+  };
+  const nfc_modulation nm = { .nmt = NMT_ISO14443A, .nbr = NBR_106 };
+  const uint8_t rats[2] = { RATS, FSDI << 4 };
+  const nfc_baud_rate *rates;
+  uint8_t t0 = FSCI_DEFAULT, ta = 0, tb = FWI_DEFAULT << 4;
+  uint8_t fwi, sfgi;
+  size_t  pos = 2, i, j;
+  int64_t start, t;
+  int     res;
+
+  memset(s, 0, sizeof(*s));
+  s->pnd = pnd;
+  s->fsd = ISODEP_MAX_FRAME;
+  s->rate = s->rate_max = NBR_106;
+
+  // Whatever state the last read left it in
+  t = trace_begin();
+  res = nfcd_device_select(pnd, nm, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen, NULL);
+  trace_end(TRACE_LIBNFC, "nfc_initiator_select_passive_target", t, res);
+  if (res <= 0)
+    return (res < 0) ? res : NFC_ETGRELEASED;
+  if ((res = nfcd_device_set_property_bool(pnd, NP_EASY_FRAMING, false)) < 0)
+    return res;
+
+  start = latency_start();
+  t = trace_begin();
+  res = nfcd_device_transceive(pnd, rats, sizeof(rats), s->ats, sizeof(s->ats), (FWT_ACTIVATION + FWT_DELTA + 999) / 1000 + LINK_MARGIN);
+  trace_end(TRACE_LIBNFC, "nfc_initiator_transceive_bytes: rats", t, res);
+  metrics_command(LAT_CMD_RATS, start, res > 0);
+  if (res < 0)
+    return res;
+  // TL counts itself
+  if ((res == 0) || (s->ats[0] != res))
+    return NFC_ERFTRANS;
+  s->ats_len = res;
+
+  if (s->ats_len > 1) {
+    t0 = s->ats[1];
+    if ((size_t) (2 + !!(t0 & ATS_TA) + !!(t0 & ATS_TB) + !!(t0 & ATS_TC)) > s->ats_len)
+      return NFC_ERFTRANS;
+    if (t0 & ATS_TA)
+      ta = s->ats[pos++];
+    if (t0 & ATS_TB)
+      tb = s->ats[pos++];
+  }
+  s->fsc = isodep_frame_size(t0 & ATS_FSCI);
+  fwi = tb >> 4;
+  sfgi = tb & 0x0f;
+  s->fwt = frame_wait_time((fwi == 15) ? FWI_DEFAULT : fwi);
+  s->sfgt = ((sfgi == 0) || (sfgi == 15)) ? 0 : frame_wait_time(sfgi);
+
+  // Highest rate the card takes both ways that the reader has too
+  if (nfcd_device_get_supported_baud_rate(pnd, NMT_ISO14443A, &rates) == NFC_SUCCESS) {
+    for (i = 0; (i < sizeof(ta_rates) / sizeof(ta_rates[0])) && (s->rate_max == NBR_106); i++) {
+      if ((ta & ta_rates[i].ta) != ta_rates[i].ta)
+        continue;
+      for (j = 0; rates[j]; j++) {
+        if (rates[j] == ta_rates[i].nbr)
+          s->rate_max = rates[j];
+      }
+    }
+  }
+
+  if (s->sfgt)
+    usleep(s->sfgt);
+  return NFC_SUCCESS;
+}
+
+int
+isodep_exchange(isodep_session *s, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_size)
+{
+  const size_t inf_max = s->fsc - 3;    /* PCB and CRC */
+  uint8_t block[ISODEP_MAX_FRAME], resp[ISODEP_MAX_FRAME];
+  size_t  sent = 0, got = 0, len;
+  int     res;
+
+  // The command, chained over frames of up to FSC
+  do {
+    len = (tx_len - sent < inf_max) ? tx_len - sent : inf_max;
+    block[0] = PCB_I | s->block | ((sent + len < tx_len) ? PCB_CHAIN : 0);
+    memcpy(block + 1, tx + sent, len);
+    if ((res = isodep_transmit(s, block, len + 1, resp)) < 0)
+      return res;
+    s->blocks++;
+    sent += len;
+    if (block[0] & PCB_CHAIN) {
+      if (!IS_R_ACK(resp[0]))
+        return NFC_ERFTRANS;
+      s->block ^= PCB_BLOCK;
+    }
+  } while (sent < tx_len);
+
+  // The response, chained the other way: each block acknowledged asks for the next
+  for (;;) {
+    if (!IS_I_BLOCK(resp[0]))
+      return NFC_ERFTRANS;
+    s->blocks++;
+    s->block ^= PCB_BLOCK;
+    len = res - 1;
+    if (len > rx_size - got)
+      return NFC_EOVFLOW;
+    memcpy(rx + got, resp + 1, len);
+    got += len;
+    if (!(resp[0] & PCB_CHAIN))
+      return got;
+    block[0] = PCB_R_ACK | s->block;
+    if ((res = isodep_transmit(s, block, 1, resp)) < 0)
+      return res;
+  }
+}
+
+int
+isodep_apdu(isodep_session *s, const uint8_t *apdu, size_t apdu_len, uint8_t *rx, size_t rx_size)
+{
+  uint8_t get_response[5] = { 0x00, 0xc0, 0x00, 0x00, 0x00 };
+  size_t  got = 0;
+  int     res;
+
+  res = isodep_exchange(s, apdu, apdu_len, rx, rx_size);
+  for (;;) {
+    if (res < 0)
+      return res;
+    if (res < 2)
+      return NFC_ERFTRANS;
+    got += res;
+    if (rx[got - 2] != 0x61)
+      return got;
+    // Another 61xx without data would never end
+    if ((res == 2) && (got > 2))
+      return NFC_ERFTRANS;
+    // 61xx: xx more bytes (0: 256 or more) waiting, on the same logical channel
+    got -= 2;
+    get_response[0] = (apdu_len > 0) ? (apdu[0] & 0x03) : 0x00;
+    get_response[4] = rx[got + 1];
+    res = isodep_exchange(s, get_response, sizeof(get_response), rx + got, rx_size - got);
+  }
+}
+
+int
+isodep_deselect(isodep_session *s)
+{
+  const uint8_t deselect = PCB_S_DESELECT;
+  uint8_t rx[ISODEP_MAX_FRAME];
+  int     res;
+
+  if ((res = isodep_transceive(s, &deselect, 1, rx, s->fwt)) < 0)
+    return res;
+  return ((res == 1) && (rx[0] == PCB_S_DESELECT)) ? NFC_SUCCESS : NFC_ERFTRANS;
+}
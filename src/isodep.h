@@ -0,0 +1,103 @@
+/*
+ * NFC Event Daemon
+ * ISO14443-4 block transmission protocol
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file isodep.h
+ * @brief APDUs to ISO14443-4 type A cards (DESFire, smart cards), over raw frames
+ *
+ * The reader's own ISO14443-4 handling (NP_AUTO_ISO14443_4) picks a small
+ * frame size and hides the chaining; here the daemon runs the protocol
+ * itself on nfcd_device_transceive(), with easy framing off and the CRC
+ * left to the chip.
+ *
+ * isodep_activate() selects the card and sends RATS asking for the largest
+ * frame the daemon accepts (FSD 256), then takes from the ATS the largest
+ * frame the card accepts (FSC), its frame waiting time and the bit rates it
+ * supports.  isodep_exchange() sends a command as I-blocks of up to FSC
+ * bytes, chaining as needed, and collects the chained response; waiting
+ * time extensions are granted, and a lost or garbled block is recovered
+ * with R(NAK)/R(ACK) as ISO14443-4 prescribes.  isodep_apdu() also fetches
+ * the rest of a response announced by a 61xx status word.
+ *
+ * The link stays at 106 kbps: libnfc has no call to switch the reader to
+ * the rate a PPS would agree on, and a card switched alone stops answering.
+ * The highest rate both would support is kept in rate_max, for the record.
+ *
+ * CID and NAD are not used, only one card is active at a time.
+ */
+
+#ifndef __ISODEP_H__
+#define __ISODEP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nfc/nfc-types.h>
+
+#define ISODEP_MAX_FRAME 256      /* FSD asked for: FSDI 8, the largest before the ISO14443-4:2016 ones */
+
+typedef struct {
+  nfc_device *pnd;
+  uint8_t ats[254];
+  size_t  ats_len;
+  size_t  fsc;                    /* largest frame the card accepts, CRC included */
+  size_t  fsd;                    /* largest frame it may send us */
+  int     fwt;                    /* us the card may take to answer */
+  int     sfgt;                   /* us it needs after the ATS */
+  nfc_baud_rate rate;             /* of the link */
+  nfc_baud_rate rate_max;         /* highest one card and reader both support */
+  uint8_t block;                  /* our block number */
+  unsigned int blocks;            /* I-blocks exchanged, both ways */
+  unsigned int wtx;               /* waiting time extensions granted */
+  unsigned int retries;           /* blocks sent again */
+} isodep_session;
+
+/**
+ * @brief Select @a pnt and bring it to ISO14443-4
+ * @return 0 on success, a libnfc error code otherwise (NFC_ETIMEOUT if it
+ * does not answer RATS)
+ */
+int     isodep_activate(isodep_session *s, nfc_device *pnd, const nfc_target *pnt);
+
+/**
+ * @brief Send @a tx, chained over as many I-blocks as it takes, and receive the response
+ * @return Length of the response in @a rx, or a libnfc error code
+ * (NFC_EOVFLOW if it does not fit in @a rx_size bytes)
+ */
+int     isodep_exchange(isodep_session *s, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_size);
+
+/**
+ * @brief Send an APDU, and GET RESPONSE the rest of its response while the status says 61xx
+ * @return Length of the response, status word included, or a libnfc error code
+ */
+int     isodep_apdu(isodep_session *s, const uint8_t *apdu, size_t apdu_len, uint8_t *rx, size_t rx_size);
+
+/**
+ * @brief Send S(DESELECT): the card halts
+ * @return 0 on success, a libnfc error code otherwise
+ */
+int     isodep_deselect(isodep_session *s);
+
+/**
+ * @brief Frame size of the ATS frame size code @a fsci (or of an FSDI)
+ */
+size_t  isodep_frame_size(uint8_t fsci);
+
+#endif /* __ISODEP_H__ */
@@ -0,0 +1,1014 @@
+/*
+ * NFC Event Daemon
+ * Event journal
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file journal.c
+ * @brief Append-only journal of tag events, kept on disk in segment files
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <nfc/nfc.h>
+
+#include "journal.h"
+#include "state.h"
+#include "nfc-utils.h"
+#include "debug.h"
+#include "metrics.h"
+
+#define JOURNAL_MAGIC "NFCDJRN"
+#define JOURNAL_VERSION 1
+#define SEGMENT_HEADER_SIZE 64
+#define RECORD_HEADER_SIZE 32
+#define RECORD_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+#define IMAGE_BASES 32
+
+typedef struct {
+  char    magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t segment_size;
+  uint64_t first_seq;
+  int64_t created;              /* seconds since the epoch */
+  uint8_t reserved[24];
+} segment_header;
+
+typedef struct {
+  uint8_t szUidLen;
+  uint8_t abtUid[10];
+  uint64_t seq;                 /* record holding the base image, 0 if none */
+  uint64_t used;                /* for the LRU replacement */
+  size_t  len;
+  uint8_t *image;
+} image_base;
+
+typedef struct {
+  uint32_t size;
+  uint32_t crc;
+  uint64_t seq;
+  int64_t time;
+  uint16_t type;
+  uint16_t slot;
+  uint32_t len;
+} record_header;
+
+/* Writer side, everything below is protected by journal_lock */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher_thread;
+static bool journal_running = false;     /* records are accepted */
+static bool journal_stopping = false;
+static bool flusher_started = false;
+
+static char jdir[PATH_MAX];
+static size_t seg_size;
+static int seg_keep;
+static int sync_interval;
+static bool store_images;
+
+static int seg_fd = -1;
+static uint8_t *seg_map = NULL;
+static size_t seg_off;
+static uint64_t seg_first;          /* first sequence number of the open segment */
+static uint64_t next_seq;
+static size_t dirty_lo, dirty_hi;   /* range written since the last msync */
+
+static const char *type_names[] = {
+  [JOURNAL_TAG_INSERTED] = "inserted",
+  [JOURNAL_TAG_REMOVED]  = "removed",
+  [JOURNAL_TAG_IMAGE]    = "image",
+  [JOURNAL_TAG_EXPIRED]  = "expired",
+  [JOURNAL_TAG_VERDICT]  = "verdict",
+  [JOURNAL_READER_DOWN]  = "reader_down",
+  [JOURNAL_READER_UP]    = "reader_up",
+};
+
+static const char *format_names[] = {
+  [JOURNAL_IMAGE_HASH]  = "hash",
+  [JOURNAL_IMAGE_FULL]  = "full",
+  [JOURNAL_IMAGE_DELTA] = "delta",
+};
+
+/* Tag currently in each state slot, and the last base image of each UID */
+static journal_tag current_tag[NFCD_MAX_SLOTS];
+static image_base bases[IMAGE_BASES];
+static uint64_t bases_clock;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_init(void)
+{
+  uint32_t c, n, k;
+
+  for (n = 0; n < 256; n++) {
+    c = n;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc_table[n] = c;
+  }
+}
+
+static uint32_t
+crc32(const uint8_t *p, size_t len)
+{
+  uint32_t c = 0xffffffff;
+
+  pthread_once(&crc_once, crc_init);
+  while (len--)
+    c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffff;
+}
+
+static void
+segment_path(char *path, size_t size, const char *dir, uint64_t first_seq)
+{
+  snprintf(path, size, "%s/%016llx.jrn", dir, (unsigned long long) first_seq);
+}
+
+static int
+segment_filter(const struct dirent *d)
+{
+  size_t  i;
+
+  if (strlen(d->d_name) != 20 || strcmp(d->d_name + 16, ".jrn"))
+    return 0;
+  for (i = 0; i < 16; i++) {
+    if (!strchr("0123456789abcdef", d->d_name[i]))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief First sequence numbers of the segments in @a dir, oldest first
+ * @return Number of segments, -1 on error; *pseqs must be freed
+ */
+static int
+list_segments(const char *dir, uint64_t **pseqs)
+{
+  struct dirent **names;
+  int     n, i;
+
+  if ((n = scandir(dir, &names, segment_filter, alphasort)) < 0)
+    return -1;
+  *pseqs = malloc((n ? n : 1) * sizeof(uint64_t));
+  for (i = 0; i < n; i++) {
+    if (*pseqs)
+      (*pseqs)[i] = strtoull(names[i]->d_name, NULL, 16);
+    free(names[i]);
+  }
+  free(names);
+  return *pseqs ? n : -1;
+}
+
+static bool
+segment_header_valid(const segment_header *sh, size_t map_size)
+{
+  return !memcmp(sh->magic, JOURNAL_MAGIC, 8) && (sh->version == JOURNAL_VERSION) &&
+         (sh->header_size == SEGMENT_HEADER_SIZE) && (sh->segment_size == map_size);
+}
+
+/**
+ * @brief Check the record at @a off of a mapped segment
+ * @return Its size, or 0 if there is no valid record with sequence @a seq there
+ */
+static size_t
+record_check(const uint8_t *map, size_t map_size, size_t off, uint64_t seq)
+{
+  const record_header *rh = (const record_header *)(map + off);
+  uint32_t size;
+
+  if (off + RECORD_HEADER_SIZE > map_size)
+    return 0;
+  size = __atomic_load_n(&rh->size, __ATOMIC_ACQUIRE);
+  if ((size < RECORD_HEADER_SIZE) || (size % 8) || (size > map_size - off) ||
+      (rh->len > size - RECORD_HEADER_SIZE) || (rh->seq != seq))
+    return 0;
+  if (crc32(map + off + 8, RECORD_HEADER_SIZE - 8 + rh->len) != rh->crc)
+    return 0;
+  return size;
+}
+
+static int
+sync_dir(const char *dir)
+{
+  int     fd, res;
+
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return -1;
+  res = fsync(fd);
+  close(fd);
+  return res;
+}
+
+/* Must be called with journal_lock held */
+static void
+segment_sync(void)
+{
+  long    page = sysconf(_SC_PAGESIZE);
+  size_t  lo;
+
+  if (!seg_map || (dirty_hi <= dirty_lo))
+    return;
+  lo = dirty_lo & ~(size_t)(page - 1);
+  if (msync(seg_map + lo, dirty_hi - lo, MS_SYNC) < 0)
+    ERR("Unable to sync journal: %s", strerror(errno));
+  dirty_lo = dirty_hi = 0;
+}
+
+/* Must be called with journal_lock held */
+static void
+segment_unmap(void)
+{
+  segment_sync();
+  if (seg_map)
+    munmap(seg_map, seg_size);
+  if (seg_fd >= 0)
+    close(seg_fd);
+  seg_map = NULL;
+  seg_fd = -1;
+}
+
+static int
+segment_map(int fd)
+{
+  void   *map = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED) {
+    ERR("Unable to map journal segment: %s", strerror(errno));
+    return -1;
+  }
+  seg_map = map;
+  seg_fd = fd;
+  dirty_lo = dirty_hi = 0;
+  return 0;
+}
+
+/* Must be called with journal_lock held */
+static void
+segments_expire(void)
+{
+  uint64_t *seqs;
+  char    path[PATH_MAX];
+  int     n, i;
+
+  if ((n = list_segments(jdir, &seqs)) < 0)
+    return;
+  for (i = 0; i < n - seg_keep; i++) {
+    segment_path(path, sizeof(path), jdir, seqs[i]);
+    if (unlink(path) < 0)
+      ERR("Unable to delete journal segment %s: %s", path, strerror(errno));
+  }
+  free(seqs);
+}
+
+/**
+ * @brief Create, preallocate and map a new segment starting at @a first_seq
+ *
+ * Must be called with journal_lock held.
+ */
+static int
+segment_create(uint64_t first_seq)
+{
+  char    path[PATH_MAX];
+  segment_header *sh;
+  int     fd, res;
+
+  segment_path(path, sizeof(path), jdir, first_seq);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) < 0) {
+    ERR("Unable to create journal segment %s: %s", path, strerror(errno));
+    return -1;
+  }
+  // Allocate every block now: no metadata update, and no SIGBUS on a full disk, later
+  if ((res = posix_fallocate(fd, 0, seg_size)) != 0) {
+    ERR("Unable to allocate journal segment %s: %s", path, strerror(res));
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  if (segment_map(fd) < 0) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  sh = (segment_header *) seg_map;
+  memset(sh, 0, sizeof(*sh));
+  memcpy(sh->magic, JOURNAL_MAGIC, 8);
+  sh->version = JOURNAL_VERSION;
+  sh->header_size = SEGMENT_HEADER_SIZE;
+  sh->segment_size = seg_size;
+  sh->first_seq = first_seq;
+  sh->created = time(NULL);
+  msync(seg_map, SEGMENT_HEADER_SIZE, MS_SYNC);
+  sync_dir(jdir);
+
+  seg_off = SEGMENT_HEADER_SIZE;
+  seg_first = next_seq = first_seq;
+  segments_expire();
+  return 0;
+}
+
+/**
+ * @brief Reopen the newest segment and find where appending resumes
+ *
+ * Must be called with journal_lock held.
+ */
+static int
+segment_recover(uint64_t first_seq)
+{
+  char    path[PATH_MAX];
+  struct stat st;
+  segment_header *sh;
+  size_t  size;
+  int     fd;
+
+  segment_path(path, sizeof(path), jdir, first_seq);
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+    ERR("Unable to open journal segment %s: %s", path, strerror(errno));
+    return -1;
+  }
+  if ((fstat(fd, &st) < 0) || ((size_t) st.st_size != seg_size)) {
+    // Written with another segment size: leave it as is and start a new one
+    close(fd);
+    return 1;
+  }
+  if (segment_map(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+  sh = (segment_header *) seg_map;
+  if (!segment_header_valid(sh, seg_size) || (sh->first_seq != first_seq)) {
+    // Crashed before the header was synced, so it holds no record
+    segment_unmap();
+    unlink(path);
+    return segment_create(first_seq);
+  }
+
+  seg_off = SEGMENT_HEADER_SIZE;
+  seg_first = next_seq = first_seq;
+  while ((size = record_check(seg_map, seg_size, seg_off, next_seq)) > 0) {
+    seg_off += size;
+    next_seq++;
+  }
+  return 0;
+}
+
+/**
+ * @brief Forget the base images, the next image of every UID is stored in full
+ *
+ * Must be called with journal_lock held.
+ */
+static void
+image_bases_reset(void)
+{
+  int     i;
+
+  for (i = 0; i < IMAGE_BASES; i++) {
+    free(bases[i].image);
+    memset(&bases[i], 0, sizeof(bases[i]));
+  }
+  memset(current_tag, 0, sizeof(current_tag));
+}
+
+static void *
+flusher(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&journal_lock);
+  while (!journal_stopping) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += sync_interval / 1000;
+    ts.tv_nsec += (long)(sync_interval % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&journal_cond, &journal_lock, &ts);
+    segment_sync();
+  }
+  pthread_mutex_unlock(&journal_lock);
+  return NULL;
+}
+
+int
+journal_open(const char *dir, size_t segment_size, int segments, int interval, bool images)
+{
+  uint64_t *seqs;
+  int     n, res = 0;
+
+  journal_close();
+  if ((mkdir(dir, 0750) < 0) && (errno != EEXIST)) {
+    ERR("Unable to create journal directory %s: %s", dir, strerror(errno));
+    return -1;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  snprintf(jdir, sizeof(jdir), "%s", dir);
+  seg_size = RECORD_ALIGN(segment_size);
+  seg_keep = segments;
+  sync_interval = interval;
+  store_images = images;
+  image_bases_reset();
+
+  if ((n = list_segments(jdir, &seqs)) < 0) {
+    ERR("Unable to list journal directory %s: %s", jdir, strerror(errno));
+    pthread_mutex_unlock(&journal_lock);
+    return -1;
+  }
+  if (n == 0) {
+    res = segment_create(1);
+  } else if ((res = segment_recover(seqs[n - 1])) > 0) {
+    // Skip over the records of the segment we could not reopen
+    journal_cursor jc;
+    journal_record jr;
+    uint64_t seq = seqs[n - 1];
+
+    pthread_mutex_unlock(&journal_lock);
+    if (journal_cursor_open(&jc, dir, seq) == 0) {
+      while (journal_cursor_next(&jc, &jr) > 0)
+        seq = jr.seq + 1;
+      journal_cursor_close(&jc);
+    }
+    pthread_mutex_lock(&journal_lock);
+    res = segment_create(seq);
+  }
+  free(seqs);
+  if (res < 0) {
+    pthread_mutex_unlock(&journal_lock);
+    return -1;
+  }
+
+  journal_stopping = false;
+  if ((res = pthread_create(&flusher_thread, NULL, flusher, NULL)) != 0) {
+    ERR("pthread_create: %s", strerror(res));
+    segment_unmap();
+    pthread_mutex_unlock(&journal_lock);
+    return -1;
+  }
+  flusher_started = true;
+  journal_running = true;
+  INFO("Journal %s opened, next record %llu", jdir, (unsigned long long) next_seq);
+  pthread_mutex_unlock(&journal_lock);
+  return 0;
+}
+
+void
+journal_close(void)
+{
+  pthread_mutex_lock(&journal_lock);
+  if (!flusher_started) {
+    pthread_mutex_unlock(&journal_lock);
+    return;
+  }
+  journal_running = false;
+  journal_stopping = true;
+  pthread_cond_signal(&journal_cond);
+  pthread_mutex_unlock(&journal_lock);
+
+  pthread_join(flusher_thread, NULL);
+
+  pthread_mutex_lock(&journal_lock);
+  segment_unmap();
+  image_bases_reset();
+  flusher_started = false;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+long
+journal_unsynced_bytes(void)
+{
+  long    n;
+
+  pthread_mutex_lock(&journal_lock);
+  n = dirty_hi - dirty_lo;
+  pthread_mutex_unlock(&journal_lock);
+  return n;
+}
+
+bool
+journal_get_dir(char *dir, size_t size)
+{
+  bool    running;
+
+  pthread_mutex_lock(&journal_lock);
+  running = journal_running;
+  if (running)
+    snprintf(dir, size, "%s", jdir);
+  pthread_mutex_unlock(&journal_lock);
+  return running;
+}
+
+/**
+ * @brief Append a record made of up to two payload parts
+ *
+ * Must be called with journal_lock held.
+ * @return Sequence number of the record, 0 if it was not written
+ */
+static uint64_t
+journal_append_locked(journal_record_type type, int slot, const void *p1, size_t len1, const void *p2, size_t len2)
+{
+  const size_t size = RECORD_ALIGN(RECORD_HEADER_SIZE + len1 + len2);
+  struct timespec ts;
+  record_header *rh;
+
+  if (!journal_running) {
+    // Opened, then disabled by a write error
+    if (flusher_started)
+      metrics_inc(METRIC_DROPPED_JOURNAL);
+    return 0;
+  }
+  if (size > seg_size - SEGMENT_HEADER_SIZE) {
+    ERR("Journal record of %zu bytes does not fit in a segment", size);
+    metrics_inc(METRIC_DROPPED_JOURNAL);
+    return 0;
+  }
+  if (seg_off + size > seg_size) {
+    segment_unmap();
+    if (segment_create(next_seq) < 0) {
+      ERR("%s", "Journal disabled");
+      journal_running = false;
+      journal_stopping = true;
+      pthread_cond_signal(&journal_cond);
+      metrics_inc(METRIC_DROPPED_JOURNAL);
+      return 0;
+    }
+  }
+
+  rh = (record_header *)(seg_map + seg_off);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rh->seq = next_seq;
+  rh->time = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  rh->type = type;
+  rh->slot = slot;
+  rh->len = len1 + len2;
+  if (len1)
+    memcpy(seg_map + seg_off + RECORD_HEADER_SIZE, p1, len1);
+  if (len2)
+    memcpy(seg_map + seg_off + RECORD_HEADER_SIZE + len1, p2, len2);
+  rh->crc = crc32(seg_map + seg_off + 8, RECORD_HEADER_SIZE - 8 + rh->len);
+  // Publish the record: readers only trust what the size covers
+  __atomic_store_n(&rh->size, (uint32_t) size, __ATOMIC_RELEASE);
+
+  if (dirty_hi == 0)
+    dirty_lo = seg_off;
+  seg_off += size;
+  dirty_hi = seg_off;
+  return next_seq++;
+}
+
+static void
+journal_append(journal_record_type type, int slot, const void *p1, size_t len1, const void *p2, size_t len2)
+{
+  pthread_mutex_lock(&journal_lock);
+  journal_append_locked(type, slot, p1, len1, p2, len2);
+  pthread_mutex_unlock(&journal_lock);
+}
+
+static void
+set_current_tag(int slot, const journal_tag *pjt)
+{
+  if ((slot < 0) || (slot >= NFCD_MAX_SLOTS))
+    return;
+  pthread_mutex_lock(&journal_lock);
+  if (pjt)
+    current_tag[slot] = *pjt;
+  else
+    memset(&current_tag[slot], 0, sizeof(current_tag[slot]));
+  pthread_mutex_unlock(&journal_lock);
+}
+
+void
+journal_tag_inserted(int slot, const nfc_target *pnt)
+{
+  journal_tag jt;
+
+  memset(&jt, 0, sizeof(jt));
+  jt.nmt = pnt->nm.nmt;
+  jt.nbr = pnt->nm.nbr;
+  if (pnt->nm.nmt == NMT_ISO14443A) {
+    jt.szUidLen = pnt->nti.nai.szUidLen;
+    memcpy(jt.abtUid, pnt->nti.nai.abtUid, jt.szUidLen);
+    memcpy(jt.abtAtqa, pnt->nti.nai.abtAtqa, 2);
+    jt.btSak = pnt->nti.nai.btSak;
+  }
+  set_current_tag(slot, &jt);
+  journal_append(JOURNAL_TAG_INSERTED, slot, &jt, sizeof(jt), NULL, 0);
+}
+
+void
+journal_tag_removed(int slot)
+{
+  set_current_tag(slot, NULL);
+  journal_append(JOURNAL_TAG_REMOVED, slot, NULL, 0, NULL, 0);
+}
+
+/**
+ * @brief Base image slot of the UID in @a pji, recycling the least recently used one
+ *
+ * Must be called with journal_lock held.
+ */
+static image_base *
+image_base_get(const journal_image *pji)
+{
+  image_base *pib = &bases[0];
+  int     i;
+
+  for (i = 0; i < IMAGE_BASES; i++) {
+    if ((bases[i].szUidLen == pji->szUidLen) && !memcmp(bases[i].abtUid, pji->abtUid, pji->szUidLen)) {
+      pib = &bases[i];
+      break;
+    }
+    if (bases[i].used < pib->used)
+      pib = &bases[i];
+  }
+  if (i == IMAGE_BASES) {
+    pib->szUidLen = pji->szUidLen;
+    memcpy(pib->abtUid, pji->abtUid, sizeof(pib->abtUid));
+    pib->seq = 0;
+  }
+  pib->used = ++bases_clock;
+  return pib;
+}
+
+static void
+image_base_set(image_base *pib, uint64_t seq, const uint8_t *image, size_t len)
+{
+  uint8_t *p;
+
+  if (pib->len != len) {
+    if ((p = realloc(pib->image, len)) == NULL) {
+      pib->seq = 0;
+      return;
+    }
+    pib->image = p;
+    pib->len = len;
+  }
+  memcpy(pib->image, image, len);
+  pib->seq = seq;
+}
+
+/**
+ * @brief Encode @a image as a delta against @a base into @a delta
+ * @return Delta size: the block bitmap, then the blocks that changed
+ */
+static size_t
+image_delta(const uint8_t *base, const uint8_t *image, size_t len, uint8_t *delta)
+{
+  const size_t blocks = (len + JOURNAL_IMAGE_BLOCK - 1) / JOURNAL_IMAGE_BLOCK;
+  size_t  off = (blocks + 7) / 8;
+  size_t  b, n;
+
+  memset(delta, 0, off);
+  for (b = 0; b < blocks; b++) {
+    n = len - b * JOURNAL_IMAGE_BLOCK;
+    if (n > JOURNAL_IMAGE_BLOCK)
+      n = JOURNAL_IMAGE_BLOCK;
+    if (!memcmp(base + b * JOURNAL_IMAGE_BLOCK, image + b * JOURNAL_IMAGE_BLOCK, n))
+      continue;
+    delta[b / 8] |= 1 << (b % 8);
+    memcpy(delta + off, image + b * JOURNAL_IMAGE_BLOCK, n);
+    off += n;
+  }
+  return off;
+}
+
+void
+journal_tag_image(int slot, const void *image, size_t len, bool complete)
+{
+  image_base *pib = NULL;
+  journal_image ji;
+  uint8_t *delta = NULL;
+  size_t  dlen;
+  uint64_t seq;
+
+  memset(&ji, 0, sizeof(ji));
+  ji.hash = state_image_hash(image, len);
+  ji.complete = complete;
+
+  pthread_mutex_lock(&journal_lock);
+  if (!store_images || (len > JOURNAL_IMAGE_MAX)) {
+    journal_append_locked(JOURNAL_TAG_IMAGE, slot, &ji, sizeof(ji), NULL, 0);
+    goto out;
+  }
+
+  ji.format = JOURNAL_IMAGE_FULL;
+  ji.size = len;
+  if ((slot >= 0) && (slot < NFCD_MAX_SLOTS) && current_tag[slot].szUidLen) {
+    ji.szUidLen = current_tag[slot].szUidLen;
+    memcpy(ji.abtUid, current_tag[slot].abtUid, sizeof(ji.abtUid));
+    pib = image_base_get(&ji);
+  }
+
+  // A delta needs a base in the same segment and must be worth it
+  if (pib && pib->seq && (pib->seq >= seg_first) && (pib->len == len) &&
+      ((delta = malloc(len + len / JOURNAL_IMAGE_BLOCK / 8 + 1)) != NULL) &&
+      ((dlen = image_delta(pib->image, image, len, delta)) < len / 2) &&
+      (seg_off + RECORD_ALIGN(RECORD_HEADER_SIZE + sizeof(ji) + dlen) <= seg_size)) {
+    ji.format = JOURNAL_IMAGE_DELTA;
+    ji.base_seq = pib->seq;
+    journal_append_locked(JOURNAL_TAG_IMAGE, slot, &ji, sizeof(ji), delta, dlen);
+    goto out;
+  }
+
+  seq = journal_append_locked(JOURNAL_TAG_IMAGE, slot, &ji, sizeof(ji), image, len);
+  if (pib && seq)
+    image_base_set(pib, seq, image, len);
+out:
+  pthread_mutex_unlock(&journal_lock);
+  free(delta);
+}
+
+void
+journal_tag_expired(int slot)
+{
+  set_current_tag(slot, NULL);
+  journal_append(JOURNAL_TAG_EXPIRED, slot, NULL, 0, NULL, 0);
+}
+
+void
+journal_tag_verdict(int slot, int verdict)
+{
+  journal_verdict jv;
+
+  memset(&jv, 0, sizeof(jv));
+  jv.verdict = verdict;
+  journal_append(JOURNAL_TAG_VERDICT, slot, &jv, sizeof(jv), NULL, 0);
+}
+
+void
+journal_reader_status(int reader, bool up)
+{
+  journal_append(up ? JOURNAL_READER_UP : JOURNAL_READER_DOWN, NFCD_SLOT(reader, 0), NULL, 0, NULL, 0);
+}
+
+static void
+cursor_unmap(journal_cursor *pjc)
+{
+  if (pjc->map)
+    munmap(pjc->map, pjc->map_size);
+  if (pjc->fd >= 0)
+    close(pjc->fd);
+  pjc->map = NULL;
+  pjc->fd = -1;
+}
+
+/**
+ * @brief Map the segment starting at @a first_seq
+ * @return 1 on success, 0 if there is no such segment (or it is still being
+ * created), -1 on error
+ */
+static int
+cursor_map(journal_cursor *pjc, uint64_t first_seq)
+{
+  char    path[PATH_MAX];
+  struct stat st;
+  void   *map;
+  int     fd;
+
+  segment_path(path, sizeof(path), pjc->dir, first_seq);
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return (errno == ENOENT) ? 0 : -1;
+  if ((fstat(fd, &st) < 0) || (st.st_size < SEGMENT_HEADER_SIZE)) {
+    close(fd);
+    return -1;
+  }
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  if (!segment_header_valid(map, st.st_size) || (((segment_header *) map)->first_seq != first_seq)) {
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+  }
+  cursor_unmap(pjc);
+  pjc->fd = fd;
+  pjc->map = map;
+  pjc->map_size = st.st_size;
+  pjc->offset = SEGMENT_HEADER_SIZE;
+  pjc->next_seq = first_seq;
+  return 1;
+}
+
+int
+journal_cursor_open(journal_cursor *pjc, const char *dir, uint64_t seq)
+{
+  journal_record jr;
+  uint64_t *seqs;
+  int     n, i;
+
+  memset(pjc, 0, sizeof(*pjc));
+  pjc->fd = -1;
+  snprintf(pjc->dir, sizeof(pjc->dir), "%s", dir);
+  pjc->next_seq = seq;
+
+  if ((n = list_segments(dir, &seqs)) < 0)
+    return -1;
+  // Newest segment starting at or before seq, or the oldest one
+  for (i = n - 1; (i > 0) && (seqs[i] > seq); i--)
+    ;
+  if ((n > 0) && (cursor_map(pjc, seqs[i]) < 0)) {
+    free(seqs);
+    return -1;
+  }
+  free(seqs);
+
+  while (pjc->map && (pjc->next_seq < seq)) {
+    size_t  offset = pjc->offset;
+
+    if (journal_cursor_next(pjc, &jr) <= 0)
+      break;
+    if (jr.seq >= seq) {
+      // Went one too far, step back
+      pjc->offset = offset;
+      pjc->next_seq = jr.seq;
+      break;
+    }
+  }
+  return 0;
+}
+
+int
+journal_cursor_next(journal_cursor *pjc, journal_record *pjr)
+{
+  const record_header *rh;
+  size_t  size;
+  int     res;
+
+  if ((pjc->map == NULL) && ((res = cursor_map(pjc, pjc->next_seq)) <= 0))
+    return res;
+
+  while ((size = record_check(pjc->map, pjc->map_size, pjc->offset, pjc->next_seq)) == 0) {
+    // End of this segment, unless the writer already moved on to the next one
+    if (((const segment_header *) pjc->map)->first_seq == pjc->next_seq)
+      return 0;
+    if ((res = cursor_map(pjc, pjc->next_seq)) <= 0)
+      return res;
+  }
+
+  rh = (const record_header *)(pjc->map + pjc->offset);
+  pjr->seq = rh->seq;
+  pjr->time = rh->time;
+  pjr->type = rh->type;
+  pjr->slot = rh->slot;
+  pjr->payload = pjc->map + pjc->offset + RECORD_HEADER_SIZE;
+  pjr->len = rh->len;
+  pjc->offset += size;
+  pjc->next_seq++;
+  return 1;
+}
+
+void
+journal_cursor_close(journal_cursor *pjc)
+{
+  cursor_unmap(pjc);
+}
+
+/**
+ * @brief Read the image record @a seq with @a pjc, which must be positioned on it
+ * @return 1 on success, 0 if it is not there or is not an image, -1 on error
+ */
+static int
+image_record(journal_cursor *pjc, uint64_t seq, journal_record *pjr, journal_image *pji)
+{
+  int     res;
+
+  if ((res = journal_cursor_next(pjc, pjr)) <= 0)
+    return res;
+  if ((pjr->seq != seq) || (pjr->type != JOURNAL_TAG_IMAGE) || (pjr->len < sizeof(*pji)))
+    return 0;
+  memcpy(pji, pjr->payload, sizeof(*pji));
+  return 1;
+}
+
+/**
+ * @brief Apply a delta payload onto the base image in @a image
+ */
+static int
+image_apply(const uint8_t *delta, size_t dlen, uint8_t *image, size_t len)
+{
+  const size_t blocks = (len + JOURNAL_IMAGE_BLOCK - 1) / JOURNAL_IMAGE_BLOCK;
+  size_t  off = (blocks + 7) / 8;
+  size_t  b, n;
+
+  if (dlen < off)
+    return -1;
+  for (b = 0; b < blocks; b++) {
+    if (!((delta[b / 8] >> (b % 8)) & 0x01))
+      continue;
+    n = len - b * JOURNAL_IMAGE_BLOCK;
+    if (n > JOURNAL_IMAGE_BLOCK)
+      n = JOURNAL_IMAGE_BLOCK;
+    if (off + n > dlen)
+      return -1;
+    memcpy(image + b * JOURNAL_IMAGE_BLOCK, delta + off, n);
+    off += n;
+  }
+  return (off == dlen) ? 0 : -1;
+}
+
+int
+journal_image_read(const char *dir, uint64_t seq, journal_image *pji, uint8_t *image, size_t size)
+{
+  journal_cursor jc;
+  journal_record jr;
+  journal_image base;
+  int     res;
+
+  if (journal_cursor_open(&jc, dir, seq) < 0)
+    return -1;
+  if ((res = image_record(&jc, seq, &jr, pji)) <= 0)
+    goto out;
+  res = 0;
+  if (pji->format == JOURNAL_IMAGE_HASH)
+    goto out;
+  res = -1;
+  if (pji->size > size)
+    goto out;
+
+  if (pji->format == JOURNAL_IMAGE_FULL) {
+    if (jr.len != sizeof(*pji) + pji->size)
+      goto out;
+    memcpy(image, jr.payload + sizeof(*pji), pji->size);
+  } else if (pji->format == JOURNAL_IMAGE_DELTA) {
+    // The base is in the same segment, read forward from it to the delta
+    journal_cursor_close(&jc);
+    if ((pji->base_seq >= seq) || (journal_cursor_open(&jc, dir, pji->base_seq) < 0))
+      return -1;
+    if ((res = image_record(&jc, pji->base_seq, &jr, &base)) <= 0)
+      goto out;
+    res = -1;
+    if ((base.format != JOURNAL_IMAGE_FULL) || (base.size != pji->size) ||
+        (jr.len != sizeof(base) + base.size))
+      goto out;
+    memcpy(image, jr.payload + sizeof(base), base.size);
+    while (jc.next_seq < seq) {
+      if (journal_cursor_next(&jc, &jr) <= 0)
+        goto out;
+    }
+    if ((image_record(&jc, seq, &jr, pji) <= 0) ||
+        (image_apply(jr.payload + sizeof(*pji), jr.len - sizeof(*pji), image, pji->size) < 0))
+      goto out;
+  } else {
+    goto out;
+  }
+
+  res = (state_image_hash(image, pji->size) == pji->hash) ? (int) pji->size : -1;
+out:
+  journal_cursor_close(&jc);
+  return res;
+}
+
+const char *
+journal_record_type_name(journal_record_type type)
+{
+  if ((type < JOURNAL_TAG_INSERTED) || (type > JOURNAL_READER_UP))
+    return "unknown";
+  return type_names[type];
+}
+
+const char *
+journal_image_format_name(journal_image_format format)
+{
+  if ((format < JOURNAL_IMAGE_HASH) || (format > JOURNAL_IMAGE_DELTA))
+    return "unknown";
+  return format_names[format];
+}
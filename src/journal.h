@@ -0,0 +1,197 @@
+/*
+ * NFC Event Daemon
+ * Event journal
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file journal.h
+ * @brief Append-only journal of tag events, kept on disk in segment files
+ *
+ * The journal is a directory of segment files named after the sequence number
+ * of their first record (%016llx.jrn).  Each segment is preallocated to its
+ * full size and memory mapped, so appending never changes file metadata; a
+ * flusher thread msyncs the dirty range at most once per sync interval.  Once
+ * a segment is full the next one is created and the oldest ones beyond the
+ * retention count are deleted.
+ *
+ * A segment starts with a 64 byte header, followed by records aligned to
+ * 8 bytes, in host byte order:
+ *
+ *   uint32 size    whole record including this header, 0 past the last one
+ *   uint32 crc     CRC-32 of the rest of the record
+ *   uint64 seq     consecutive across segments
+ *   int64  time    microseconds since the epoch
+ *   uint16 type    journal_record_type
+ *   uint16 slot    state slot of the card, see NFCD_SLOT()
+ *   uint32 len     payload bytes that follow
+ *
+ * The size is stored last, so a reader never sees a half written record;
+ * after a crash the first record with a bad CRC or an unexpected sequence
+ * number ends the journal, and appending resumes there.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <nfc/nfc-types.h>
+
+#ifndef PATH_MAX
+#  define PATH_MAX 4096
+#endif
+
+typedef enum {
+  JOURNAL_TAG_INSERTED = 1,     /* payload: journal_tag */
+  JOURNAL_TAG_REMOVED,          /* no payload */
+  JOURNAL_TAG_IMAGE,            /* payload: journal_image, then the image data */
+  JOURNAL_TAG_EXPIRED,          /* no payload */
+  JOURNAL_TAG_VERDICT,          /* payload: journal_verdict */
+  JOURNAL_READER_DOWN,          /* no payload, slot of card 0 */
+  JOURNAL_READER_UP,            /* no payload, slot of card 0 */
+} journal_record_type;
+
+typedef struct {
+  uint8_t nmt;                  /* nfc_modulation_type */
+  uint8_t nbr;                  /* nfc_baud_rate */
+  uint8_t szUidLen;
+  uint8_t abtUid[10];
+  uint8_t abtAtqa[2];
+  uint8_t btSak;
+} journal_tag;
+
+typedef struct {
+  uint8_t verdict;              /* acl_verdict */
+  uint8_t pad[7];
+} journal_verdict;
+
+typedef enum {
+  JOURNAL_IMAGE_HASH,           /* no image data, only its hash */
+  JOURNAL_IMAGE_FULL,           /* the whole image */
+  JOURNAL_IMAGE_DELTA,          /* blocks that differ from a base image */
+} journal_image_format;
+
+/*
+ * Images are kept as a base per UID, followed by deltas against it.  A delta
+ * is a bitmap of the 16 byte blocks that changed, bit i of byte i / 8 for
+ * block i, followed by the new contents of those blocks, in order.  The base
+ * of a delta always lives in the same segment, so a delta is never orphaned
+ * by the retention.
+ */
+#define JOURNAL_IMAGE_BLOCK 16
+
+/*
+ * Largest image stored, as big as an ISO14443-4 response (4 KB and its status
+ * word) and more than a MIFARE Classic 4K dump.  Larger ones are only hashed.
+ */
+#define JOURNAL_IMAGE_MAX (4096 + 2)
+
+typedef struct {
+  uint64_t hash;                /* as in the reader state */
+  uint64_t base_seq;            /* JOURNAL_IMAGE_DELTA: record holding the base */
+  uint32_t size;                /* image bytes, 0 for JOURNAL_IMAGE_HASH */
+  uint8_t complete;
+  uint8_t format;               /* journal_image_format */
+  uint8_t szUidLen;
+  uint8_t abtUid[10];
+  uint8_t pad[7];
+} journal_image;
+
+typedef struct {
+  uint64_t seq;
+  int64_t time;
+  journal_record_type type;
+  int     slot;                 /* NFCD_SLOT() of the card */
+  const uint8_t *payload;       /* valid until the next call on the cursor */
+  size_t  len;
+} journal_record;
+
+typedef struct {
+  char    dir[PATH_MAX];
+  uint64_t next_seq;            /* sequence number expected next */
+  int     fd;
+  uint8_t *map;
+  size_t  map_size;
+  size_t  offset;
+} journal_cursor;
+
+/**
+ * @brief Open (or create) the journal in @a dir and start the flusher thread
+ * @param segment_size Size of each segment file in bytes
+ * @param segments Number of segments to keep
+ * @param sync_interval Longest time in ms a record stays in memory only
+ * @param images Also store card images (a base per UID, then deltas), not just their hash
+ * @return 0 on success, -1 on error
+ */
+int     journal_open(const char *dir, size_t segment_size, int segments, int sync_interval, bool images);
+
+/**
+ * @brief Sync and close the journal; nothing is recorded until it is reopened
+ */
+void    journal_close(void);
+
+void    journal_tag_inserted(int slot, const nfc_target *pnt);
+void    journal_tag_removed(int slot);
+void    journal_tag_image(int slot, const void *image, size_t len, bool complete);
+void    journal_tag_expired(int slot);
+void    journal_tag_verdict(int slot, int verdict);
+void    journal_reader_status(int reader, bool up);
+
+/**
+ * @brief Bytes appended but not synced to disk yet
+ */
+long    journal_unsynced_bytes(void);
+
+/**
+ * @brief Copy the directory of the open journal
+ * @return false if no journal is open
+ */
+bool    journal_get_dir(char *dir, size_t size);
+
+/**
+ * @brief Position a cursor on the first record with a sequence number >= @a seq
+ *
+ * If that record was already deleted the cursor starts at the oldest one kept;
+ * compare the sequence number of the first record to detect the gap.
+ *
+ * @return 0 on success, -1 on error
+ */
+int     journal_cursor_open(journal_cursor *pjc, const char *dir, uint64_t seq);
+
+/**
+ * @brief Read the next record
+ * @return 1 if @a pjr was filled, 0 at the end of the journal, -1 on error
+ */
+int     journal_cursor_next(journal_cursor *pjc, journal_record *pjr);
+
+void    journal_cursor_close(journal_cursor *pjc);
+
+/**
+ * @brief Rebuild the card image held by record @a seq, applying its delta if any
+ * @param pji Filled with the image record header
+ * @return Image size, 0 if the record is gone or holds no image, -1 on error
+ * (including an image that does not match its hash, or a too small buffer)
+ */
+int     journal_image_read(const char *dir, uint64_t seq, journal_image *pji, uint8_t *image, size_t size);
+
+const char *journal_record_type_name(journal_record_type type);
+const char *journal_image_format_name(journal_image_format format);
+
+#endif /* __JOURNAL_H__ */
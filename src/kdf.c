@@ -0,0 +1,208 @@
+/*
+ * NFC Event Daemon
+ * Diversified key derivation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file kdf.c
+ * @brief Per-card key diversification from a master secret (NXP AN10922)
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kdf.h"
+#include "aes.h"
+#include "nfc-utils.h"
+
+static aes128_ctx master;
+static bool master_loaded = false;
+
+static int
+hex_value(int c)
+{
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  c = tolower(c);
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  return -1;
+}
+
+int
+kdf_read_master_key(const char *path, uint8_t abtKey[16])
+{
+  char    buf[256];
+  struct stat st;
+  ssize_t len;
+  size_t  digits = 0;
+  int     fd;
+  ssize_t i;
+
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+    ERR("Unable to open master key %s: %s", path, strerror(errno));
+    return -1;
+  }
+  // Check the file we opened, not the path, so it cannot be swapped in between
+  if (fstat(fd, &st) < 0) {
+    ERR("Unable to stat master key %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode) || ((st.st_uid != 0) && (st.st_uid != geteuid())) ||
+      (st.st_mode & (S_IRWXG | S_IRWXO))) {
+    ERR("Refusing master key %s: must be a regular file owned by root or us, with mode 0600 or stricter", path);
+    close(fd);
+    return -1;
+  }
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+  if (len < 0) {
+    ERR("Unable to read master key %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  // Hex digits, whitespace and ':' separators are accepted, '#' starts a comment
+  for (i = 0; i < len; i++) {
+    int     v;
+
+    if (buf[i] == '#') {
+      while ((i < len) && (buf[i] != '\n'))
+        i++;
+      continue;
+    }
+    if (isspace((unsigned char) buf[i]) || (buf[i] == ':'))
+      continue;
+    if (((v = hex_value((unsigned char) buf[i])) < 0) || (digits == 32)) {
+      digits = 0;
+      break;
+    }
+    if (digits % 2 == 0)
+      abtKey[digits / 2] = v << 4;
+    else
+      abtKey[digits / 2] |= v;
+    digits++;
+  }
+  aes_wipe(buf, sizeof(buf));
+  if (digits != 32) {
+    ERR("Invalid master key in %s: expected 32 hex digits", path);
+    aes_wipe(abtKey, 16);
+    return -1;
+  }
+  return 0;
+}
+
+void
+kdf_set_master_key(const uint8_t abtKey[16])
+{
+  if (abtKey == NULL) {
+    aes_wipe(&master, sizeof(master));
+    master_loaded = false;
+    return;
+  }
+  aes128_init(&master, abtKey);
+  master_loaded = true;
+}
+
+int
+kdf_load_master_key(const char *path)
+{
+  uint8_t abtKey[16];
+
+  if (path[0] == '\0') {
+    kdf_set_master_key(NULL);
+    return 0;
+  }
+  if (kdf_read_master_key(path, abtKey) < 0)
+    return -1;
+  kdf_set_master_key(abtKey);
+  aes_wipe(abtKey, sizeof(abtKey));
+  return 0;
+}
+
+static void
+an10922_aes128(const aes128_ctx *pctx, const uint8_t *pbtInput, size_t szLen, uint8_t abtKey[16])
+{
+  uint8_t abtMsg[32] = { 0x01 };
+  uint8_t k1[16], k2[16];
+  size_t  i;
+
+  if (szLen > KDF_MAX_INPUT)
+    szLen = KDF_MAX_INPUT;
+  memcpy(abtMsg + 1, pbtInput, szLen);
+
+  // Unlike plain CMAC the message is always two blocks: padded and xored with
+  // K2 when shorter than 32 bytes, xored with K1 otherwise
+  aes128_cmac_subkeys(pctx, k1, k2);
+  if (szLen + 1 < sizeof(abtMsg)) {
+    abtMsg[szLen + 1] = 0x80;
+    for (i = 0; i < 16; i++)
+      abtMsg[16 + i] ^= k2[i];
+  } else {
+    for (i = 0; i < 16; i++)
+      abtMsg[16 + i] ^= k1[i];
+  }
+
+  // CBC-MAC with a zero IV
+  aes128_encrypt(pctx, abtMsg, abtKey);
+  for (i = 0; i < 16; i++)
+    abtKey[i] ^= abtMsg[16 + i];
+  aes128_encrypt(pctx, abtKey, abtKey);
+
+  aes_wipe(abtMsg, sizeof(abtMsg));
+  aes_wipe(k1, sizeof(k1));
+  aes_wipe(k2, sizeof(k2));
+}
+
+void
+kdf_an10922_aes128(const uint8_t abtMaster[16], const uint8_t *pbtInput, size_t szLen, uint8_t abtKey[16])
+{
+  aes128_ctx ctx;
+
+  aes128_init(&ctx, abtMaster);
+  an10922_aes128(&ctx, pbtInput, szLen, abtKey);
+  aes_wipe(&ctx, sizeof(ctx));
+}
+
+bool
+kdf_mifare_classic_key(const uint8_t *pbtUid, size_t szUidLen, uint8_t ui8Sector, mifare_cmd mc, uint8_t abtKey[6])
+{
+  uint8_t abtInput[KDF_MAX_INPUT];
+  uint8_t abtDerived[16];
+
+  if (!master_loaded || (szUidLen > 10))
+    return false;
+
+  memcpy(abtInput, pbtUid, szUidLen);
+  abtInput[szUidLen] = ui8Sector;
+  abtInput[szUidLen + 1] = (uint8_t) mc;
+  an10922_aes128(&master, abtInput, szUidLen + 2, abtDerived);
+  memcpy(abtKey, abtDerived, 6);
+  aes_wipe(abtDerived, sizeof(abtDerived));
+  return true;
+}
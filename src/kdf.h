@@ -0,0 +1,79 @@
+/*
+ * NFC Event Daemon
+ * Diversified key derivation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file kdf.h
+ * @brief Per-card key diversification from a master secret (NXP AN10922)
+ *
+ * Sector keys are derived with the AES-128 scheme of AN10922: an AES-CMAC of
+ * 0x01 || M under the master key, where M is the diversification input and
+ * the message is always padded to 32 bytes.  For MIFARE Classic, M is
+ * UID || sector || authentication command (0x60 for key A, 0x61 for key B)
+ * and the 6 first bytes of the result make the key.
+ *
+ * Part of the daemon, not of the card engine: the master key is process
+ * wide, and reaches the sessions through their key provider.
+ */
+
+#ifndef __KDF_H__
+#define __KDF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mifare.h"
+
+#define KDF_MAX_INPUT 31
+
+/**
+ * @brief Load the master key, 32 hex digits
+ *
+ * The file must be a regular file owned by root or by the daemon user, and
+ * neither readable nor writable by group or others.  An empty path forgets the
+ * current key.
+ *
+ * @return 0 on success, -1 on error (the previous key is kept)
+ */
+int     kdf_load_master_key(const char *path);
+
+/**
+ * @brief Read and check the master key in @a path, under the same rules,
+ * without installing it
+ * @return 0 on success, -1 on error
+ */
+int     kdf_read_master_key(const char *path, uint8_t abtKey[16]);
+
+/**
+ * @brief Install a master key read by kdf_read_master_key(), NULL to forget the current one
+ */
+void    kdf_set_master_key(const uint8_t abtKey[16]);
+
+/**
+ * @brief AN10922 AES-128 diversification of @a abtMaster with @a szLen bytes of input
+ */
+void    kdf_an10922_aes128(const uint8_t abtMaster[16], const uint8_t *pbtInput, size_t szLen, uint8_t abtKey[16]);
+
+/**
+ * @brief Key provider for mifare_classic_set_key_provider()
+ * @return false when no master key is loaded
+ */
+bool    kdf_mifare_classic_key(const uint8_t *pbtUid, size_t szUidLen, uint8_t ui8Sector, mifare_cmd mc, uint8_t abtKey[6]);
+
+#endif /* __KDF_H__ */
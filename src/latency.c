@@ -0,0 +1,239 @@
+/*
+ * NFC Event Daemon
+ * Adaptive command timeouts
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file latency.c
+ * @brief Command timeouts learnt from observed latencies
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "latency.h"
+#include "nfc-utils.h"
+
+/*
+ * Buckets are 4 per power of two: bucket b >= 4 holds latencies in
+ * [(4 + b % 4) << (b / 4 - 1), (5 + b % 4) << (b / 4 - 1)) microseconds,
+ * which keeps the error under 25% from 4 us up to 2 s.
+ */
+#define LAT_BUCKETS 80
+#define LAT_MIN_SAMPLES 32        /* use the ceiling until then */
+#define LAT_MAX_SAMPLES 4096      /* halve the counts past this, to follow drifts */
+#define LAT_MIN_TIMEOUT 2         /* ms, below that USB scheduling alone may fire it */
+#define LAT_CARD_TYPES 8
+
+typedef struct {
+  uint32_t counts[LAT_BUCKETS];
+  uint32_t total;
+  uint32_t since_update;
+  int     timeout;                /* ms, valid once total >= LAT_MIN_SAMPLES */
+} latency_hist;
+
+typedef struct {
+  bool    used;
+  uint8_t btSak;
+  latency_hist hist[LAT_NUM_CMDS];
+} latency_card;
+
+static const char *cmd_names[] = {
+  [LAT_CMD_AUTH]  = "auth",
+  [LAT_CMD_READ]  = "read",
+  [LAT_CMD_WRITE] = "write",
+  [LAT_CMD_VALUE] = "value",
+  [LAT_CMD_RATS]  = "rats",
+  [LAT_CMD_BLOCK] = "block",
+};
+
+/* What is learnt is per thread: a reader is driven by one thread, and its own cards */
+static __thread latency_card cards[LAT_CARD_TYPES];
+static __thread latency_card *current = NULL;
+static int lat_percentile = 99;
+static int lat_margin = 50;
+static int lat_ceiling = 100;
+
+static int
+bucket_of(uint32_t us)
+{
+  int     log;
+
+  if (us < 4)
+    return us;
+  log = 31 - __builtin_clz(us);
+  if (log > (LAT_BUCKETS / 4))
+    return LAT_BUCKETS - 1;
+  return (log - 1) * 4 + ((us >> (log - 2)) & 3);
+}
+
+static uint32_t
+bucket_upper(int b)
+{
+  if (b < 4)
+    return b + 1;
+  return (uint32_t)(5 + b % 4) << (b / 4 - 1);
+}
+
+static void
+hist_update_timeout(latency_hist *h)
+{
+  uint32_t target = ((uint64_t) h->total * lat_percentile + 99) / 100;
+  uint32_t seen = 0;
+  int     b;
+
+  for (b = 0; b < LAT_BUCKETS - 1; b++) {
+    seen += h->counts[b];
+    if (seen >= target)
+      break;
+  }
+  // Upper edge of the bucket plus the margin, rounded up to the next ms
+  h->timeout = (int)(((uint64_t) bucket_upper(b) * (100 + lat_margin) / 100 + 999) / 1000);
+  if (h->timeout < LAT_MIN_TIMEOUT)
+    h->timeout = LAT_MIN_TIMEOUT;
+  h->since_update = 0;
+}
+
+void
+latency_configure(int percentile, int margin, int ceiling)
+{
+  size_t  i, c;
+
+  lat_percentile = percentile;
+  lat_margin = margin;
+  lat_ceiling = ceiling;
+  for (i = 0; i < LAT_CARD_TYPES; i++) {
+    for (c = 0; c < LAT_NUM_CMDS; c++) {
+      if (cards[i].hist[c].total >= LAT_MIN_SAMPLES)
+        hist_update_timeout(&cards[i].hist[c]);
+    }
+  }
+}
+
+void
+latency_set_card(uint8_t btSak)
+{
+  size_t  i;
+
+  for (i = 0; i < LAT_CARD_TYPES; i++) {
+    if (cards[i].used && (cards[i].btSak == btSak)) {
+      current = &cards[i];
+      return;
+    }
+  }
+  for (i = 0; i < LAT_CARD_TYPES; i++) {
+    if (!cards[i].used) {
+      cards[i].used = true;
+      cards[i].btSak = btSak;
+      current = &cards[i];
+      return;
+    }
+  }
+  // Too many card types: recycle the last slot rather than mix types
+  memset(&cards[LAT_CARD_TYPES - 1], 0, sizeof(cards[0]));
+  cards[LAT_CARD_TYPES - 1].used = true;
+  cards[LAT_CARD_TYPES - 1].btSak = btSak;
+  current = &cards[LAT_CARD_TYPES - 1];
+}
+
+int
+latency_timeout(latency_cmd cmd)
+{
+  const latency_hist *h;
+
+  if (lat_ceiling == 0)
+    return -1;                    // driver default
+  if (current == NULL)
+    return lat_ceiling;
+  h = &current->hist[cmd];
+  if (h->total < LAT_MIN_SAMPLES)
+    return lat_ceiling;
+  return (h->timeout < lat_ceiling) ? h->timeout : lat_ceiling;
+}
+
+int64_t
+latency_start(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+latency_record(latency_cmd cmd, int64_t start)
+{
+  latency_hist *h;
+  int64_t us = latency_start() - start;
+  size_t  b;
+
+  if (current == NULL)
+    latency_set_card(0);
+  h = &current->hist[cmd];
+  if (us < 0)
+    us = 0;
+  if (us > UINT32_MAX)
+    us = UINT32_MAX;
+  h->counts[bucket_of((uint32_t) us)]++;
+  h->total++;
+  if (h->total > LAT_MAX_SAMPLES) {
+    h->total = 0;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      h->counts[b] /= 2;
+      h->total += h->counts[b];
+    }
+  }
+  // Recomputing is a walk over the buckets, do it every few samples only
+  if ((h->total >= LAT_MIN_SAMPLES) && ((h->total == LAT_MIN_SAMPLES) || (++h->since_update >= 16)))
+    hist_update_timeout(h);
+}
+
+const char *
+latency_cmd_name(latency_cmd cmd)
+{
+  return cmd_names[cmd];
+}
+
+void
+latency_print(void)
+{
+  size_t  i, c;
+
+  for (i = 0; i < LAT_CARD_TYPES; i++) {
+    if (!cards[i].used)
+      continue;
+    for (c = 0; c < LAT_NUM_CMDS; c++) {
+      const latency_hist *h = &cards[i].hist[c];
+
+      if (h->total == 0)
+        continue;
+      if (h->total < LAT_MIN_SAMPLES)
+        DBG("SAK %02x %-5s: %u samples, learning", cards[i].btSak, cmd_names[c], h->total);
+      else
+        DBG("SAK %02x %-5s: %u samples, timeout %d ms", cards[i].btSak, cmd_names[c], h->total, h->timeout);
+    }
+  }
+}
@@ -0,0 +1,90 @@
+/*
+ * NFC Event Daemon
+ * Adaptive command timeouts
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file latency.h
+ * @brief Command timeouts learnt from observed latencies
+ *
+ * The round trip time of every successful command is recorded in a
+ * logarithmic histogram per command class and card type (SAK).  The timeout
+ * of the next command of that class is a high percentile of the histogram
+ * plus a margin, capped by a ceiling, so a wrong key or a card that left the
+ * field is noticed after a few milliseconds rather than after the driver
+ * default.  Until enough samples are collected the ceiling is used.
+ *
+ * The histograms are per thread, as a reader is only driven from the thread
+ * polling it: each one learns the timeouts of its own link.  The parameters
+ * are shared; latency_configure() and latency_print() apply to the
+ * histograms of the calling thread, the others pick new parameters up with
+ * their next update.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+
+typedef enum {
+  LAT_CMD_AUTH,
+  LAT_CMD_READ,
+  LAT_CMD_WRITE,
+  LAT_CMD_VALUE,        /* increment, decrement, restore, transfer */
+  LAT_CMD_RATS,
+  LAT_CMD_BLOCK,        /* ISO14443-4 block, timed out by the card's FWT */
+  LAT_NUM_CMDS,
+} latency_cmd;
+
+/**
+ * @brief Set the learning parameters
+ * @param percentile Percentile of the observed latencies to wait for (50..100)
+ * @param margin Extra time, in percent of that percentile
+ * @param ceiling Longest timeout in ms; 0 disables learning and uses the
+ * driver default timeout
+ */
+void    latency_configure(int percentile, int margin, int ceiling);
+
+/**
+ * @brief Set the card type (SAK) the next commands are sent to
+ */
+void    latency_set_card(uint8_t btSak);
+
+/**
+ * @brief Timeout in ms to pass to libnfc for a command of class @a cmd
+ */
+int     latency_timeout(latency_cmd cmd);
+
+/**
+ * @brief Start timing a command
+ * @return Opaque start time for latency_record()
+ */
+int64_t latency_start(void);
+
+/**
+ * @brief Record the latency of a successful command started at @a start
+ */
+void    latency_record(latency_cmd cmd, int64_t start);
+
+const char *latency_cmd_name(latency_cmd cmd);
+
+/**
+ * @brief Log the learnt timeouts (debug level)
+ */
+void    latency_print(void);
+
+#endif /* __LATENCY_H__ */
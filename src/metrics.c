@@ -0,0 +1,465 @@
+/*
+ * NFC Event Daemon
+ * Metrics
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file metrics.c
+ * @brief Counters exported in the Prometheus text format
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <nfc/nfc.h>
+
+#include "metrics.h"
+#include "nfc-utils.h"
+
+#define CACHE_LINE 64
+#define HIST_BUCKETS 11
+#define REQUEST_TIMEOUT 2000    /* ms granted to an HTTP client to send its request */
+
+/* Upper bounds of the command duration buckets, in us */
+static const unsigned long hist_bounds[HIST_BUCKETS] = {
+  500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000
+};
+
+/*
+ * The counters of one thread.  Only that thread writes them, so an update is
+ * a relaxed load and store of a word; the alignment keeps two threads off the
+ * same cache line.
+ */
+typedef struct metrics_shard {
+  unsigned long counters[METRIC_NUM_COUNTERS];
+  unsigned long commands[LAT_NUM_CMDS][HIST_BUCKETS + 1];   /* last one: +Inf */
+  unsigned long command_us[LAT_NUM_CMDS];
+  unsigned long command_errors[LAT_NUM_CMDS];
+  struct metrics_shard *next;
+} __attribute__((aligned(CACHE_LINE))) metrics_shard;
+
+typedef struct {
+  const char *name;
+  const char *labels;
+  const char *help;
+} metric_desc;
+
+/* Entries sharing a name must follow each other */
+static const metric_desc counter_desc[METRIC_NUM_COUNTERS] = {
+  [METRIC_POLLS]    = { "nfcd_polls_total", NULL, "Target polls started" },
+  [METRIC_TAPS]     = { "nfcd_taps_total", NULL, "Tags that entered the field" },
+  [METRIC_REMOVALS] = { "nfcd_removals_total", NULL, "Tags that left the field" },
+  [METRIC_EXPIRIES] = { "nfcd_expiries_total", NULL, "Expire time events" },
+  [METRIC_EVENTS]   = { "nfcd_events_total", NULL, "Events dispatched" },
+  [METRIC_READS_CLASSIC_COMPLETE]    = { "nfcd_reads_total", "card=\"mifare_classic\",result=\"complete\"", "Card reads" },
+  [METRIC_READS_CLASSIC_PARTIAL]     = { "nfcd_reads_total", "card=\"mifare_classic\",result=\"partial\"", NULL },
+  [METRIC_READS_CLASSIC_FAILED]      = { "nfcd_reads_total", "card=\"mifare_classic\",result=\"failed\"", NULL },
+  [METRIC_READS_ULTRALIGHT_COMPLETE] = { "nfcd_reads_total", "card=\"mifare_ultralight\",result=\"complete\"", NULL },
+  [METRIC_READS_ULTRALIGHT_FAILED]   = { "nfcd_reads_total", "card=\"mifare_ultralight\",result=\"failed\"", NULL },
+  [METRIC_READS_ISODEP_COMPLETE]     = { "nfcd_reads_total", "card=\"iso14443_4\",result=\"complete\"", NULL },
+  [METRIC_READS_ISODEP_FAILED]       = { "nfcd_reads_total", "card=\"iso14443_4\",result=\"failed\"", NULL },
+  [METRIC_AUTH_HITS]   = { "nfcd_auth_total", "result=\"hit\"", "MIFARE Classic authentications" },
+  [METRIC_AUTH_MISSES] = { "nfcd_auth_total", "result=\"miss\"", NULL },
+  [METRIC_RESELECTS]         = { "nfcd_reselects_total", NULL, "Tag reselections after a halt" },
+  [METRIC_RESELECT_FAILURES] = { "nfcd_reselect_failures_total", NULL, "Reselections that found no tag" },
+  [METRIC_DROPPED_UBUS]    = { "nfcd_events_dropped_total", "sink=\"ubus\"", "Events lost before reaching a sink" },
+  [METRIC_DROPPED_JOURNAL] = { "nfcd_events_dropped_total", "sink=\"journal\"", NULL },
+  [METRIC_ACCESS_ALLOWED] = { "nfcd_access_total", "verdict=\"allow\"", "Access decisions" },
+  [METRIC_ACCESS_DENIED]  = { "nfcd_access_total", "verdict=\"deny\"", NULL },
+  [METRIC_READER_DOWN]            = { "nfcd_reader_down_total", NULL, "Readers that stopped answering" },
+  [METRIC_READER_REOPEN_FAILURES] = { "nfcd_reader_reopen_failures_total", NULL, "Attempts to reopen a reader that failed" },
+  [METRIC_DEBITS_OK]     = { "nfcd_debits_total", "result=\"ok\"", "Value block debits" },
+  [METRIC_DEBITS_FAILED] = { "nfcd_debits_total", "result=\"failed\"", NULL },
+};
+
+static const metric_desc gauge_desc[METRIC_NUM_GAUGES] = {
+  [METRIC_UBUS_BACKLOG]     = { "nfcd_ubus_backlog", NULL, "State changes not notified on ubus yet" },
+  [METRIC_JOURNAL_UNSYNCED] = { "nfcd_journal_unsynced_bytes", NULL, "Journal bytes not synced to disk yet" },
+  [METRIC_POLL_INTERVAL]    = { "nfcd_poll_interval_ms", NULL, "Milliseconds between software polls for a new card" },
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard *shards = NULL;
+static __thread metrics_shard *local = NULL;
+
+static long (*gauges[METRIC_NUM_GAUGES])(void);
+
+static pthread_t server_thread;
+static bool server_running = false;
+static int stop_pipe[2] = { -1, -1 };
+static int unix_fd = -1;
+static int http_fd = -1;
+static char unix_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/**
+ * @brief Counters of the calling thread, registered on first use
+ *
+ * Shards are never freed: a thread that exited still counts.
+ */
+static metrics_shard *
+local_shard(void)
+{
+  metrics_shard *s;
+
+  if (local)
+    return local;
+  if (posix_memalign((void **) &s, CACHE_LINE, sizeof(*s)) != 0)
+    return NULL;
+  memset(s, 0, sizeof(*s));
+  pthread_mutex_lock(&shards_lock);
+  s->next = shards;
+  __atomic_store_n(&shards, s, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&shards_lock);
+  return local = s;
+}
+
+static inline void
+bump(unsigned long *p, unsigned long n)
+{
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_add(metric_counter counter, unsigned long n)
+{
+  metrics_shard *s = local_shard();
+
+  if (s)
+    bump(&s->counters[counter], n);
+}
+
+void
+metrics_command(latency_cmd cmd, int64_t start, bool ok)
+{
+  metrics_shard *s = local_shard();
+  int64_t us = latency_start() - start;
+  int     b;
+
+  if (!s)
+    return;
+  if (us < 0)
+    us = 0;
+  for (b = 0; (b < HIST_BUCKETS) && ((unsigned long) us > hist_bounds[b]); b++)
+    ;
+  bump(&s->commands[cmd][b], 1);
+  bump(&s->command_us[cmd], (unsigned long) us);
+  if (!ok)
+    bump(&s->command_errors[cmd], 1);
+}
+
+void
+metrics_set_gauge(metric_gauge gauge, long (*fn)(void))
+{
+  __atomic_store_n(&gauges[gauge], fn, __ATOMIC_RELEASE);
+}
+
+static void
+print_header(FILE *f, const metric_desc *d, const char *type)
+{
+  if (d->help)
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, type);
+}
+
+/**
+ * @brief Render all metrics in the Prometheus text exposition format
+ */
+static void
+render(FILE *f)
+{
+  unsigned long counters[METRIC_NUM_COUNTERS] = { 0 };
+  unsigned long commands[LAT_NUM_CMDS][HIST_BUCKETS + 1] = { { 0 } };
+  unsigned long command_us[LAT_NUM_CMDS] = { 0 };
+  unsigned long command_errors[LAT_NUM_CMDS] = { 0 };
+  const metrics_shard *s;
+  unsigned long total;
+  long    (*fn)(void);
+  int     i, c, b;
+
+  for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+    for (i = 0; i < METRIC_NUM_COUNTERS; i++)
+      counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+    for (c = 0; c < LAT_NUM_CMDS; c++) {
+      for (b = 0; b <= HIST_BUCKETS; b++)
+        commands[c][b] += __atomic_load_n(&s->commands[c][b], __ATOMIC_RELAXED);
+      command_us[c] += __atomic_load_n(&s->command_us[c], __ATOMIC_RELAXED);
+      command_errors[c] += __atomic_load_n(&s->command_errors[c], __ATOMIC_RELAXED);
+    }
+  }
+
+  for (i = 0; i < METRIC_NUM_COUNTERS; i++) {
+    const metric_desc *d = &counter_desc[i];
+
+    print_header(f, d, "counter");
+    if (d->labels)
+      fprintf(f, "%s{%s} %lu\n", d->name, d->labels, counters[i]);
+    else
+      fprintf(f, "%s %lu\n", d->name, counters[i]);
+  }
+
+  fprintf(f, "# HELP nfcd_command_duration_seconds Card command round trip time\n"
+          "# TYPE nfcd_command_duration_seconds histogram\n");
+  for (c = 0; c < LAT_NUM_CMDS; c++) {
+    total = 0;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+      total += commands[c][b];
+      fprintf(f, "nfcd_command_duration_seconds_bucket{cmd=\"%s\",le=\"%g\"} %lu\n",
+              latency_cmd_name(c), hist_bounds[b] / 1e6, total);
+    }
+    total += commands[c][HIST_BUCKETS];
+    fprintf(f, "nfcd_command_duration_seconds_bucket{cmd=\"%s\",le=\"+Inf\"} %lu\n", latency_cmd_name(c), total);
+    fprintf(f, "nfcd_command_duration_seconds_sum{cmd=\"%s\"} %g\n", latency_cmd_name(c), command_us[c] / 1e6);
+    fprintf(f, "nfcd_command_duration_seconds_count{cmd=\"%s\"} %lu\n", latency_cmd_name(c), total);
+  }
+  fprintf(f, "# HELP nfcd_command_errors_total Card commands that failed or timed out\n"
+          "# TYPE nfcd_command_errors_total counter\n");
+  for (c = 0; c < LAT_NUM_CMDS; c++)
+    fprintf(f, "nfcd_command_errors_total{cmd=\"%s\"} %lu\n", latency_cmd_name(c), command_errors[c]);
+
+  for (i = 0; i < METRIC_NUM_GAUGES; i++) {
+    if ((fn = __atomic_load_n(&gauges[i], __ATOMIC_ACQUIRE)) == NULL)
+      continue;
+    print_header(f, &gauge_desc[i], "gauge");
+    fprintf(f, "%s %ld\n", gauge_desc[i].name, fn());
+  }
+}
+
+static void
+send_all(int fd, const char *p, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief Wait for the end of the request headers; the path is not looked at
+ * @return true for a GET request
+ */
+static bool
+http_read_request(int fd)
+{
+  char    req[1024];
+  size_t  len = 0;
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  ssize_t n;
+
+  while (len < sizeof(req) - 1) {
+    if (poll(&pfd, 1, REQUEST_TIMEOUT) <= 0)
+      return false;
+    if ((n = recv(fd, req + len, sizeof(req) - 1 - len, 0)) <= 0)
+      return false;
+    len += n;
+    req[len] = '\0';
+    if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+      break;
+  }
+  return !strncmp(req, "GET ", 4);
+}
+
+static void
+serve(int listen_fd, bool http)
+{
+  char   *text = NULL;
+  size_t  len = 0;
+  char    head[128];
+  FILE   *f;
+  int     fd;
+
+  if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    return;
+  if (http && !http_read_request(fd)) {
+    static const char bad[] = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+
+    send_all(fd, bad, sizeof(bad) - 1);
+    close(fd);
+    return;
+  }
+  if ((f = open_memstream(&text, &len)) == NULL) {
+    close(fd);
+    return;
+  }
+  render(f);
+  fclose(f);
+  if (http) {
+    snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    send_all(fd, head, strlen(head));
+  }
+  send_all(fd, text, len);
+  free(text);
+  close(fd);
+}
+
+static void *
+metrics_thread(void *arg)
+{
+  struct pollfd pfd[3] = {
+    { .fd = stop_pipe[0], .events = POLLIN },
+    { .fd = unix_fd, .events = POLLIN },
+    { .fd = http_fd, .events = POLLIN },
+  };
+
+  (void) arg;
+  for (;;) {
+    if (poll(pfd, 3, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      ERR("poll: %s", strerror(errno));
+      break;
+    }
+    if (pfd[0].revents)
+      break;
+    if (pfd[1].revents & POLLIN)
+      serve(unix_fd, false);
+    if (pfd[2].revents & POLLIN)
+      serve(http_fd, true);
+  }
+  return NULL;
+}
+
+static int
+listen_unix(const char *path)
+{
+  struct sockaddr_un sa;
+  int     fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    ERR("Metrics socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(sa.sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    ERR("socket: %s", strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  if ((bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) || (listen(fd, 4) < 0)) {
+    ERR("Unable to listen on %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+listen_http(int port)
+{
+  struct sockaddr_in sa;
+  const int on = 1;
+  int     fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    ERR("socket: %s", strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if ((bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) || (listen(fd, 4) < 0)) {
+    ERR("Unable to listen on 127.0.0.1:%d: %s", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int
+metrics_start(const char *socket_path, int port)
+{
+  int     res;
+
+  metrics_stop();
+  if (!socket_path[0] && !port)
+    return 0;
+
+  if (socket_path[0]) {
+    if ((unix_fd = listen_unix(socket_path)) < 0)
+      goto fail;
+    snprintf(unix_path, sizeof(unix_path), "%s", socket_path);
+  }
+  if (port && ((http_fd = listen_http(port)) < 0))
+    goto fail;
+  if (pipe2(stop_pipe, O_CLOEXEC) < 0) {
+    ERR("pipe: %s", strerror(errno));
+    goto fail;
+  }
+  if ((res = pthread_create(&server_thread, NULL, metrics_thread, NULL)) != 0) {
+    ERR("pthread_create: %s", strerror(res));
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+    goto fail;
+  }
+  server_running = true;
+  return 0;
+
+fail:
+  server_running = true;
+  metrics_stop();
+  return -1;
+}
+
+void
+metrics_stop(void)
+{
+  if (!server_running)
+    return;
+  if (stop_pipe[1] >= 0) {
+    close(stop_pipe[1]);
+    stop_pipe[1] = -1;
+    pthread_join(server_thread, NULL);
+  }
+  if (stop_pipe[0] >= 0)
+    close(stop_pipe[0]);
+  stop_pipe[0] = -1;
+  if (unix_fd >= 0) {
+    close(unix_fd);
+    unlink(unix_path);
+  }
+  if (http_fd >= 0)
+    close(http_fd);
+  unix_fd = http_fd = -1;
+  server_running = false;
+}
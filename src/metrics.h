@@ -0,0 +1,100 @@
+/*
+ * NFC Event Daemon
+ * Metrics
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file metrics.h
+ * @brief Counters exported in the Prometheus text format
+ *
+ * Every thread updates its own cache line aligned set of counters, without
+ * locks or atomic read-modify-write; a scrape adds up the sets of all
+ * threads.  Counters are machine words and wrap around on 32 bit targets,
+ * which Prometheus handles as a counter reset.
+ *
+ * The text is served on a Unix socket (the whole text is written to every
+ * connection, then it is closed) and optionally over HTTP on localhost.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "latency.h"
+
+typedef enum {
+  METRIC_POLLS,
+  METRIC_TAPS,
+  METRIC_REMOVALS,
+  METRIC_EXPIRIES,
+  METRIC_EVENTS,
+  METRIC_READS_CLASSIC_COMPLETE,
+  METRIC_READS_CLASSIC_PARTIAL,
+  METRIC_READS_CLASSIC_FAILED,
+  METRIC_READS_ULTRALIGHT_COMPLETE,
+  METRIC_READS_ULTRALIGHT_FAILED,
+  METRIC_READS_ISODEP_COMPLETE,
+  METRIC_READS_ISODEP_FAILED,
+  METRIC_AUTH_HITS,
+  METRIC_AUTH_MISSES,
+  METRIC_RESELECTS,
+  METRIC_RESELECT_FAILURES,
+  METRIC_DROPPED_UBUS,
+  METRIC_DROPPED_JOURNAL,
+  METRIC_ACCESS_ALLOWED,
+  METRIC_ACCESS_DENIED,
+  METRIC_READER_DOWN,
+  METRIC_READER_REOPEN_FAILURES,
+  METRIC_DEBITS_OK,
+  METRIC_DEBITS_FAILED,
+  METRIC_NUM_COUNTERS,
+} metric_counter;
+
+typedef enum {
+  METRIC_UBUS_BACKLOG,          /* state changes not notified yet */
+  METRIC_JOURNAL_UNSYNCED,      /* journal bytes not synced yet */
+  METRIC_POLL_INTERVAL,         /* software polling: ms between probes */
+  METRIC_NUM_GAUGES,
+} metric_gauge;
+
+void    metrics_add(metric_counter counter, unsigned long n);
+#define metrics_inc(counter) metrics_add(counter, 1)
+
+/**
+ * @brief Count a card command started at @a start (see latency_start())
+ */
+void    metrics_command(latency_cmd cmd, int64_t start, bool ok);
+
+/**
+ * @brief Set the function a gauge is read with at scrape time, NULL to hide it
+ *
+ * The function is called from the metrics thread.
+ */
+void    metrics_set_gauge(metric_gauge gauge, long (*fn)(void));
+
+/**
+ * @brief Start (or restart) serving the metrics
+ * @param socket_path Unix socket to listen on, empty string for none
+ * @param port TCP port to serve HTTP on, on 127.0.0.1 only; 0 for none
+ * @return 0 on success, -1 on error
+ */
+int     metrics_start(const char *socket_path, int port);
+void    metrics_stop(void);
+
+#endif /* __METRICS_H__ */
@@ -43,6 +43,19 @@
 
 #include <nfc/nfc.h>
 
+#include "device.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+
+static const char *trace_names[] = {
+  [LAT_CMD_AUTH]  = "nfc_initiator_transceive_bytes: auth",
+  [LAT_CMD_READ]  = "nfc_initiator_transceive_bytes: read",
+  [LAT_CMD_WRITE] = "nfc_initiator_transceive_bytes: write",
+  [LAT_CMD_VALUE] = "nfc_initiator_transceive_bytes: value",
+  [LAT_CMD_RATS]  = "nfc_initiator_transceive_bytes: rats",
+};
+
 /**
  * @brief Execute a MIFARE Classic Command
  * @return Returns true if action was successfully performed; otherwise returns false.
@@ -62,34 +75,43 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
   uint8_t  abtRx[265];
   size_t  szParamLen;
   uint8_t  abtCmd[265];
+  latency_cmd lc;
+  int64_t start, t;
   //bool    bEasyFraming;
 
   abtCmd[0] = mc;               // The MIFARE Classic command
   abtCmd[1] = ui8Block;         // The block address (1K=0x00..0x39, 4K=0x00..0xff)
 
   switch (mc) {
-      // Read and store command have no parameter
+      // Read and transfer commands have no parameter
     case MC_READ:
-    case MC_STORE:
       szParamLen = 0;
+      lc = LAT_CMD_READ;
+      break;
+    case MC_TRANSFER:
+      szParamLen = 0;
+      lc = LAT_CMD_VALUE;
       break;
 
       // Authenticate command
     case MC_AUTH_A:
     case MC_AUTH_B:
       szParamLen = sizeof(struct mifare_param_auth);
+      lc = LAT_CMD_AUTH;
       break;
 
       // Data command
     case MC_WRITE:
       szParamLen = sizeof(struct mifare_param_data);
+      lc = LAT_CMD_WRITE;
       break;
 
-      // Value command
+      // Value command; restore takes an operand too, which the tag ignores
     case MC_DECREMENT:
     case MC_INCREMENT:
-    case MC_TRANSFER:
+    case MC_STORE:
       szParamLen = sizeof(struct mifare_param_value);
+      lc = LAT_CMD_VALUE;
       break;
 
       // Please fix your code, you never should reach this statement
@@ -103,20 +125,29 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
 
   // FIXME: Save and restore bEasyFraming
   // bEasyFraming = nfc_device_get_property_bool (pnd, NP_EASY_FRAMING, &bEasyFraming);
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
+  if (nfcd_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0) {
+    nfcd_device_perror(pnd, "nfc_device_set_property_bool");
     return false;
   }
-  // Fire the mifare command
+  // Fire the mifare command, waiting about as long as this command usually takes
   int res;
-  if ((res = nfc_initiator_transceive_bytes(pnd, abtCmd, 2 + szParamLen, abtRx, sizeof(abtRx), -1))  < 0) {
+  start = latency_start();
+  t = trace_begin();
+  res = nfcd_device_transceive(pnd, abtCmd, 2 + szParamLen, abtRx, sizeof(abtRx), latency_timeout(lc));
+  trace_end(TRACE_LIBNFC, trace_names[lc], t, res);
+  metrics_command(lc, start, res >= 0);
+  if (lc == LAT_CMD_AUTH)
+    metrics_inc((res >= 0) ? METRIC_AUTH_HITS : METRIC_AUTH_MISSES);
+  if (res < 0) {
     if (res == NFC_ERFTRANS) {
       // "Invalid received frame",  usual means we are
       // authenticated on a sector but the requested MIFARE cmd (read, write)
       // is not permitted by current acces bytes;
       // So there is nothing to do here.
+    } else if ((res == NFC_ETIMEOUT) || (res == NFC_EMFCAUTHFAIL)) {
+      // Wrong key or tag gone, the caller handles both
     } else {
-      nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+      nfcd_device_perror(pnd, "nfc_initiator_transceive_bytes");
     }
     // XXX nfc_device_set_property_bool (pnd, NP_EASY_FRAMING, bEasyFraming);
     return false;
@@ -128,6 +159,8 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
   }
   */
 
+  latency_record(lc, start);
+
   // When we have executed a read command, copy the received bytes into the param
   if (mc == MC_READ) {
     if (res == 16) {
@@ -139,3 +172,214 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
   // Command succesfully executed
   return true;
 }
+
+/**
+ * @brief Decode the access bits (bytes 6..8 of a sector trailer)
+ * @return Returns false if the inverted copies do not match, in which case the conditions are unknown.
+ */
+bool
+mifare_classic_access_decode(const uint8_t abtAccessBits[4], mifare_classic_access *pma)
+{
+  uint8_t c1 = abtAccessBits[1] >> 4;
+  uint8_t c2 = abtAccessBits[2] & 0x0f;
+  uint8_t c3 = abtAccessBits[2] >> 4;
+  uint8_t i;
+
+  if (((abtAccessBits[0] & 0x0f) != (~c1 & 0x0f)) ||
+      ((abtAccessBits[0] >> 4) != (~c2 & 0x0f)) ||
+      ((abtAccessBits[1] & 0x0f) != (~c3 & 0x0f)))
+    return false;
+
+  for (i = 0; i < 4; i++)
+    pma->abtCond[i] = (((c1 >> i) & 1) << 2) | (((c2 >> i) & 1) << 1) | ((c3 >> i) & 1);
+  return true;
+}
+
+/**
+ * @brief Tell if key B can be used to access the sector
+ *
+ * When the trailer conditions allow reading key B, it is data and the tag
+ * refuses any access after an authentication with it.
+ */
+bool
+mifare_classic_access_key_b_usable(const mifare_classic_access *pma)
+{
+  switch (pma->abtCond[3]) {
+    case 0x0: // 000
+    case 0x2: // 010
+    case 0x1: // 001
+      return false;
+    default:
+      return true;
+  }
+}
+
+/**
+ * @brief Tell if a data block group may be read after authenticating with @a mcAuth
+ */
+bool
+mifare_classic_access_can_read(const mifare_classic_access *pma, const uint8_t ui8Group, const mifare_cmd mcAuth)
+{
+  if ((mcAuth == MC_AUTH_B) && !mifare_classic_access_key_b_usable(pma))
+    return false;
+
+  switch (pma->abtCond[ui8Group]) {
+    case 0x7: // 111: never
+      return false;
+    case 0x3: // 011: key B
+    case 0x5: // 101: key B
+      return mcAuth == MC_AUTH_B;
+    default:  // key A|B
+      return true;
+  }
+}
+
+/**
+ * @brief Tell if the trailer (access bits) may be read after authenticating with @a mcAuth
+ */
+bool
+mifare_classic_access_can_read_trailer(const mifare_classic_access *pma, const mifare_cmd mcAuth)
+{
+  // Access bits are always readable with key A, and with key B whenever it is usable
+  return (mcAuth == MC_AUTH_A) || mifare_classic_access_key_b_usable(pma);
+}
+
+/**
+ * @brief Tell if a value command may be run on a data block group after authenticating with @a mcAuth
+ * @param mc MC_INCREMENT, or MC_DECREMENT, MC_STORE and MC_TRANSFER which share their conditions
+ */
+bool
+mifare_classic_access_can_value(const mifare_classic_access *pma, const uint8_t ui8Group, const mifare_cmd mc,
+                                const mifare_cmd mcAuth)
+{
+  if ((mcAuth == MC_AUTH_B) && !mifare_classic_access_key_b_usable(pma))
+    return false;
+
+  switch (pma->abtCond[ui8Group]) {
+    case 0x0: // 000: transport configuration, key A|B
+      return true;
+    case 0x6: // 110: value block, increment with key B only
+      return (mc != MC_INCREMENT) || (mcAuth == MC_AUTH_B);
+    case 0x1: // 001: value block that can only be decremented
+      return mc != MC_INCREMENT;
+    default:  // read/write blocks
+      return false;
+  }
+}
+
+/**
+ * @brief Decode a value block: the value three times (plain, inverted, plain), then the address byte four times
+ * @param pui8Addr When not NULL, receives the address byte, which value commands keep as it is
+ * @return Returns false if the copies do not match, in which case @a abtData is not a value block.
+ */
+bool
+mifare_classic_value_decode(const uint8_t abtData[16], int32_t *piValue, uint8_t *pui8Addr)
+{
+  uint8_t i;
+
+  for (i = 0; i < 4; i++) {
+    if ((abtData[i] != abtData[i + 8]) || ((abtData[i] ^ abtData[i + 4]) != 0xff))
+      return false;
+  }
+  if ((abtData[12] != abtData[14]) || (abtData[13] != abtData[15]) || ((abtData[12] ^ abtData[13]) != 0xff))
+    return false;
+
+  // Little endian, two's complement
+  *piValue = (int32_t) ((uint32_t) abtData[0] | ((uint32_t) abtData[1] << 8) |
+                        ((uint32_t) abtData[2] << 16) | ((uint32_t) abtData[3] << 24));
+  if (pui8Addr)
+    *pui8Addr = abtData[12];
+  return true;
+}
+
+void
+mifare_classic_value_encode(const int32_t iValue, const uint8_t ui8Addr, uint8_t abtData[16])
+{
+  uint8_t i;
+
+  for (i = 0; i < 4; i++) {
+    abtData[i] = abtData[i + 8] = (uint8_t) ((uint32_t) iValue >> (8 * i));
+    abtData[i + 4] = ~abtData[i];
+  }
+  abtData[12] = abtData[14] = ui8Addr;
+  abtData[13] = abtData[15] = ~ui8Addr;
+}
+
+/**
+ * @brief Access condition group (0..3, 3 is the trailer) of a block
+ */
+uint8_t
+mifare_classic_block_group(const uint8_t ui8Block)
+{
+  if (ui8Block < 128)
+    return ui8Block % 4;
+  if ((ui8Block % 16) == 15)
+    return 3;
+  return (ui8Block % 16) / 5;
+}
+
+/**
+ * @brief First block of a sector: 32 sectors of 4 blocks, then 8 sectors of 16 blocks
+ */
+uint8_t
+mifare_classic_sector_first_block(const uint8_t ui8Sector)
+{
+  if (ui8Sector < 32)
+    return ui8Sector * 4;
+  return 128 + (ui8Sector - 32) * 16;
+}
+
+uint8_t
+mifare_classic_block_sector(const uint8_t ui8Block)
+{
+  if (ui8Block < 128)
+    return ui8Block / 4;
+  return 32 + (ui8Block - 128) / 16;
+}
+
+uint8_t
+mifare_classic_sector_block_count(const uint8_t ui8Sector)
+{
+  return (ui8Sector < 32) ? 4 : 16;
+}
+
+/**
+ * @brief Tell if the image of @a ui8Block was filled by the read that produced @a pmrr
+ */
+bool
+mifare_classic_read_result_has_block(const mifare_classic_read_result *pmrr, const uint8_t ui8Block)
+{
+  return (pmrr->abtBlockMap[ui8Block / 8] >> (ui8Block % 8)) & 0x01;
+}
+
+const char *
+mifare_classic_sector_status_name(const mifare_classic_sector_status mss)
+{
+  static const char *names[] = {
+    [MC_SECTOR_NOT_READ]    = "not_read",
+    [MC_SECTOR_OK]          = "ok",
+    [MC_SECTOR_PARTIAL]     = "partial",
+    [MC_SECTOR_AUTH_FAILED] = "auth_failed",
+    [MC_SECTOR_READ_FAILED] = "read_failed",
+  };
+
+  return names[mss];
+}
+
+const char *
+mifare_classic_value_status_name(const mifare_classic_value_status mvs)
+{
+  static const char *names[] = {
+    [MC_VALUE_OK]           = "ok",
+    [MC_VALUE_INVALID]      = "invalid",
+    [MC_VALUE_AUTH_FAILED]  = "auth_failed",
+    [MC_VALUE_FORBIDDEN]    = "forbidden",
+    [MC_VALUE_NOT_VALUE]    = "not_value_block",
+    [MC_VALUE_OUT_OF_RANGE] = "out_of_range",
+    [MC_VALUE_FAILED]       = "failed",
+    [MC_VALUE_UNVERIFIED]   = "unverified",
+    [MC_VALUE_MISMATCH]     = "mismatch",
+  };
+
+  return names[mvs];
+}
@@ -142,7 +142,115 @@ typedef struct {
 // Reset struct alignment to default
 #  pragma pack()
 
-bool    mifare_classic_read_card(nfc_device *pnd, nfc_target *pnt, bool bUseKeyA, mifare_param *pmp, mifare_classic_tag *ptag);
-bool    mifare_ultralight_read_card(nfc_device *pnd, nfc_target *pnt, mifare_param *pmp, mifareul_tag *ptag);
+// MIFARE Classic access conditions, as C1C2C3 (C1 is bit 2) for each of the
+// three data block groups and the trailer.  On 1K sectors a group is a block,
+// on the 16-block sectors of 4K cards a group is five consecutive blocks.
+typedef struct {
+  uint8_t  abtCond[4];
+} mifare_classic_access;
+
+bool    mifare_classic_access_decode(const uint8_t abtAccessBits[4], mifare_classic_access *pma);
+bool    mifare_classic_access_key_b_usable(const mifare_classic_access *pma);
+bool    mifare_classic_access_can_read(const mifare_classic_access *pma, const uint8_t ui8Group, const mifare_cmd mcAuth);
+bool    mifare_classic_access_can_read_trailer(const mifare_classic_access *pma, const mifare_cmd mcAuth);
+bool    mifare_classic_access_can_value(const mifare_classic_access *pma, const uint8_t ui8Group, const mifare_cmd mc,
+                                        const mifare_cmd mcAuth);
+uint8_t mifare_classic_block_group(const uint8_t ui8Block);
+uint8_t mifare_classic_sector_first_block(const uint8_t ui8Sector);
+uint8_t mifare_classic_block_sector(const uint8_t ui8Block);
+uint8_t mifare_classic_sector_block_count(const uint8_t ui8Sector);
+
+// Outcome of reading one MIFARE Classic sector
+typedef enum {
+  MC_SECTOR_NOT_READ = 0,   // not reached: read aborted or tag removed before
+  MC_SECTOR_OK,             // every block the known keys may read was read
+  MC_SECTOR_PARTIAL,        // some blocks read before a failure
+  MC_SECTOR_AUTH_FAILED,    // no known key opens the sector
+  MC_SECTOR_READ_FAILED,    // authenticated, but nothing could be read
+} mifare_classic_sector_status;
+
+typedef struct {
+  uint32_t uiBlocks;
+  uint32_t uiSectors;
+  uint32_t uiReadBlocks;
+  uint32_t uiSkippedBlocks;     // forbidden by the access conditions
+  uint32_t uiFailedSectors;
+  uint32_t uiUnwantedSectors;   // left out by the sector filter
+  bool     bCancelled;          // stopped by the sector callback
+  uint8_t  abtSectorStatus[40]; // mifare_classic_sector_status
+  uint8_t  abtBlockMap[32];     // one bit per block, set when its image is valid
+} mifare_classic_read_result;
+
+typedef struct {
+  bool     bTolerateFailures;   // carry on past a failed sector
+  // Sectors to read first, in this order; the others follow from the last one
+  const uint8_t *pui8SectorOrder;
+  size_t   szSectorOrder;
+  // Called as soon as each sector is done, whatever its status; returning
+  // false cancels the rest of the read
+  bool   (*pfnSectorDone)(void *pvUser, const uint8_t ui8Sector, const mifare_classic_tag *ptag,
+                          const mifare_classic_read_result *pmrr);
+  // Called before each sector with what was read so far; returning false
+  // leaves the sector out, without a command sent
+  bool   (*pfnSectorWanted)(void *pvUser, const uint8_t ui8Sector, const mifare_classic_tag *ptag,
+                            const mifare_classic_read_result *pmrr);
+  void    *pvUser;
+} mifare_classic_read_opts;
+
+bool    mifare_classic_read_result_has_block(const mifare_classic_read_result *pmrr, const uint8_t ui8Block);
+const char *mifare_classic_sector_status_name(const mifare_classic_sector_status mss);
+
+// MIFARE Classic value blocks: a signed 32 bit value, stored plain, inverted
+// and plain again, then an address byte (free for the application, usually
+// the block number) stored plain, inverted, plain, inverted.
+bool    mifare_classic_value_decode(const uint8_t abtData[16], int32_t *piValue, uint8_t *pui8Addr);
+void    mifare_classic_value_encode(const int32_t iValue, const uint8_t ui8Addr, uint8_t abtData[16]);
+
+// One operation of a batch on the value blocks of a sector: increment,
+// decrement or restore (copy) ui8Block, then transfer the result to ui8Dest
+typedef struct {
+  mifare_cmd mc;              // MC_INCREMENT, MC_DECREMENT or MC_STORE
+  uint8_t  ui8Block;
+  uint8_t  ui8Dest;           // often ui8Block; another block keeps a backup
+  uint32_t uiAmount;          // increment and decrement only
+  int32_t  iBefore;           // out: value of ui8Block before the operation
+  int32_t  iAfter;            // out: value transferred to ui8Dest
+} mifare_classic_value_op;
+
+// Outcome of a batch of value operations
+typedef enum {
+  MC_VALUE_OK = 0,            // every operation applied and read back
+  MC_VALUE_INVALID,           // blocks out of one sector, or not data blocks
+  MC_VALUE_AUTH_FAILED,       // no known key opens the sector
+  MC_VALUE_FORBIDDEN,         // the access conditions refuse an operation to the keys known
+  MC_VALUE_NOT_VALUE,         // a block operated on is not a value block
+  MC_VALUE_OUT_OF_RANGE,      // a decrement below zero, or an increment past INT32_MAX
+  MC_VALUE_FAILED,            // refused or tag lost before any transfer: the card is unchanged
+  MC_VALUE_UNVERIFIED,        // tag lost after a transfer: some operations may have been applied
+  MC_VALUE_MISMATCH,          // a block read back does not hold the expected value
+} mifare_classic_value_status;
+
+const char *mifare_classic_value_status_name(const mifare_classic_value_status mvs);
+
+// The card engine functions below run on a session (session.h), which holds
+// the device, the key dictionary and what was learnt about the cards
+struct nfcd_session;
+
+int     mifare_classic_read_keys(const char *path, uint8_t **ppbtKeys);
+void    mifare_classic_set_keys(struct nfcd_session *ps, uint8_t *pbtKeys, size_t szKeys);
+int     mifare_classic_load_keys(struct nfcd_session *ps, const char *path);
+void    mifare_classic_set_abort_handler(struct nfcd_session *ps, bool (*handler)(void *pvUser));
+void    mifare_classic_set_field_shared(struct nfcd_session *ps, bool bShared);
+void    mifare_classic_set_key_provider(struct nfcd_session *ps,
+                                        bool (*provider)(void *pvUser, const uint8_t *pbtUid, size_t szUidLen,
+                                                         uint8_t ui8Sector, mifare_cmd mc, uint8_t abtKey[6]));
+bool    mifare_classic_read_card(struct nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp,
+                                 const mifare_classic_read_opts *pmro, mifare_classic_tag *ptag,
+                                 mifare_classic_read_result *pmrr);
+bool    mifare_classic_write_card(struct nfcd_session *ps, const nfc_target *pnt, bool bUseKeyA, mifare_param *pmp,
+                                  mifare_classic_tag *ptag);
+mifare_classic_value_status mifare_classic_value_apply(struct nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp,
+                                                       mifare_classic_value_op *pmvo, size_t szOps);
+bool    mifare_ultralight_read_card(struct nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp, mifareul_tag *ptag);
 
 #endif // _LIBNFC_MIFARE_H_
@@ -0,0 +1,348 @@
+/*
+ * NFC Event Daemon
+ * NDEF and MAD parsing
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file ndef.c
+ * @brief NDEF messages and the MIFARE Application Directory, decoded in place
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "ndef.h"
+
+/* General purpose byte of the sector 0 trailer */
+#define MAD_GPB_DA 0x80           /* a MAD is present */
+#define MAD_GPB_VERSION 0x03
+
+#define MAD_CRC_PRESET 0xc7
+
+#define TLV_NULL 0x00
+#define TLV_NDEF 0x03
+#define TLV_TERMINATOR 0xfe
+
+#define NDEF_MB 0x80
+#define NDEF_ME 0x40
+#define NDEF_CF 0x20
+#define NDEF_SR 0x10
+#define NDEF_IL 0x08
+#define NDEF_TNF 0x07
+
+/**
+ * @brief CRC-8 of AN10787: x^8 + x^4 + x^3 + x^2 + 1, preset 0xc7
+ */
+static uint8_t
+mad_crc(uint8_t crc, const uint8_t *data, size_t len)
+{
+  size_t  i;
+  int     bit;
+
+  for (i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x1d) : (uint8_t) (crc << 1);
+  }
+  return crc;
+}
+
+bool
+mad_present(const mifare_classic_tag *ptag, const mifare_classic_read_result *pmrr, bool *mad2)
+{
+  uint8_t gpb;
+
+  if (!mifare_classic_read_result_has_block(pmrr, 3))
+    return false;
+  gpb = ptag->amb[3].mbt.abtAccessBits[3];
+  if (!(gpb & MAD_GPB_DA))
+    return false;
+  switch (gpb & MAD_GPB_VERSION) {
+    case 1:
+      *mad2 = false;
+      return true;
+    case 2:
+      *mad2 = true;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @brief Decode the directory in @a count consecutive blocks from @a block, for the sectors from @a sector
+ *
+ * Byte 0 is the CRC of the others, byte 1 the info byte, then come two
+ * bytes per sector: application code, function cluster code.
+ */
+static bool
+mad_decode_blocks(const mifare_classic_tag *ptag, const mifare_classic_read_result *pmrr, uint8_t block,
+                  uint8_t count, uint8_t sector, mad *pmad)
+{
+  uint8_t data[48];
+  uint8_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!mifare_classic_read_result_has_block(pmrr, block + i))
+      return false;
+    memcpy(data + 16 * i, ptag->amb[block + i].mbd.abtData, 16);
+  }
+  if (mad_crc(MAD_CRC_PRESET, data + 1, 16 * count - 1) != data[0])
+    return false;
+  for (i = 2; i < 16 * count; i += 2)
+    pmad->aid[sector++] = data[i] | (data[i + 1] << 8);
+  return true;
+}
+
+bool
+mad_decode(const mifare_classic_tag *ptag, const mifare_classic_read_result *pmrr, mad *pmad)
+{
+  bool    mad2;
+
+  memset(pmad, 0, sizeof(*pmad));
+  if (!mad_present(ptag, pmrr, &mad2))
+    return false;
+  // MAD1 in blocks 1 and 2, for sectors 1 to 15
+  if (!mad_decode_blocks(ptag, pmrr, 1, 2, 1, pmad))
+    return false;
+  pmad->version = mad2 ? 2 : 1;
+  pmad->sectors = 16;
+  // MAD2 in sector 16, for sectors 17 to 39
+  if (!mad2 || (pmrr->uiSectors < MAD_SECTORS) || !mifare_classic_read_result_has_block(pmrr, 64))
+    return true;
+  if (!mad_decode_blocks(ptag, pmrr, 64, 3, 17, pmad))
+    return false;
+  pmad->sectors = MAD_SECTORS;
+  return true;
+}
+
+size_t
+mad_sectors(const mad *pmad, uint16_t aid, uint8_t sectors[MAD_SECTORS])
+{
+  size_t  count = 0;
+  uint8_t sector;
+
+  for (sector = 1; sector < pmad->sectors; sector++) {
+    if ((sector != 16) && (pmad->aid[sector] == aid))
+      sectors[count++] = sector;
+  }
+  return count;
+}
+
+void
+ndef_area_classic(ndef_area *area, const mifare_classic_tag *ptag, const uint8_t *sectors, size_t count)
+{
+  size_t  i;
+
+  memset(area, 0, sizeof(*area));
+  for (i = 0; (i < count) && (i < NDEF_MAX_RUNS); i++) {
+    const uint8_t first = mifare_classic_sector_first_block(sectors[i]);
+
+    // Every block of the sector but its trailer
+    area->run[i] = ptag->amb[first].mbd.abtData;
+    area->run_len[i] = 16 * (mifare_classic_sector_block_count(sectors[i]) - 1);
+    area->len += area->run_len[i];
+  }
+  area->runs = i;
+}
+
+bool
+ndef_area_ultralight(ndef_area *area, const mifareul_tag *ptag)
+{
+  // Capability container in page 3: magic, version, data size / 8, access
+  const uint8_t *cc = ptag->amb[0].mbd.abtData + 12;
+  size_t  len = cc[2] * 8;
+
+  memset(area, 0, sizeof(*area));
+  if (cc[0] != 0xe1)
+    return false;
+  // Data from page 4 on, as far as the image goes
+  if (len > sizeof(*ptag) - 16)
+    len = sizeof(*ptag) - 16;
+  area->run[0] = ptag->amb[1].mbd.abtData;
+  area->run_len[0] = len;
+  area->runs = 1;
+  area->len = len;
+  return true;
+}
+
+size_t
+ndef_view_chunk(const ndef_view *view, size_t offset, const uint8_t **data)
+{
+  const ndef_area *area = view->area;
+  size_t  pos, i, len;
+
+  if (offset >= view->len)
+    return 0;
+  pos = view->offset + offset;
+  for (i = 0; i < area->runs; i++) {
+    if (pos < area->run_len[i]) {
+      *data = area->run[i] + pos;
+      len = area->run_len[i] - pos;
+      return (len < view->len - offset) ? len : view->len - offset;
+    }
+    pos -= area->run_len[i];
+  }
+  return 0;
+}
+
+size_t
+ndef_view_copy(const ndef_view *view, void *dst, size_t size)
+{
+  const uint8_t *data;
+  size_t  done = 0, len;
+
+  while ((done < size) && ((len = ndef_view_chunk(view, done, &data)) > 0)) {
+    if (len > size - done)
+      len = size - done;
+    memcpy((uint8_t *) dst + done, data, len);
+    done += len;
+  }
+  return done;
+}
+
+bool
+ndef_view_equals(const ndef_view *view, const void *data, size_t len)
+{
+  const uint8_t *chunk;
+  size_t  done = 0, n;
+
+  if (view->len != len)
+    return false;
+  while ((n = ndef_view_chunk(view, done, &chunk)) > 0) {
+    if (memcmp(chunk, (const uint8_t *) data + done, n))
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+/**
+ * @brief Byte at @a offset of @a view, -1 past its end
+ */
+static int
+view_byte(const ndef_view *view, size_t offset)
+{
+  const uint8_t *data;
+
+  return ndef_view_chunk(view, offset, &data) ? *data : -1;
+}
+
+/**
+ * @brief The @a len bytes of @a view from @a offset, if it has them
+ */
+static bool
+view_sub(const ndef_view *view, size_t offset, size_t len, ndef_view *sub)
+{
+  if ((offset > view->len) || (len > view->len - offset))
+    return false;
+  sub->area = view->area;
+  sub->offset = view->offset + offset;
+  sub->len = len;
+  return true;
+}
+
+int
+ndef_find_message(const ndef_area *area, ndef_view *message)
+{
+  const ndef_view all = { .area = area, .offset = 0, .len = area->len };
+  size_t  pos = 0, len;
+  int     type, b;
+
+  while ((type = view_byte(&all, pos)) >= 0) {
+    pos++;
+    if (type == TLV_NULL)
+      continue;
+    if (type == TLV_TERMINATOR)
+      return 0;
+    // One length byte, or 0xff and two more, big endian
+    if ((b = view_byte(&all, pos++)) < 0)
+      return -1;
+    len = b;
+    if (b == 0xff) {
+      if ((b = view_byte(&all, pos)) < 0)
+        return -1;
+      len = b << 8;
+      if ((b = view_byte(&all, pos + 1)) < 0)
+        return -1;
+      len |= b;
+      pos += 2;
+    }
+    if (type == TLV_NDEF)
+      return view_sub(&all, pos, len, message) ? 1 : -1;
+    // Lock and memory control, proprietary: skipped
+    pos += len;
+  }
+  return 0;
+}
+
+void
+ndef_reader_init(ndef_reader *pnr, const ndef_view *message)
+{
+  pnr->message = *message;
+  pnr->next = 0;
+  pnr->done = (message->len == 0);
+}
+
+int
+ndef_next_record(ndef_reader *pnr, ndef_record *record)
+{
+  const ndef_view *m = &pnr->message;
+  size_t  pos = pnr->next;
+  size_t  type_len, id_len = 0, payload_len;
+  int     flags, b, i;
+
+  if (pnr->done)
+    return 0;
+  if (((flags = view_byte(m, pos++)) < 0) || ((b = view_byte(m, pos++)) < 0))
+    return -1;
+  type_len = b;
+  if (flags & NDEF_SR) {
+    if ((b = view_byte(m, pos++)) < 0)
+      return -1;
+    payload_len = b;
+  } else {
+    payload_len = 0;
+    for (i = 0; i < 4; i++) {
+      if ((b = view_byte(m, pos++)) < 0)
+        return -1;
+      payload_len = (payload_len << 8) | b;
+    }
+  }
+  if (flags & NDEF_IL) {
+    if ((b = view_byte(m, pos++)) < 0)
+      return -1;
+    id_len = b;
+  }
+
+  record->tnf = flags & NDEF_TNF;
+  record->begin = flags & NDEF_MB;
+  record->end = flags & NDEF_ME;
+  record->chunked = flags & NDEF_CF;
+  if (!view_sub(m, pos, type_len, &record->type) ||
+      !view_sub(m, pos + type_len, id_len, &record->id) ||
+      !view_sub(m, pos + type_len + id_len, payload_len, &record->payload))
+    return -1;
+  pnr->next = pos + type_len + id_len + payload_len;
+  pnr->done = record->end || (pnr->next >= m->len);
+  return 1;
+}
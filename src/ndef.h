@@ -0,0 +1,164 @@
+/*
+ * NFC Event Daemon
+ * NDEF and MAD parsing
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file ndef.h
+ * @brief NDEF messages and the MIFARE Application Directory, decoded in place
+ *
+ * Nothing is copied out of the card image.  The data of an application is
+ * an ndef_area: the data blocks of its sectors, in sector order, as runs of
+ * the image between the trailers (one run for a MIFARE Ultralight).  An
+ * ndef_view is a range of an area; ndef_view_chunk() hands out its bytes a
+ * contiguous run at a time, ndef_view_copy() flattens it for the callers
+ * that need it.  Views stay valid as long as the image and the area do.
+ *
+ * Decoding is lazy: ndef_find_message() only walks the TLVs up to the NDEF
+ * message, and ndef_next_record() decodes one record header per call.
+ *
+ * mad_decode() reads the MAD (AN10787) of a MIFARE Classic image, from the
+ * blocks of sector 0, and of sector 16 for a MAD2.  mad_sectors() tells
+ * which sectors an application occupies, which is what a read plan needs
+ * to read no more of the card than the application.
+ */
+
+#ifndef __NDEF_H__
+#define __NDEF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mifare.h"
+
+#define MAD_SECTORS 40
+#define MAD_AID_NDEF 0xe103       /* NFC Forum NDEF application */
+
+typedef struct {
+  uint8_t version;                /* 1 or 2 */
+  uint8_t sectors;                /* sectors covered: 16, 40 once both halves of a MAD2 are read */
+  uint16_t aid[MAD_SECTORS];      /* application of each sector, 0 if free or the MAD's */
+} mad;
+
+typedef enum {
+  NDEF_TNF_EMPTY = 0,
+  NDEF_TNF_WELL_KNOWN,
+  NDEF_TNF_MEDIA,
+  NDEF_TNF_URI,
+  NDEF_TNF_EXTERNAL,
+  NDEF_TNF_UNKNOWN,
+  NDEF_TNF_UNCHANGED,
+} ndef_tnf;
+
+#define NDEF_MAX_RUNS MAD_SECTORS
+
+typedef struct {
+  const uint8_t *run[NDEF_MAX_RUNS];
+  uint16_t run_len[NDEF_MAX_RUNS];
+  size_t  runs;
+  size_t  len;                    /* bytes over all the runs */
+} ndef_area;
+
+typedef struct {
+  const ndef_area *area;
+  size_t  offset;                 /* in the area */
+  size_t  len;
+} ndef_view;
+
+typedef struct {
+  ndef_tnf tnf;
+  bool    begin;                  /* MB: first record of the message */
+  bool    end;                    /* ME: last record of the message */
+  bool    chunked;                /* CF: continued in the next record */
+  ndef_view type;
+  ndef_view id;
+  ndef_view payload;
+} ndef_record;
+
+/* Where ndef_next_record() is in a message */
+typedef struct {
+  ndef_view message;
+  size_t  next;                   /* offset of the next record in the message */
+  bool    done;
+} ndef_reader;
+
+/**
+ * @brief Decode the MAD of @a ptag
+ * @param pmrr Tells which blocks of the image were read
+ *
+ * The first half of a MAD2 decodes on its own, until sector 16 is read.
+ *
+ * @return false if the card has no MAD, or it was not read, or its CRC is wrong
+ */
+bool    mad_decode(const mifare_classic_tag *ptag, const mifare_classic_read_result *pmrr, mad *pmad);
+
+/**
+ * @brief Sectors holding the application @a aid, in order
+ * @return Number of sectors stored in @a sectors
+ */
+size_t  mad_sectors(const mad *pmad, uint16_t aid, uint8_t sectors[MAD_SECTORS]);
+
+/**
+ * @brief Tell from the trailer of sector 0, once read, if the card has a MAD
+ * @param mad2 Set if it is a MAD2, whose second half is in sector 16
+ */
+bool    mad_present(const mifare_classic_tag *ptag, const mifare_classic_read_result *pmrr, bool *mad2);
+
+/**
+ * @brief The data blocks of @a sectors in a MIFARE Classic image, as an area
+ */
+void    ndef_area_classic(ndef_area *area, const mifare_classic_tag *ptag, const uint8_t *sectors, size_t count);
+
+/**
+ * @brief The data pages of a MIFARE Ultralight image, after its capability container
+ * @return false if the capability container does not announce NDEF
+ */
+bool    ndef_area_ultralight(ndef_area *area, const mifareul_tag *ptag);
+
+/**
+ * @brief Find the first NDEF message TLV of @a area
+ * @return 1 if found, 0 if there is none, -1 if the TLVs are malformed
+ */
+int     ndef_find_message(const ndef_area *area, ndef_view *message);
+
+void    ndef_reader_init(ndef_reader *pnr, const ndef_view *message);
+
+/**
+ * @brief Decode the next record of a message
+ * @return 1 if @a record was filled, 0 at the end of the message, -1 if it is malformed
+ */
+int     ndef_next_record(ndef_reader *pnr, ndef_record *record);
+
+/**
+ * @brief Contiguous bytes of @a view from @a offset on, without copying
+ * @return Number of bytes at @a *data, 0 past the end of the view
+ */
+size_t  ndef_view_chunk(const ndef_view *view, size_t offset, const uint8_t **data);
+
+/**
+ * @brief Copy up to @a size bytes of @a view to @a dst
+ * @return Number of bytes copied
+ */
+size_t  ndef_view_copy(const ndef_view *view, void *dst, size_t size);
+
+/**
+ * @brief Compare @a view with @a len bytes at @a data
+ */
+bool    ndef_view_equals(const ndef_view *view, const void *data, size_t len);
+
+#endif /* __NDEF_H__ */
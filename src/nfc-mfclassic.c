@@ -56,6 +56,11 @@
 #include <nfc/nfc.h>
 
 #include "mifare.h"
+#include "device.h"
+#include "session.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
 #include "nfc-utils.h"
 
 #if 0
@@ -72,8 +77,14 @@ static bool bTolerateFailures;
 static bool bFormatCard;
 static bool magic2 = false;
 static uint8_t uiBlocks;
+
+uint8_t  abtHalt[4] = { 0x50, 0x00, 0x00, 0x00 };
+
+// special unlock command
+uint8_t  abtUnlock1[1] = { 0x40 };
+uint8_t  abtUnlock2[1] = { 0x43 };
 #endif
-static uint8_t keys[] = {
+static const uint8_t default_keys[] = {
   0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
   0xd3, 0xf7, 0xd3, 0xf7, 0xd3, 0xf7,
   0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5,
@@ -90,18 +101,152 @@ static const nfc_modulation nmMifare = {
   .nbr = NBR_106,
 };
 
-static size_t num_keys = sizeof(keys) / 6;
+/**
+ * @brief Read a key dictionary, without installing it
+ * @param path Text file holding one 6-byte key per line as 12 hex digits; '#' starts a comment.
+ * @param ppbtKeys Receives the keys, 6 bytes each, for mifare_classic_set_keys()
+ * @return Returns the number of keys read, or -1 if the file could not be parsed.
+ */
+int
+mifare_classic_read_keys(const char *path, uint8_t **ppbtKeys)
+{
+  FILE   *pfKeys;
+  char    line[128];
+  uint8_t *new_keys = NULL;
+  size_t  new_num_keys = 0;
+  int     iLine = 0;
+
+  if ((pfKeys = fopen(path, "r")) == NULL) {
+    ERR("Could not open keys file: %s", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), pfKeys)) {
+    uint8_t abtKey[6];
+    size_t  szNibbles = 0;
+    char   *p;
+
+    iLine++;
+    for (p = line; *p && (*p != '#'); p++) {
+      if (isxdigit((unsigned char) *p)) {
+        if (szNibbles == 12)
+          break;
+        uint8_t n = isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a' + 10);
+        if (szNibbles % 2 == 0)
+          abtKey[szNibbles / 2] = n << 4;
+        else
+          abtKey[szNibbles / 2] |= n;
+        szNibbles++;
+      } else if (!isspace((unsigned char) *p) && (*p != ':')) {
+        break;
+      }
+    }
+    if (szNibbles == 0 && ((*p == '\0') || (*p == '#')))
+      continue;
+    if ((szNibbles != 12) || ((*p != '\0') && (*p != '#'))) {
+      ERR("%s:%d: invalid key", path, iLine);
+      free(new_keys);
+      fclose(pfKeys);
+      return -1;
+    }
+    uint8_t *p2 = realloc(new_keys, (new_num_keys + 1) * 6);
+    if (p2 == NULL) {
+      free(new_keys);
+      fclose(pfKeys);
+      return -1;
+    }
+    new_keys = p2;
+    memcpy(new_keys + new_num_keys * 6, abtKey, 6);
+    new_num_keys++;
+  }
+  fclose(pfKeys);
 
-#define MAX_FRAME_LEN 264
+  if (new_num_keys == 0) {
+    ERR("No key found in %s", path);
+    return -1;
+  }
+  *ppbtKeys = new_keys;
+  return new_num_keys;
+}
 
-static uint8_t abtRx[MAX_FRAME_LEN];
+/**
+ * @brief Replace the key dictionary a session uses to guess sector keys
+ * @param pbtKeys Keys from mifare_classic_read_keys(), owned by the session from now on; NULL restores the built-in dictionary.
+ */
+void
+mifare_classic_set_keys(nfcd_session *ps, uint8_t *pbtKeys, size_t szKeys)
+{
+  if (ps->pbtKeys && (ps->pbtKeys != default_keys))
+    free((void *) ps->pbtKeys);
+  if (pbtKeys == NULL) {
+    ps->pbtKeys = default_keys;
+    ps->szKeys = sizeof(default_keys) / 6;
+  } else {
+    ps->pbtKeys = pbtKeys;
+    ps->szKeys = szKeys;
+  }
+}
 
-uint8_t  abtHalt[4] = { 0x50, 0x00, 0x00, 0x00 };
+/**
+ * @brief Replace the key dictionary a session uses to guess sector keys
+ * @return Returns the number of keys loaded, or -1 if the file could not be parsed (the current dictionary is kept).
+ * @param path Same format as for mifare_classic_read_keys(). NULL or "" restores the built-in dictionary.
+ */
+int
+mifare_classic_load_keys(nfcd_session *ps, const char *path)
+{
+  uint8_t *pbtKeys;
+  int     res;
 
-// special unlock command
-uint8_t  abtUnlock1[1] = { 0x40 };
-uint8_t  abtUnlock2[1] = { 0x43 };
+  if ((path == NULL) || (*path == '\0')) {
+    mifare_classic_set_keys(ps, NULL, 0);
+    return ps->szKeys;
+  }
+  if ((res = mifare_classic_read_keys(path, &pbtKeys)) < 0)
+    return -1;
+  mifare_classic_set_keys(ps, pbtKeys, res);
+  return res;
+}
+
+/**
+ * @brief Install a predicate polled at every sector boundary of a read or write
+ *
+ * It is called with the pvUser of the session.  When it returns true the
+ * operation stops before starting the next sector, so a write never leaves a
+ * sector half updated, and nfcd_session_poll() does not poll.
+ */
+void
+mifare_classic_set_abort_handler(nfcd_session *ps, bool (*handler)(void *pvUser))
+{
+  ps->pfnAbort = handler;
+}
 
+/**
+ * @brief Tell whether other cards share the field with the ones about to be read
+ *
+ * The field cycle after RATS would reset them, so while they are there a
+ * card whose size only RATS can tell is taken for a 1K, and probed once it
+ * is alone.
+ */
+void
+mifare_classic_set_field_shared(nfcd_session *ps, bool bShared)
+{
+  ps->bFieldShared = bShared;
+}
+
+/**
+ * @brief Install a function computing the key of a sector, NULL to remove it
+ *
+ * When no key is given to a read or write, the provided key is tried first and
+ * the dictionary only if the tag refuses it, so a card whose keys are all
+ * derived authenticates every sector in a single attempt.
+ */
+void
+mifare_classic_set_key_provider(nfcd_session *ps,
+                                bool (*provider)(void *pvUser, const uint8_t *pbtUid, size_t szUidLen,
+                                                 uint8_t ui8Sector, mifare_cmd mc, uint8_t abtKey[6]))
+{
+  ps->pfnKeyProvider = provider;
+}
 
 static void
 print_success_or_failure(bool bFailure, uint32_t *uiBlockCounter)
@@ -144,181 +289,693 @@ get_trailer_block(uint32_t uiFirstBlock)
   return trailer_block;
 }
 
+static  uint32_t
+get_sector_count(uint32_t uiBlocks)
+{
+  if (uiBlocks < 128)
+    return (uiBlocks + 1) / 4;
+  return 32 + (uiBlocks + 1 - 128) / 16;
+}
+
 static  bool
-authenticate(nfc_device *pnd, nfc_target *pnt, bool bUseKeyA, uint32_t uiBlock, mifare_param *pmp)
+reselect(nfcd_session *ps, const nfc_target *pnt)
+{
+  int64_t t = trace_begin();
+  int     res;
+
+  metrics_inc(METRIC_RESELECTS);
+  res = nfcd_device_select(ps->dev.pnd, nmMifare, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen, NULL);
+  trace_end(TRACE_LIBNFC, "nfc_initiator_select_passive_target", t, res);
+  if (res <= 0) {
+    metrics_inc(METRIC_RESELECT_FAILURES);
+    ERR("tag was removed");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Authenticate a sector with the given key, or by trying the dictionary
+ * @param pbtKey When not NULL, receives the key that worked
+ *
+ * A failed authentication halts the tag, so it is reselected after each miss
+ * and is ready for another attempt when 0 is returned.
+ *
+ * @return 1 when authenticated, 0 when no key was accepted, -1 if the tag is gone
+ */
+static  int
+authenticate(nfcd_session *ps, const nfc_target *pnt, mifare_cmd mc, uint32_t uiBlock, mifare_param *pmp, uint8_t *pbtKey)
 {
-  mifare_cmd mc;
+  nfc_device *pnd = ps->dev.pnd;
   mifare_param mp;
 
   // Set the authentication information (uid)
   memcpy(mp.mpa.abtAuthUid, pnt->nti.nai.abtUid + pnt->nti.nai.szUidLen - 4, 4);
 
-  // Should we use key A or B?
-  mc = (bUseKeyA) ? MC_AUTH_A : MC_AUTH_B;
-
   if (pmp) {
     memcpy(mp.mpa.abtKey, pmp->mpa.abtKey, 6);
-    if (nfc_initiator_select_passive_target(pnd, nmMifare, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen, NULL) <= 0) {
-      ERR("tag was removed");
-      return false;
+    if (nfc_initiator_mifare_cmd(pnd, mc, uiBlock, &mp)) {
+      if (pbtKey)
+        memcpy(pbtKey, mp.mpa.abtKey, 6);
+      return 1;
     }
+    if (!reselect(ps, pnt))
+      return -1;
   } else {
-    // If no key specifying, try to guess the right key
-    for (size_t key_index = 0; key_index < num_keys; key_index++) {
-      memcpy(mp.mpa.abtKey, keys + (key_index * 6), 6);
+    // A key derived for this card and sector, when a provider can compute one
+    if (ps->pfnKeyProvider &&
+        ps->pfnKeyProvider(ps->pvUser, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen, mifare_classic_block_sector(uiBlock),
+                           mc, mp.mpa.abtKey)) {
       if (nfc_initiator_mifare_cmd(pnd, mc, uiBlock, &mp)) {
-        return true;
+        if (pbtKey)
+          memcpy(pbtKey, mp.mpa.abtKey, 6);
+        return 1;
       }
-      if (nfc_initiator_select_passive_target(pnd, nmMifare, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen, NULL) <= 0) {
-        ERR("tag was removed");
-        return false;
+      if (!reselect(ps, pnt))
+        return -1;
+    }
+    // If no key specifying, try to guess the right key
+    for (size_t key_index = 0; key_index < ps->szKeys; key_index++) {
+      memcpy(mp.mpa.abtKey, ps->pbtKeys + (key_index * 6), 6);
+      if (nfc_initiator_mifare_cmd(pnd, mc, uiBlock, &mp)) {
+        if (pbtKey)
+          memcpy(pbtKey, mp.mpa.abtKey, 6);
+        return 1;
       }
+      if (!reselect(ps, pnt))
+        return -1;
     }
   }
 
-  return false;
+  return 0;
 }
 
-
+/**
+ * @brief Send RATS, which only ISO14443-4 capable cards answer
+ *
+ * A card that answered is in the ISO14443-4 layer and has to be powered down
+ * to talk MIFARE Classic again, so the field is cycled.  One that did not
+ * answer went back to idle.  Either way the tag has to be selected again.
+ *
+ * @return ATS length, 0 if the card did not answer, -1 on error
+ */
 static int
-get_rats(nfc_device *pnd, nfc_target *pnt)
+get_rats(nfcd_session *ps, const nfc_target *pnt)
 {
+  nfc_device *pnd = ps->dev.pnd;
   int res;
+  int64_t start, t;
   uint8_t  abtRats[2] = { 0xe0, 0x50};
   // Use raw send/receive methods
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0) {
-    nfc_perror(pnd, "nfc_configure");
+  if (nfcd_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0) {
+    nfcd_device_perror(pnd, "nfc_configure");
     return -1;
   }
-  res = nfc_initiator_transceive_bytes(pnd, abtRats, sizeof(abtRats), abtRx, sizeof(abtRx), 0);
+  start = latency_start();
+  t = trace_begin();
+  res = nfcd_device_transceive(pnd, abtRats, sizeof(abtRats), ps->abtRx, sizeof(ps->abtRx), latency_timeout(LAT_CMD_RATS));
+  trace_end(TRACE_LIBNFC, "nfc_initiator_transceive_bytes: rats", t, res);
+  metrics_command(LAT_CMD_RATS, start, res > 0);
   if (res > 0) {
+    latency_record(LAT_CMD_RATS, start);
     // ISO14443-4 card, turn RF field off/on to access ISO14443-3 again
-    if (nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false) < 0) {
-      nfc_perror(pnd, "nfc_configure");
+    if (nfcd_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false) < 0) {
+      nfcd_device_perror(pnd, "nfc_configure");
       return -1;
     }
-    if (nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true) < 0) {
-      nfc_perror(pnd, "nfc_configure");
+    if (nfcd_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true) < 0) {
+      nfcd_device_perror(pnd, "nfc_configure");
       return -1;
     }
+  } else {
+    res = 0;
   }
-#if 0
-  // Reselect tag
-  if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, pnt) <= 0) {
-    printf("Error: tag disappeared\n");
-    return -1;
-  }
-#endif
   return res;
 }
 
+// Sizes told by ATQA and SAK; the first matching entry wins
+static const struct {
+  uint8_t  btAtqaMask;    // applied to the second ATQA byte
+  uint8_t  btAtqa;
+  uint8_t  btSakMask;
+  uint8_t  btSak;
+  uint8_t  uiBlocks;
+  bool     bProbe;        // ambiguous, RATS has to tell
+} size_fingerprints[] = {
+  { 0x02, 0x02, 0x00, 0x00, 0xff, false },  // 4K
+  { 0x00, 0x00, 0x01, 0x01, 0x13, false },  // Mini, 320 bytes
+  { 0x00, 0x00, 0xff, 0x88, 0x3f, false },  // Infineon 1K
+  { 0x00, 0x00, 0x00, 0x00, 0x3f, true  },  // 1K, or Plus 2K in security level 1
+};
+
+// Sizes found by RATS are kept in the session
 static int
-get_uiblocks(nfc_device *pnd, nfc_target *pnt)
+size_cache_lookup(const nfcd_session *ps, const nfc_target *pnt)
 {
-  uint8_t uiblocks;
+  for (size_t i = 0; i < ps->szSizeCacheUsed; i++) {
+    if ((ps->asc[i].szUidLen == pnt->nti.nai.szUidLen) &&
+        (memcmp(ps->asc[i].abtUid, pnt->nti.nai.abtUid, ps->asc[i].szUidLen) == 0))
+      return ps->asc[i].uiBlocks;
+  }
+  return -1;
+}
 
-  // Guessing size
-  if ((pnt->nti.nai.abtAtqa[1] & 0x02) == 0x02)
-    // 4K
-    uiblocks = 0xff;
-  else if ((pnt->nti.nai.btSak & 0x01) == 0x01)
-    // 320b
-    uiblocks = 0x13;
-  else
-    // 1K/2K, checked through RATS
-    uiblocks = 0x3f;
+static void
+size_cache_store(nfcd_session *ps, const nfc_target *pnt, uint8_t uiBlocks)
+{
+  nfcd_size_cache_entry *psce = &ps->asc[ps->szSizeCacheNext];
+
+  // Replace the oldest entry once full
+  psce->szUidLen = pnt->nti.nai.szUidLen;
+  memcpy(psce->abtUid, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen);
+  psce->uiBlocks = uiBlocks;
+  ps->szSizeCacheNext = (ps->szSizeCacheNext + 1) % NFCD_SESSION_SIZE_CACHE;
+  if (ps->szSizeCacheUsed < NFCD_SESSION_SIZE_CACHE)
+    ps->szSizeCacheUsed++;
+}
 
-  // Testing RATS
-  int res;
-  if ((res = get_rats(pnd, pnt)) > 0) {
-    if ((res >= 10) && (abtRx[5] == 0xc1) && (abtRx[6] == 0x05)
-        && (abtRx[7] == 0x2f) && (abtRx[8] == 0x2f)
-        && ((pnt->nti.nai.abtAtqa[1] & 0x02) == 0x00)) {
+/**
+ * @brief Tell the last block of a selected tag, from ATQA and SAK or through RATS
+ *
+ * The tag is selected again after RATS, ready for authentication.  RATS is
+ * left out while other cards share the field.
+ *
+ * @return last block number, -1 if the tag is gone
+ */
+static int
+get_uiblocks(nfcd_session *ps, const nfc_target *pnt)
+{
+  uint8_t uiblocks = 0x3f;
+  size_t  i;
+  int     res;
+
+  // Guessing size
+  for (i = 0; i < sizeof(size_fingerprints) / sizeof(size_fingerprints[0]); i++) {
+    if (((pnt->nti.nai.abtAtqa[1] & size_fingerprints[i].btAtqaMask) == size_fingerprints[i].btAtqa) &&
+        ((pnt->nti.nai.btSak & size_fingerprints[i].btSakMask) == size_fingerprints[i].btSak))
+      break;
+  }
+  if (i == sizeof(size_fingerprints) / sizeof(size_fingerprints[0]))
+    return uiblocks;
+  uiblocks = size_fingerprints[i].uiBlocks;
+  if (!size_fingerprints[i].bProbe)
+    return uiblocks;
+
+  // 1K/2K, checked through RATS the first time this card is seen
+  if ((res = size_cache_lookup(ps, pnt)) >= 0)
+    return res;
+  if (ps->bFieldShared)
+    return uiblocks;
+  if ((res = get_rats(ps, pnt)) > 0) {
+    if ((res >= 10) && (ps->abtRx[5] == 0xc1) && (ps->abtRx[6] == 0x05)
+        && (ps->abtRx[7] == 0x2f) && (ps->abtRx[8] == 0x2f)) {
       // MIFARE Plus 2K
       uiblocks = 0x7f;
     }
   }
-
+  // A card that did not answer is cached too, it would only time out again
+  if (res >= 0)
+    size_cache_store(ps, pnt, uiblocks);
+  if (!reselect(ps, pnt))
+    return -1;
   return uiblocks;
 }
 
-bool
-mifare_classic_read_card(nfc_device *pnd, nfc_target *pnt, bool bUseKeyA, mifare_param *pmp, mifare_classic_tag *ptag)
+static  bool
+read_block(nfcd_session *ps, uint32_t uiBlock, mifare_classic_tag *ptag, mifare_classic_read_result *pmrr)
 {
   mifare_param mp;
-  int32_t iBlock;
-  bool    bFailure = false;
-  uint32_t uiReadBlocks = 0;
-  uint8_t uiBlocks = get_uiblocks(pnd, pnt);
 
+  if (!nfc_initiator_mifare_cmd(ps->dev.pnd, MC_READ, uiBlock, &mp))
+    return false;
+  memcpy(ptag->amb[uiBlock].mbd.abtData, mp.mpd.abtData, 16);
+  pmrr->abtBlockMap[uiBlock / 8] |= 1 << (uiBlock % 8);
+  return true;
+}
 
-  printf("Reading out %d blocks |", uiBlocks + 1);
-  // Read the card from end to begin
-  for (iBlock = uiBlocks; iBlock >= 0; iBlock--) {
-    // Authenticate everytime we reach a trailer block
-    if (is_trailer_block(iBlock)) {
-      if (bFailure) {
-        // When a failure occured we need to redo the anti-collision
-        if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, pnt) <= 0) {
-          printf("!\nError: tag was removed\n");
-          return false;
-        }
-        bFailure = false;
-      }
+typedef enum {
+  PASS_DONE,
+  PASS_AUTH_FAILED,       // no known key, the tag was reselected
+  PASS_READ_FAILED,       // the tag halted on a read
+  PASS_TAG_LOST,
+} read_pass_result;
+
+// What a pass over a sector learnt, to tell skipped blocks from failed ones
+typedef struct {
+  mifare_classic_access ma;
+  bool    bAccessKnown;
+  mifare_cmd mcSession;
+  mifare_cmd mcOther;     // same as mcSession unless the other key was found too
+} sector_session;
 
-      fflush(stdout);
+/**
+ * @brief One pass over a sector, only issuing commands its access conditions allow
+ *
+ * Key A is tried first because it can always read the access bits; key B is
+ * only used when A is unknown, or for the blocks that require it.  Blocks no
+ * known key may read are left zeroed.  The keys found are stored in the
+ * trailer of @a ptag, as a dump would have them.
+ */
+static  read_pass_result
+read_sector_pass(nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp, mifare_classic_tag *ptag,
+                 uint32_t uiFirst, uint32_t uiTrailer, sector_session *pss, mifare_classic_read_result *pmrr)
+{
+  mifare_classic_block_trailer *pmbt = &ptag->amb[uiTrailer].mbt;
+  uint8_t abtKey[6];
+  bool    bNeedOther = false;
+  uint32_t uiBlock;
+  int     res;
 
-      // Try to authenticate for the current sector
-      if (!authenticate(pnd, pnt, bUseKeyA, iBlock, pmp)) {
-        printf("!\nError: authentication failed for block 0x%02x\n", iBlock);
-        return false;
-      }
-      // Try to read out the trailer
-      if (!nfc_initiator_mifare_cmd(pnd, MC_READ, iBlock, &mp)) {
-        printf("!\nfailed to read trailer block 0x%02x\n", iBlock);
-        bFailure = true;
+  pss->bAccessKnown = false;
+
+  // Open a session, key A first as it can always read the access bits
+  if ((res = authenticate(ps, pnt, MC_AUTH_A, uiTrailer, pmp, abtKey)) > 0) {
+    pss->mcSession = MC_AUTH_A;
+  } else if ((res == 0) && ((res = authenticate(ps, pnt, MC_AUTH_B, uiTrailer, pmp, abtKey)) > 0)) {
+    pss->mcSession = MC_AUTH_B;
+  } else {
+    return (res < 0) ? PASS_TAG_LOST : PASS_AUTH_FAILED;
+  }
+  pss->mcOther = (pss->mcSession == MC_AUTH_A) ? MC_AUTH_B : MC_AUTH_A;
+
+  // The trailer tells which key may read what
+  if (!read_block(ps, uiTrailer, ptag, pmrr))
+    return PASS_READ_FAILED;
+  memcpy((pss->mcSession == MC_AUTH_A) ? pmbt->abtKeyA : pmbt->abtKeyB, abtKey, 6);
+  pss->bAccessKnown = mifare_classic_access_decode(pmbt->abtAccessBits, &pss->ma);
+
+  for (uiBlock = uiTrailer; uiBlock-- > uiFirst;) {
+    if (pss->bAccessKnown) {
+      uint8_t uiGroup = mifare_classic_block_group(uiBlock);
+
+      if (!mifare_classic_access_can_read(&pss->ma, uiGroup, pss->mcSession)) {
+        // Read it later under the other key, or skip it without asking the tag
+        if (mifare_classic_access_can_read(&pss->ma, uiGroup, pss->mcOther))
+          bNeedOther = true;
+        continue;
       }
-    } else {
-      // Make sure a earlier readout did not fail
-      if (!bFailure) {
-        // Try to read out the data block
-        if (nfc_initiator_mifare_cmd(pnd, MC_READ, iBlock, &mp)) {
-          memcpy(ptag->amb[iBlock].mbd.abtData, mp.mpd.abtData, 16);
-        } else {
-          printf("!\nError: unable to read block 0x%02x\n", iBlock);
-          bFailure = true;
-        }
+    }
+    if (!read_block(ps, uiBlock, ptag, pmrr))
+      return PASS_READ_FAILED;
+  }
+
+  if (!bNeedOther) {
+    pss->mcOther = pss->mcSession;
+    return PASS_DONE;
+  }
+
+  // Nested authentication; a miss halts the tag, which authenticate() reselects
+  if ((res = authenticate(ps, pnt, pss->mcOther, uiTrailer, pmp, abtKey)) <= 0) {
+    pss->mcOther = pss->mcSession;    // nothing more will be read
+    return (res < 0) ? PASS_TAG_LOST : PASS_DONE;
+  }
+  memcpy((pss->mcOther == MC_AUTH_A) ? pmbt->abtKeyA : pmbt->abtKeyB, abtKey, 6);
+  for (uiBlock = uiTrailer; uiBlock-- > uiFirst;) {
+    uint8_t uiGroup = mifare_classic_block_group(uiBlock);
+
+    if (mifare_classic_access_can_read(&pss->ma, uiGroup, pss->mcSession) ||
+        !mifare_classic_access_can_read(&pss->ma, uiGroup, pss->mcOther))
+      continue;
+    if (!read_block(ps, uiBlock, ptag, pmrr))
+      return PASS_READ_FAILED;
+  }
+  return PASS_DONE;
+}
+
+/**
+ * @brief Read one sector and report its blocks on the progress line
+ * @param bRetry Read the sector a second time, on a new session, if a read fails
+ * @param pbLost Set when the tag stopped answering selection
+ *
+ * The tag is left selected and ready for the next sector whenever possible.
+ */
+static  mifare_classic_sector_status
+read_sector(nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp, mifare_classic_tag *ptag,
+            uint32_t uiSector, bool bRetry, mifare_classic_read_result *pmrr, bool *pbLost)
+{
+  const uint32_t uiFirst = mifare_classic_sector_first_block(uiSector);
+  const uint32_t uiTrailer = get_trailer_block(uiFirst);
+  sector_session ss;
+  read_pass_result rpr;
+  uint32_t uiBlock;
+  uint32_t uiRead = 0;
+
+  for (int iAttempt = 0; ; iAttempt++) {
+    rpr = read_sector_pass(ps, pnt, pmp, ptag, uiFirst, uiTrailer, &ss, pmrr);
+    if (rpr != PASS_READ_FAILED)
+      break;
+    // The tag halts on a failed read, it needs a new session to go on
+    if (!reselect(ps, pnt)) {
+      rpr = PASS_TAG_LOST;
+      break;
+    }
+    if (!bRetry || (iAttempt > 0))
+      break;
+  }
+  *pbLost = (rpr == PASS_TAG_LOST);
+
+  // Report each block: read, skipped because access conditions forbid it, or failed
+  for (uiBlock = uiTrailer + 1; uiBlock-- > uiFirst;) {
+    if (mifare_classic_read_result_has_block(pmrr, uiBlock)) {
+      printf(".");
+      uiRead++;
+      continue;
+    }
+    if ((uiBlock != uiTrailer) && ss.bAccessKnown) {
+      uint8_t uiGroup = mifare_classic_block_group(uiBlock);
+
+      if (!mifare_classic_access_can_read(&ss.ma, uiGroup, ss.mcSession) &&
+          !((ss.mcOther != ss.mcSession) && mifare_classic_access_can_read(&ss.ma, uiGroup, ss.mcOther))) {
+        printf("-");
+        pmrr->uiSkippedBlocks++;
+        continue;
       }
     }
-    // Show if the readout went well for each block
-    print_success_or_failure(bFailure, &uiReadBlocks);
-    if (bFailure)
+    printf("x");
+  }
+  pmrr->uiReadBlocks += uiRead;
+
+  if (rpr == PASS_DONE)
+    return MC_SECTOR_OK;
+  if (uiRead > 0)
+    return MC_SECTOR_PARTIAL;
+  return (rpr == PASS_AUTH_FAILED) ? MC_SECTOR_AUTH_FAILED : MC_SECTOR_READ_FAILED;
+}
+
+/**
+ * @brief Sector reading order: the requested sectors first, then the others from the last one
+ * @return Number of sectors in @a aui8Order
+ */
+static  uint32_t
+plan_sector_order(const mifare_classic_read_opts *pmro, uint32_t uiSectors, uint8_t aui8Order[40])
+{
+  bool    abPlanned[40] = { false };
+  uint32_t uiCount = 0;
+  int32_t iSector;
+
+  if (pmro) {
+    for (size_t i = 0; i < pmro->szSectorOrder; i++) {
+      uint8_t ui8Sector = pmro->pui8SectorOrder[i];
+
+      // Sectors the card does not have are silently ignored
+      if ((ui8Sector >= uiSectors) || abPlanned[ui8Sector])
+        continue;
+      abPlanned[ui8Sector] = true;
+      aui8Order[uiCount++] = ui8Sector;
+    }
+  }
+  for (iSector = uiSectors - 1; iSector >= 0; iSector--) {
+    if (!abPlanned[iSector])
+      aui8Order[uiCount++] = iSector;
+  }
+  return uiCount;
+}
+
+/**
+ * @brief Read a MIFARE Classic card, sector by sector
+ * @param pmro Read options, NULL for the defaults
+ * @param pmrr When not NULL, receives the status of each sector and block
+ *
+ * Sectors listed in the options are read first, the others follow from the
+ * last one.  The sector callback runs as soon as a sector is done, so its
+ * data can be used before the whole card is read, and can cancel the rest.
+ * The sector filter can leave sectors out as the read goes, e.g. those the
+ * directory read first does not list.
+ *
+ * Access conditions are decoded from each trailer so that only permitted
+ * reads are sent: a forbidden read makes the tag drop the session, which
+ * would cost a reselect and a new authentication.  The key type is chosen
+ * per sector from those conditions.
+ *
+ * By default the first failed sector ends the read.  With bTolerateFailures
+ * the tag is reselected, the sector is tried once more if a read failed, and
+ * the read goes on with the next sector; the image is then partial and
+ * @a pmrr tells which blocks of it are valid.
+ *
+ * @return true if every sector wanted was read
+ */
+bool
+mifare_classic_read_card(nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp, const mifare_classic_read_opts *pmro,
+                         mifare_classic_tag *ptag, mifare_classic_read_result *pmrr)
+{
+  mifare_classic_read_result mrr;
+  const bool bTolerate = pmro && pmro->bTolerateFailures;
+  bool    bLost = false;
+  uint8_t aui8Order[40];
+  uint32_t uiCount, i;
+  int     res;
+
+  latency_set_card(pnt->nti.nai.btSak);
+  if (pmrr == NULL)
+    pmrr = &mrr;
+  memset(pmrr, 0, sizeof(*pmrr));
+  // The scan left the tag halted
+  if (!reselect(ps, pnt) || ((res = get_uiblocks(ps, pnt)) < 0)) {
+    printf("Error: tag was removed\n");
+    return false;
+  }
+  pmrr->uiBlocks = res + 1;
+  pmrr->uiSectors = get_sector_count(pmrr->uiBlocks - 1);
+  uiCount = plan_sector_order(pmro, pmrr->uiSectors, aui8Order);
+
+  printf("Reading out %d blocks |", pmrr->uiBlocks);
+  for (i = 0; i < uiCount; i++) {
+    const uint8_t ui8Sector = aui8Order[i];
+    mifare_classic_sector_status mss;
+    bool    bContinue;
+
+    if (ps->pfnAbort && ps->pfnAbort(ps->pvUser)) {
+      printf("!\nAborted\n");
+      return false;
+    }
+    fflush(stdout);
+
+    if (pmro && pmro->pfnSectorWanted && !pmro->pfnSectorWanted(pmro->pvUser, ui8Sector, ptag, pmrr)) {
+      pmrr->uiUnwantedSectors++;
+      continue;
+    }
+    mss = read_sector(ps, pnt, pmp, ptag, ui8Sector, bTolerate, pmrr, &bLost);
+    pmrr->abtSectorStatus[ui8Sector] = mss;
+    if (mss != MC_SECTOR_OK)
+      pmrr->uiFailedSectors++;
+    bContinue = !(pmro && pmro->pfnSectorDone) || pmro->pfnSectorDone(pmro->pvUser, ui8Sector, ptag, pmrr);
+    if ((mss != MC_SECTOR_OK) && !bTolerate) {
+      if (mss == MC_SECTOR_AUTH_FAILED)
+        printf("!\nError: authentication failed for sector %d\n", ui8Sector);
+      else
+        printf("!\nError: unable to read sector %d\n", ui8Sector);
       return false;
+    }
+    if (!bContinue) {
+      pmrr->bCancelled = (i + 1 < uiCount);
+      break;
+    }
+    if (bLost) {
+      printf("!");
+      break;
+    }
   }
   printf("|\n");
-  printf("Done, %d of %d blocks read.\n", uiReadBlocks, uiBlocks + 1);
+  printf("Done, %d of %d blocks read", pmrr->uiReadBlocks, pmrr->uiBlocks);
+  if (pmrr->uiSkippedBlocks)
+    printf(", %d not readable with the known keys", pmrr->uiSkippedBlocks);
+  if (pmrr->uiUnwantedSectors)
+    printf(", %d sectors left out", pmrr->uiUnwantedSectors);
+  if (pmrr->bCancelled)
+    printf(", stopped early");
+  else if (pmrr->uiFailedSectors || bLost)
+    printf(", partial image");
+  printf(".\n");
+  if (pmrr->uiFailedSectors || bLost || pmrr->bCancelled) {
+    // One character per sector, from the first one
+    static const char acStatus[] = { '_', '.', 'p', 'A', 'x' };
+
+    printf("Sectors |");
+    for (i = 0; i < pmrr->uiSectors; i++)
+      printf("%c", acStatus[pmrr->abtSectorStatus[i]]);
+    printf("|\n");
+  }
   fflush(stdout);
 
+  return !bLost && !pmrr->bCancelled && (pmrr->uiFailedSectors == 0);
+}
+
+/**
+ * @brief Tell if authenticating with @a mcAuth allows a whole batch: reading, operating, transferring, reading back
+ */
+static  bool
+value_batch_allowed(const mifare_classic_access *pma, const mifare_classic_value_op *pmvo, size_t szOps, mifare_cmd mcAuth)
+{
+  for (size_t i = 0; i < szOps; i++) {
+    const uint8_t ui8Group = mifare_classic_block_group(pmvo[i].ui8Block);
+    const uint8_t ui8DestGroup = mifare_classic_block_group(pmvo[i].ui8Dest);
+
+    if (!mifare_classic_access_can_read(pma, ui8Group, mcAuth) ||
+        !mifare_classic_access_can_value(pma, ui8Group, pmvo[i].mc, mcAuth) ||
+        !mifare_classic_access_can_value(pma, ui8DestGroup, MC_TRANSFER, mcAuth) ||
+        !mifare_classic_access_can_read(pma, ui8DestGroup, mcAuth))
+      return false;
+  }
   return true;
 }
 
+/**
+ * @brief Apply a batch of value operations to the blocks of one sector, under one authentication
+ * @param pmp Key to authenticate with, NULL to use the key provider and the dictionary
+ *
+ * Every block operated on is read and checked to be a value block, and every
+ * result computed, before the first command is sent: a batch that cannot
+ * complete leaves the card as it was.  Operations apply in order, so one on
+ * a block an earlier one transferred to sees the new value.  The access
+ * conditions pick the key: A when it may do it all, B otherwise.  The blocks
+ * transferred to are read back at the end.
+ *
+ * Each transfer is atomic on the tag, the batch is not: a tag pulled away
+ * halfway keeps the transfers done so far.  Restoring the block just
+ * decremented into a backup block, as the last operation, lets the next
+ * tap tell which balance is right.
+ *
+ * The tag is left selected and authenticated, as after mifare_classic_read_card().
+ */
+mifare_classic_value_status
+mifare_classic_value_apply(nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp, mifare_classic_value_op *pmvo, size_t szOps)
+{
+  nfc_device *pnd = ps->dev.pnd;
+  const uint8_t ui8Sector = szOps ? mifare_classic_block_sector(pmvo[0].ui8Block) : 0;
+  const uint8_t ui8First = mifare_classic_sector_first_block(ui8Sector);
+  const uint8_t ui8Trailer = ui8First + mifare_classic_sector_block_count(ui8Sector) - 1;
+  mifare_classic_access ma;
+  mifare_param mp;
+  mifare_cmd mcSession;
+  int32_t aiValue[16];      // the sector as it will be, by block offset
+  bool    abKnown[16] = { false };
+  size_t  i, szTransfers = 0;
+  int     res;
+
+  if (szOps == 0)
+    return MC_VALUE_OK;
+  for (i = 0; i < szOps; i++) {
+    if ((mifare_classic_block_sector(pmvo[i].ui8Block) != ui8Sector) ||
+        (mifare_classic_block_sector(pmvo[i].ui8Dest) != ui8Sector) ||
+        (pmvo[i].ui8Block == 0) || (pmvo[i].ui8Block == ui8Trailer) ||
+        (pmvo[i].ui8Dest == 0) || (pmvo[i].ui8Dest == ui8Trailer) ||
+        ((pmvo[i].mc != MC_INCREMENT) && (pmvo[i].mc != MC_DECREMENT) && (pmvo[i].mc != MC_STORE)) ||
+        (pmvo[i].uiAmount > INT32_MAX))
+      return MC_VALUE_INVALID;
+  }
+  latency_set_card(pnt->nti.nai.btSak);
+  // The scan left the tag halted
+  if (!reselect(ps, pnt))
+    return MC_VALUE_FAILED;
+
+  // Key A first, as it can always read the access bits
+  if ((res = authenticate(ps, pnt, MC_AUTH_A, ui8Trailer, pmp, NULL)) > 0) {
+    mcSession = MC_AUTH_A;
+  } else if ((res == 0) && ((res = authenticate(ps, pnt, MC_AUTH_B, ui8Trailer, pmp, NULL)) > 0)) {
+    mcSession = MC_AUTH_B;
+  } else {
+    return (res < 0) ? MC_VALUE_FAILED : MC_VALUE_AUTH_FAILED;
+  }
+  if (!nfc_initiator_mifare_cmd(pnd, MC_READ, ui8Trailer, &mp))
+    return MC_VALUE_FAILED;
+  if (!mifare_classic_access_decode(mp.mpd.abtData + 6, &ma))
+    return MC_VALUE_FORBIDDEN;
+  if (!value_batch_allowed(&ma, pmvo, szOps, mcSession)) {
+    const mifare_cmd mcOther = (mcSession == MC_AUTH_A) ? MC_AUTH_B : MC_AUTH_A;
+
+    if (!value_batch_allowed(&ma, pmvo, szOps, mcOther))
+      return MC_VALUE_FORBIDDEN;
+    // Nested authentication; a miss halts the tag, which authenticate() reselects
+    if ((res = authenticate(ps, pnt, mcOther, ui8Trailer, pmp, NULL)) <= 0)
+      return (res < 0) ? MC_VALUE_FAILED : MC_VALUE_FORBIDDEN;
+  }
+
+  // Check it all before changing anything
+  for (i = 0; i < szOps; i++) {
+    const uint8_t ui8Src = pmvo[i].ui8Block - ui8First;
+    const uint8_t ui8Dest = pmvo[i].ui8Dest - ui8First;
+    int64_t llAfter;
+
+    if (!abKnown[ui8Src]) {
+      if (!nfc_initiator_mifare_cmd(pnd, MC_READ, pmvo[i].ui8Block, &mp))
+        return MC_VALUE_FAILED;
+      if (!mifare_classic_value_decode(mp.mpd.abtData, &aiValue[ui8Src], NULL))
+        return MC_VALUE_NOT_VALUE;
+      abKnown[ui8Src] = true;
+    }
+    pmvo[i].iBefore = aiValue[ui8Src];
+    llAfter = pmvo[i].iBefore;
+    if (pmvo[i].mc == MC_INCREMENT)
+      llAfter += pmvo[i].uiAmount;
+    else if (pmvo[i].mc == MC_DECREMENT)
+      llAfter -= pmvo[i].uiAmount;
+    if ((llAfter > INT32_MAX) || ((pmvo[i].mc == MC_DECREMENT) && (llAfter < 0)))
+      return MC_VALUE_OUT_OF_RANGE;
+    pmvo[i].iAfter = (int32_t) llAfter;
+    aiValue[ui8Dest] = pmvo[i].iAfter;
+    abKnown[ui8Dest] = true;
+  }
+
+  for (i = 0; i < szOps; i++) {
+    // Little endian operand, ignored by restore
+    memset(&mp, 0, sizeof(mp));
+    for (uint8_t j = 0; j < 4; j++)
+      mp.mpv.abtValue[j] = (uint8_t) (pmvo[i].uiAmount >> (8 * j));
+    if (!nfc_initiator_mifare_cmd(pnd, pmvo[i].mc, pmvo[i].ui8Block, &mp))
+      return szTransfers ? MC_VALUE_UNVERIFIED : MC_VALUE_FAILED;
+    // Lost in the middle of a transfer, the block may or may not have been written
+    if (!nfc_initiator_mifare_cmd(pnd, MC_TRANSFER, pmvo[i].ui8Dest, &mp))
+      return MC_VALUE_UNVERIFIED;
+    szTransfers++;
+  }
+
+  // Read back each block transferred to, once
+  for (i = 0; i < szOps; i++) {
+    const uint8_t ui8Dest = pmvo[i].ui8Dest - ui8First;
+    int32_t iValue;
+
+    if (!abKnown[ui8Dest])
+      continue;
+    if (!nfc_initiator_mifare_cmd(pnd, MC_READ, pmvo[i].ui8Dest, &mp))
+      return MC_VALUE_UNVERIFIED;
+    if (!mifare_classic_value_decode(mp.mpd.abtData, &iValue, NULL) || (iValue != aiValue[ui8Dest]))
+      return MC_VALUE_MISMATCH;
+    abKnown[ui8Dest] = false;
+  }
+  return MC_VALUE_OK;
+}
+
 bool
-mifare_classic_write_card(nfc_device *pnd, nfc_target *pnt, bool bUseKeyA, mifare_param *pmp, mifare_classic_tag *ptag)
+mifare_classic_write_card(nfcd_session *ps, const nfc_target *pnt, bool bUseKeyA, mifare_param *pmp, mifare_classic_tag *ptag)
 {
+  nfc_device *pnd = ps->dev.pnd;
   mifare_param mp;
   uint32_t uiBlock;
   bool    bFailure = false;
   uint32_t uiWriteBlocks = 0;
-  uint8_t uiBlocks = get_uiblocks(pnd, pnt);
+  uint8_t uiBlocks;
+  int     res;
+
+  latency_set_card(pnt->nti.nai.btSak);
+  // The scan left the tag halted
+  if (!reselect(ps, pnt) || ((res = get_uiblocks(ps, pnt)) < 0)) {
+    printf("Error: tag was removed\n");
+    return false;
+  }
+  uiBlocks = res;
 
   printf("Writing %d blocks |", uiBlocks + 1);
   // Write the card from begin to end;
   for (uiBlock = 0; uiBlock <= uiBlocks; uiBlock++) {
     // Authenticate everytime we reach the first sector of a new block
     if (is_first_block(uiBlock)) {
+      if (ps->pfnAbort && ps->pfnAbort(ps->pvUser)) {
+        printf("!\nAborted\n");
+        return false;
+      }
       if (bFailure) {
-        // When a failure occured we need to redo the anti-collision
-        if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, pnt) <= 0) {
+        // When a failure occured we need to redo the anti-collision, for this tag only
+        if (!reselect(ps, pnt)) {
           printf("!\nError: tag was removed\n");
           return false;
         }
@@ -328,7 +985,7 @@ mifare_classic_write_card(nfc_device *pnd, nfc_target *pnt, bool bUseKeyA, mifar
       fflush(stdout);
 
       // Try to authenticate for the current sector
-      if (!authenticate(pnd, pnt, bUseKeyA, uiBlock, pmp)) {
+      if (authenticate(ps, pnt, bUseKeyA ? MC_AUTH_A : MC_AUTH_B, uiBlock, pmp, NULL) <= 0) {
         printf("!\nError: authentication failed for block %02x\n", uiBlock);
         return false;
       }
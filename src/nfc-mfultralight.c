@@ -57,6 +57,8 @@
 
 #include "nfc-utils.h"
 #include "mifare.h"
+#include "latency.h"
+#include "session.h"
 
 #define MAX_TARGET_COUNT 16
 #define MAX_UID_LEN 10
@@ -96,7 +98,7 @@ print_success_or_failure(bool bFailure, uint32_t *uiCounter)
 }
 
 bool
-mifare_ultralight_read_card(nfc_device *pnd, nfc_target *pnt, mifare_param *pmp, mifareul_tag *ptag)
+mifare_ultralight_read_card(nfcd_session *ps, const nfc_target *pnt, mifare_param *pmp, mifareul_tag *ptag)
 {
   mifare_param mp;
   uint32_t page;
@@ -104,11 +106,17 @@ mifare_ultralight_read_card(nfc_device *pnd, nfc_target *pnt, mifare_param *pmp,
   uint32_t uiReadedPages = 0;
   const uint32_t uiBlocks = BLOCK_COUNT;
 
+  latency_set_card(pnt->nti.nai.btSak);
+  // The scan left the tag halted, wake this one by its UID
+  if (nfcd_device_select(ps->dev.pnd, nmMifare, pnt->nti.nai.abtUid, pnt->nti.nai.szUidLen, NULL) <= 0) {
+    printf("Error: tag was removed\n");
+    return false;
+  }
   printf("Reading %d pages |", uiBlocks + 1);
 
   for (page = 0; page <= uiBlocks; page += 4) {
     // Try to read out the data block
-    if (nfc_initiator_mifare_cmd(pnd, MC_READ, page, &mp)) {
+    if (nfc_initiator_mifare_cmd(ps->dev.pnd, MC_READ, page, &mp)) {
       memcpy(ptag->amb[page / 4].mbd.abtData, mp.mpd.abtData, 16);
     } else {
       bFailure = true;
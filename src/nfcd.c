@@ -22,6 +22,8 @@
   #include "config.h"
 #endif // HAVE_CONFIG_H
 
+#define _GNU_SOURCE
+
 #include <nfc/nfc.h>
 
 #include <stdio.h>
@@ -32,135 +34,1198 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 
 #include "nfc-utils.h"
 #include "mifare.h"
 #include "debug.h"
 #include "types.h"
+#include "conf.h"
+#include "device.h"
+#include "signals.h"
+#include "state.h"
+#include "rpc.h"
+#include "aes.h"
+#include "kdf.h"
+#include "latency.h"
+#include "journal.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "timer.h"
+#include "acl.h"
+#include "ring.h"
+#include "ndef.h"
+#include "isodep.h"
+#include "session.h"
 
 
-#define DEF_POLLING 1    /* 1 second timeout */
-#define DEF_EXPIRE 0    /* no expire */
+static nfcd_conf conf;
 
+/* the card engine state of the reader */
+static nfcd_session session;
+static nfcd_capture *capture;     /* capture or replay of its traffic */
+nfc_context* context;
 
-int polling_time = DEF_POLLING;
-int expire_time = DEF_EXPIRE;
-int daemonize = 0;
-int debug = 0;
+#define READ_ATTEMPTS 3
+#define WAKE_TIMEOUT 20           /* ms, for each raw frame waking a card */
 
-nfc_device* device = NULL;
-nfc_context* context;
+/* Cards in the field of the reader, field[i] publishes in slot NFCD_SLOT(0, i) */
+typedef struct {
+  bool    present;
+  nfc_target target;
+  bool    read_pending;           /* not read yet */
+  unsigned read_failures;
+  unsigned read_wait;             /* scans to let pass before the next attempt */
+  acl_verdict verdict;
+  nfcd_timer gone;                /* missing from the field, removed when it fires */
+} field_card;
+
+static field_card field[NFCD_MAX_CARDS];
+static size_t next_read;          /* where the next read looks first */
+static bool field_reset;          /* cycle the field at the next scan, after a failed one */
+
+/* Deadlines of the poll loop */
+static timer_wheel wheel;
+static nfcd_timer expire_timer;   /* field empty for expire_time */
+static nfcd_timer presence_timer; /* next check of the cards in the field */
+static nfcd_timer probe_timer;    /* next software poll of an empty field */
+static nfcd_timer retry_timer;    /* next attempt after a failed reader call */
+static bool presence_due, probe_due, retry_due;
 
-bool quit_flag = false;
+/*
+ * Reader health.  A reader failing reader_max_errors calls in a row is
+ * closed, then reopened after RETRY_MIN ms, twice as long after each
+ * failed attempt up to reader_retry_max.  The cards in its field stay as
+ * they were until it answers again.
+ */
+#define RETRY_MIN 50              /* ms */
+static bool reader_up;
+static int reader_backoff;        /* ms before the next reopen attempt */
+
+/*
+ * Software polling state.  The probe interval stays at poll_min_interval
+ * while cards keep coming about as often as they did, then stretches by a
+ * quarter per empty probe up to poll_max_interval.
+ */
+static struct {
+  int     interval;               /* ms before the next probe */
+  int64_t last_tap;               /* ms, CLOCK_MONOTONIC, 0: none yet */
+  int64_t tap_gap;                /* ms, moving average of the time between taps */
+} sw_poll;
 
-static void stop_polling(int sig)
+static long
+sw_poll_interval(void)
 {
-  (void) sig;
-  DBG( "Stop polling... (sig:%d)", sig);
-  if (device != NULL) {
-    nfc_abort_command(device);
-    DBG( "%s", "Polling aborted.");
-    quit_flag = true;
-  } else {
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+  return __atomic_load_n(&sw_poll.interval, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief The engine stops a read between two sectors once a stop is requested
+ */
+static bool
+engine_abort ( void *user )
+{
+  return signals_stop_requested();
+}
+
+/**
+ * @brief A stop aborts the device while it waits in a poll
+ */
+static void
+engine_poll_watch ( void *user, nfc_device *pnd, bool watch )
+{
+  if ( watch )
+    signals_watch_device ( pnd );
+  else
+    signals_unwatch_device ( pnd );
+}
+
+/**
+ * @brief The poll loop ends on a stop request, or once the replay went past the last poll captured
+ */
+static bool
+ned_stopping ( void )
+{
+  return signals_stop_requested() || replay_ended ( capture );
+}
+
+/**
+ * @brief Sector keys derived from the master key
+ */
+static bool
+engine_derive_key ( void *user, const uint8_t *uid, size_t uid_len, uint8_t sector, mifare_cmd mc, uint8_t key[6] )
+{
+  return kdf_mifare_classic_key ( uid, uid_len, sector, mc, key );
+}
+
+/**
+ * @brief Apply the settings that can change at runtime
+ *
+ * Whatever can fail (key files, output) is read or opened first, and only
+ * installed once all of it succeeded: on error every setting in use is kept.
+ */
+static int
+apply_config(const nfcd_conf *cfg)
+{
+  static bool output_buffered;
+  uint8_t *keys = NULL;
+  uint8_t master[16];
+  int     num_keys = 0;
+  int     out = -1;
+
+  if (cfg->key_file[0] && ((num_keys = mifare_classic_read_keys(cfg->key_file, &keys)) < 0))
+    return -1;
+  if (cfg->master_key_file[0] && (kdf_read_master_key(cfg->master_key_file, master) < 0)) {
+    free(keys);
+    return -1;
+  }
+  if (strcmp(cfg->output, "-") != 0) {
+    /* (re)open the sink, this also lets logrotate move the file away */
+    if ((out = open(cfg->output, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+      ERR("Unable to open output %s: %s", cfg->output, strerror(errno));
+      free(keys);
+      aes_wipe(master, sizeof(master));
+      return -1;
+    }
   }
+
+  set_debug_level(cfg->debug);
+  signals_set_shutdown_timeout(cfg->shutdown_timeout);
+  latency_configure(cfg->timeout_percentile, cfg->timeout_margin, cfg->timeout_ceiling);
+  trace_configure(cfg->trace_file, cfg->trace_buffer);
+  metrics_set_gauge(METRIC_POLL_INTERVAL, (cfg->poll_mode == NFC_POLL_SOFTWARE) ? sw_poll_interval : NULL);
+
+  mifare_classic_set_keys(&session, keys, num_keys);
+  kdf_set_master_key(cfg->master_key_file[0] ? master : NULL);
+  aes_wipe(master, sizeof(master));
+  mifare_classic_set_key_provider(&session, cfg->master_key_file[0] ? engine_derive_key : NULL);
+
+  if (out >= 0) {
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    if (!output_buffered) {
+      setvbuf(stdout, NULL, _IOLBF, 0);
+      output_buffered = true;
+    }
+  }
+
+  conf_print(cfg);
+  return 0;
 }
 
 
 /**
- * @brief Execute NEM function that handle events
+ * @brief Open, reopen or close the journal when its settings change
+ * @param prev Settings in use, NULL at startup
  */
-static int execute_event ( const nfc_device *dev, const nfc_target* tag, const nem_event_t event ) {
-  INFO ( "%s\n", __FUNCTION__ );
-  switch (event) {
-    case EVENT_TAG_INSERTED:
-      switch (tag->nm.nmt) {
-        case NMT_ISO14443A:
-          // Test if we are dealing with a MIFARE classic tag
-          if (tag->nti.nai.btSak & 0x08) {
-            mifare_classic_tag card;
-            printf("Found MIFARE Classic card:\n");
-            print_nfc_target(tag, true);
-            mifare_classic_read_card(dev, tag, 1, NULL, &card);
+static void
+apply_journal(const nfcd_conf *cfg, const nfcd_conf *prev)
+{
+  if (prev && !strcmp(cfg->journal_dir, prev->journal_dir) &&
+      (cfg->journal_segment_size == prev->journal_segment_size) &&
+      (cfg->journal_segments == prev->journal_segments) &&
+      (cfg->journal_sync_interval == prev->journal_sync_interval) &&
+      (cfg->journal_images == prev->journal_images))
+    return;
+
+  journal_close();
+  if (cfg->journal_dir[0] &&
+      (journal_open(cfg->journal_dir, (size_t) cfg->journal_segment_size * 1024, cfg->journal_segments,
+                    cfg->journal_sync_interval, cfg->journal_images) < 0))
+    WARN("%s", "Event journal disabled");
+}
+
+/**
+ * @brief Start, restart or stop serving metrics when their settings change
+ * @param prev Settings in use, NULL at startup
+ */
+static void
+apply_metrics(const nfcd_conf *cfg, const nfcd_conf *prev)
+{
+  if (prev && !strcmp(cfg->metrics_socket, prev->metrics_socket) && (cfg->metrics_port == prev->metrics_port))
+    return;
+
+  if (metrics_start(cfg->metrics_socket, cfg->metrics_port) < 0)
+    WARN("%s", "Metrics disabled");
+}
+
+/**
+ * @brief Start, restart or stop capturing the reader traffic when its settings change
+ * @param prev Settings in use, NULL at startup
+ */
+static void
+apply_capture(const nfcd_conf *cfg, const nfcd_conf *prev)
+{
+  if (prev && !strcmp(cfg->capture_file, prev->capture_file) &&
+      (cfg->capture_max_size == prev->capture_max_size))
+    return;
+
+  capture_stop(capture);
+  if (cfg->capture_file[0] && replay_active(capture))
+    WARN("%s", "Not capturing a replay");
+  else if (cfg->capture_file[0] &&
+           (capture_start(capture, cfg->capture_file, (size_t) cfg->capture_max_size * 1024) < 0))
+    WARN("%s", "Reader traffic capture disabled");
+}
+
+/**
+ * @brief Create, recreate or remove the shared memory event ring when its settings change
+ * @param prev Settings in use, NULL at startup
+ */
+static void
+apply_ring(const nfcd_conf *cfg, const nfcd_conf *prev)
+{
+  if (prev && !strcmp(cfg->ring_name, prev->ring_name) && (cfg->ring_size == prev->ring_size))
+    return;
+
+  ring_close();
+  if (cfg->ring_name[0] && (ring_open(cfg->ring_name, cfg->ring_size) < 0))
+    WARN("%s", "Event ring disabled");
+}
+
+/**
+ * @brief Load, reload or drop the access list
+ * @param prev Settings in use, NULL at startup
+ *
+ * Unlike the other settings the list is reloaded on every SIGHUP, in the
+ * background, so that it can be edited in place.
+ */
+static void
+apply_acl(const nfcd_conf *cfg, const nfcd_conf *prev)
+{
+  if (!prev) {
+    if (acl_load(cfg->acl_file) < 0)
+      WARN("%s", "Access decisions disabled");
+  } else if (acl_reload(cfg->acl_file) < 0) {
+    WARN("%s", "Access list not reloaded");
+  }
+}
+
+/**
+ * @brief Publish the access verdict of a card
+ */
+static void
+ned_decide(int slot, acl_verdict verdict, bool inserted)
+{
+  field[NFCD_SLOT_CARD(slot)].verdict = verdict;
+  if (verdict == ACL_NONE)
+    return;
+  if (verdict == ACL_ALLOW)
+    metrics_inc(METRIC_ACCESS_ALLOWED);
+  else if (verdict == ACL_DENY)
+    metrics_inc(METRIC_ACCESS_DENIED);
+  if (!inserted) {
+    ring_tag_verdict(slot, verdict);
+    state_tag_verdict(slot, verdict);
+  }
+  journal_tag_verdict(slot, verdict);
+  printf("Access: %s\n", acl_verdict_name(verdict));
+}
+
+/**
+ * @brief Publish each MIFARE Classic sector as soon as it is read
+ * @return false to stop the read, once the priority read plan has what it wants
+ */
+static bool
+publish_sector(void *user, const uint8_t sector, const mifare_classic_tag *card, const mifare_classic_read_result *result)
+{
+  const uint8_t first = mifare_classic_sector_first_block(sector);
+  const uint8_t trailer = first + mifare_classic_sector_block_count(sector) - 1;
+  nfcd_sector s;
+  uint8_t block;
+  size_t  i;
+
+  s.number = sector;
+  s.status = result->abtSectorStatus[sector];
+  s.szData = 0;
+  for (block = first; block < trailer; block++) {
+    memcpy(s.abtData + s.szData, card->amb[block].mbd.abtData, 16);
+    s.szData += 16;
+  }
+  state_tag_sector(*(const int *) user, &s);
+  if (field[NFCD_SLOT_CARD(*(const int *) user)].verdict == ACL_PENDING) {
+    acl_verdict verdict = acl_check_sector(&field[NFCD_SLOT_CARD(*(const int *) user)].target, &s);
+
+    if (verdict != ACL_PENDING)
+      ned_decide(*(const int *) user, verdict, false);
+  }
+
+  if (conf.read_plan != READ_PLAN_PRIORITY)
+    return true;
+  for (i = 0; i < conf.num_sector_order; i++) {
+    if ((conf.sector_order[i] < result->uiSectors) && (result->abtSectorStatus[conf.sector_order[i]] == MC_SECTOR_NOT_READ))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Read plan ndef: the MAD, then the sectors it gives to NDEF
+ */
+static bool
+ndef_sector_wanted(void *user, const uint8_t sector, const mifare_classic_tag *card, const mifare_classic_read_result *result)
+{
+  bool    mad2;
+  mad     m;
+
+  if (sector == 0)
+    return true;
+  if (sector == 16)
+    return mad_present(card, result, &mad2) && mad2;
+  return mad_decode(card, result, &m) && (sector < m.sectors) && (m.aid[sector] == MAD_AID_NDEF);
+}
+
+/**
+ * @brief Print the records of the NDEF message in @a area
+ */
+static void
+ned_print_ndef ( const ndef_area *area )
+{
+  ndef_view message;
+  ndef_reader nr;
+  ndef_record record;
+  char    type[64];
+  size_t  len;
+  int     res;
+
+  if ( ( res = ndef_find_message ( area, &message ) ) <= 0 ) {
+    printf ( "NDEF: %s\n", res ? "malformed TLV" : "no message" );
+    return;
+  }
+  ndef_reader_init ( &nr, &message );
+  while ( ( res = ndef_next_record ( &nr, &record ) ) > 0 ) {
+    len = ndef_view_copy ( &record.type, type, sizeof(type) - 1 );
+    type[len] = '\0';
+    printf ( "NDEF record: tnf %d, type '%s', %zu byte payload\n", record.tnf, type, record.payload.len );
+  }
+  if ( res < 0 )
+    printf ( "%s\n", "NDEF: malformed record" );
+}
+
+/**
+ * @brief Bring an ISO14443-4 card up, send it the configured APDU and publish the response
+ * @return false if the read should be attempted again
+ */
+static bool
+ned_read_isodep ( nfc_device* dev, int slot, const nfc_target* tag )
+{
+  /* a few KB in one exchange is what the chaining is for */
+  uint8_t response[4096 + 2];
+  isodep_session s;
+  int64_t t;
+  int     res;
+
+  t = trace_begin();
+  res = isodep_activate ( &s, dev, tag );
+  trace_end ( TRACE_NFCD, "isodep_activate", t, res );
+  if ( res < 0 ) {
+    metrics_inc ( METRIC_READS_ISODEP_FAILED );
+    printf ( "%s\n", "ISO14443-4: no ATS" );
+    return false;
+  }
+  printf ( "ISO14443-4: FSC %zu, FSD %zu, FWT %d us, %s (%s possible)\n", s.fsc, s.fsd, s.fwt,
+           str_nfc_baud_rate ( s.rate ), str_nfc_baud_rate ( s.rate_max ) );
+  if ( conf.apdu_len ) {
+    t = trace_begin();
+    res = isodep_apdu ( &s, conf.apdu, conf.apdu_len, response, sizeof ( response ) );
+    trace_end ( TRACE_NFCD, "isodep_apdu", t, res );
+    if ( res < 0 ) {
+      metrics_inc ( METRIC_READS_ISODEP_FAILED );
+      printf ( "APDU failed: %s\n", ( res == NFC_EOVFLOW ) ? "response too long" : "no response" );
+      isodep_deselect ( &s );
+      return false;
+    }
+    printf ( "APDU: %d byte response, status %02x%02x, %u blocks, %u waiting time extensions, %u retries\n",
+             res - 2, response[res - 2], response[res - 1], s.blocks, s.wtx, s.retries );
+    /* the status word tells consumers what the data is worth */
+    state_tag_image ( slot, response, res, true );
+    journal_tag_image ( slot, response, res, true );
+  }
+  metrics_inc ( METRIC_READS_ISODEP_COMPLETE );
+  isodep_deselect ( &s );
+  return true;
+}
+
+/**
+ * @brief Read the card in a slot according to the read plan
+ * @return false if the read should be attempted again
+ */
+static bool
+ned_read_tag ( nfcd_session* ps, int slot, const nfc_target* tag )
+{
+  bool    done = true;
+
+  switch (tag->nm.nmt) {
+    case NMT_ISO14443A:
+      // Test if we are dealing with a MIFARE classic tag
+      if (tag->nti.nai.btSak & 0x08) {
+        /* the MAD first, then in sector order */
+        static const uint8_t ndef_order[MAD_SECTORS] = {
+           0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+          20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
+        };
+        mifare_classic_tag card;
+        mifare_classic_read_opts opts = {
+          .bTolerateFailures = conf.tolerate_failures,
+          .pui8SectorOrder = conf.sector_order,
+          .szSectorOrder = conf.num_sector_order,
+          .pfnSectorDone = publish_sector,
+          .pvUser = &slot,
+        };
+        mifare_classic_read_result result;
+
+        if (conf.read_plan == READ_PLAN_NDEF) {
+          opts.pui8SectorOrder = ndef_order;
+          opts.szSectorOrder = MAD_SECTORS;
+          opts.pfnSectorWanted = ndef_sector_wanted;
+        }
+        printf("Found MIFARE Classic card:\n");
+        print_nfc_target(tag, true);
+        memset(&card, 0, sizeof(card));
+        if (conf.read_plan != READ_PLAN_UID) {
+          int64_t tr = trace_begin();
+          bool complete = mifare_classic_read_card(ps, tag, NULL, &opts, &card, &result);
+          trace_end(TRACE_NFCD, "mifare_classic_read_card", tr, result.uiReadBlocks);
+          /* complete as far as the plan goes, the image is not */
+          if (result.uiUnwantedSectors)
+            complete = false;
+          if (complete)
+            metrics_inc(METRIC_READS_CLASSIC_COMPLETE);
+          else
+            metrics_inc((result.uiReadBlocks > 0) ? METRIC_READS_CLASSIC_PARTIAL : METRIC_READS_CLASSIC_FAILED);
+          /* a partial image is still worth publishing when tolerated or asked for */
+          if (complete || ((conf.tolerate_failures || result.bCancelled || result.uiUnwantedSectors) && (result.uiReadBlocks > 0))) {
+            state_tag_image(slot, &card, sizeof(card), complete);
+            journal_tag_image(slot, &card, sizeof(card), complete);
           }
-          // Test if we are dealing with a MIFARE ultralight tag
-          if (tag->nti.nai.abtAtqa[1] == 0x44) {
-              mifareul_tag card;
-              printf("Found MIFARE UL card:\n");
-              print_nfc_target(tag, true);
-              mifare_ultralight_read_card(dev, tag, NULL, &card);
+          if (conf.read_plan == READ_PLAN_NDEF) {
+            uint8_t sectors[MAD_SECTORS];
+            ndef_area area;
+            mad     m;
+
+            if (mad_decode(&card, &result, &m)) {
+              ndef_area_classic(&area, &card, sectors, mad_sectors(&m, MAD_AID_NDEF, sectors));
+              ned_print_ndef(&area);
+            } else {
+              printf("%s\n", "NDEF: no MAD");
+            }
           }
-          break;
-        case NMT_JEWEL:
-        case NMT_ISO14443B:
-        case NMT_ISO14443BI:
-        case NMT_ISO14443B2SR:
-        case NMT_ISO14443B2CT:
-        case NMT_FELICA:
-        default:
-          break;
+          /* sectors our keys do not open will not open next time either */
+          done = (result.uiReadBlocks > 0) && !result.bCancelled;
+        }
       }
+      // DESFire and other cards that only speak ISO14443-4
+      if ((tag->nti.nai.btSak & 0x20) && !(tag->nti.nai.btSak & 0x08)) {
+        printf("Found ISO14443-4 card:\n");
+        print_nfc_target(tag, true);
+        if (conf.read_plan != READ_PLAN_UID)
+          done = ned_read_isodep(ps->dev.pnd, slot, tag);
+      } else if (tag->nti.nai.abtAtqa[1] == 0x44) {
+          // Test if we are dealing with a MIFARE ultralight tag (a DESFire has the same ATQA)
+          mifareul_tag card;
+          printf("Found MIFARE UL card:\n");
+          print_nfc_target(tag, true);
+          memset(&card, 0, sizeof(card));
+          if ((conf.read_plan == READ_PLAN_FULL) || (conf.read_plan == READ_PLAN_NDEF)) {
+            int64_t tr = trace_begin();
+            bool read = mifare_ultralight_read_card(ps, tag, NULL, &card);
+
+            trace_end(TRACE_NFCD, "mifare_ultralight_read_card", tr, read);
+            if (read) {
+              metrics_inc(METRIC_READS_ULTRALIGHT_COMPLETE);
+              state_tag_image(slot, &card, sizeof(card), true);
+              journal_tag_image(slot, &card, sizeof(card), true);
+              if (conf.read_plan == READ_PLAN_NDEF) {
+                ndef_area area;
+
+                if (ndef_area_ultralight(&area, &card))
+                  ned_print_ndef(&area);
+                else
+                  printf("%s\n", "NDEF: not formatted");
+              }
+            } else {
+              metrics_inc(METRIC_READS_ULTRALIGHT_FAILED);
+              done = false;
+            }
+          }
+      }
+      break;
+    case NMT_JEWEL:
+    case NMT_ISO14443B:
+    case NMT_ISO14443BI:
+    case NMT_ISO14443B2SR:
+    case NMT_ISO14443B2CT:
+    case NMT_FELICA:
+    default:
       break;
+  }
+  return done;
+}
+
+/**
+ * @brief Execute NEM function that handle events
+ */
+static int execute_event ( const nfc_device *dev, int slot, const nfc_target* tag, const nem_event_t event ) {
+  static const char *trace_names[] = {
+    [EVENT_TAG_INSERTED] = "event: tag inserted",
+    [EVENT_TAG_REMOVED]  = "event: tag removed",
+    [EVENT_EXPIRE_TIME]  = "event: expire time",
+    [EVENT_READER_DOWN]  = "event: reader down",
+    [EVENT_READER_UP]    = "event: reader up",
+  };
+  int64_t t = trace_begin();
+
+  INFO ( "%s\n", __FUNCTION__ );
+  metrics_inc(METRIC_EVENTS);
+  switch (event) {
+    case EVENT_TAG_INSERTED: {
+      /* decided right away, unless it depends on sector data */
+      acl_verdict verdict = acl_check(tag);
+
+      /* shared memory readers first, they are the ones waiting */
+      ring_tag_inserted(slot, tag, verdict);
+      metrics_inc(METRIC_TAPS);
+      state_tag_inserted(slot, tag, verdict);
+      journal_tag_inserted(slot, tag);
+      ned_decide(slot, verdict, true);
+      break;
+    }
     case EVENT_TAG_REMOVED:
+      ring_tag_removed(slot);
+      metrics_inc(METRIC_REMOVALS);
+      state_tag_removed(slot);
+      journal_tag_removed(slot);
+      break;
     case EVENT_EXPIRE_TIME:
+      ring_tag_expired(slot);
+      metrics_inc(METRIC_EXPIRIES);
+      journal_tag_expired(slot);
+      break;
+    case EVENT_READER_DOWN:
+    case EVENT_READER_UP:
+      ring_reader_status(NFCD_SLOT_READER(slot), event == EVENT_READER_UP);
+      if (event == EVENT_READER_DOWN)
+        metrics_inc(METRIC_READER_DOWN);
+      state_reader_status(NFCD_SLOT_READER(slot), event == EVENT_READER_UP);
+      journal_reader_status(NFCD_SLOT_READER(slot), event == EVENT_READER_UP);
+      break;
     default:
       break;
   }
+  trace_end(TRACE_NFCD, trace_names[event], t, 0);
   return 0;
 }
 
+/**
+ * @brief Adapt the software polling interval to a probe
+ * @param tap A new card was found
+ */
+static void
+sw_poll_adapt(bool tap)
+{
+  const int64_t now = timer_now();
+  int     interval = sw_poll.interval;
 
-typedef enum {
-  NFC_POLL_HARDWARE,
-  NFC_POLL_SOFTWARE,
-} nfc_poll_mode;
+  if (tap) {
+    if (sw_poll.last_tap)
+      sw_poll.tap_gap = sw_poll.tap_gap ? (3 * sw_poll.tap_gap + (now - sw_poll.last_tap)) / 4 : now - sw_poll.last_tap;
+    sw_poll.last_tap = now;
+    interval = conf.poll_min_interval;
+  } else if (!sw_poll.last_tap || (now - sw_poll.last_tap > 2 * sw_poll.tap_gap)) {
+    // Quieter than usual: back off
+    interval += interval / 4 + 1;
+  }
+  if (interval < conf.poll_min_interval)
+    interval = conf.poll_min_interval;
+  if (interval > conf.poll_max_interval)
+    interval = conf.poll_max_interval;
+  if (interval != sw_poll.interval)
+    DBG("Software poll interval %d ms", interval);
+  __atomic_store_n(&sw_poll.interval, interval, __ATOMIC_RELAXED);
+}
 
-static nfc_target*
-ned_poll_for_tag(nfc_device* dev, nfc_target* tag)
+static bool
+ned_field_present ( void )
+{
+  size_t  j;
+
+  for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+    if ( field[j].present )
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief The bytes a card of its modulation is told apart by
+ * @param len Set to their count, 0 for a modulation without an identifier
+ */
+static const uint8_t *
+ned_target_id ( const nfc_target *t, size_t *len )
+{
+  switch ( t->nm.nmt ) {
+    case NMT_ISO14443A:
+      *len = MIN ( t->nti.nai.szUidLen, sizeof ( t->nti.nai.abtUid ) );
+      return t->nti.nai.abtUid;
+    case NMT_FELICA:
+      *len = sizeof ( t->nti.nfi.abtId );
+      return t->nti.nfi.abtId;
+    case NMT_ISO14443B:
+      *len = sizeof ( t->nti.nbi.abtPupi );
+      return t->nti.nbi.abtPupi;
+    case NMT_ISO14443BI:
+      *len = sizeof ( t->nti.nii.abtDIV );
+      return t->nti.nii.abtDIV;
+    case NMT_ISO14443B2SR:
+      *len = sizeof ( t->nti.nsi.abtUID );
+      return t->nti.nsi.abtUID;
+    case NMT_ISO14443B2CT:
+      *len = sizeof ( t->nti.nci.abtUID );
+      return t->nti.nci.abtUID;
+    case NMT_JEWEL:
+      *len = sizeof ( t->nti.nji.btId );
+      return t->nti.nji.btId;
+    default:
+      *len = 0;
+      return NULL;
+  }
+}
+
+static bool
+same_target ( const nfc_target *a, const nfc_target *b )
+{
+  const uint8_t *ida, *idb;
+  size_t  la, lb;
+
+  if ( a->nm.nmt != b->nm.nmt )
+    return false;
+  ida = ned_target_id ( a, &la );
+  idb = ned_target_id ( b, &lb );
+  return ( la == lb ) && ( !la || !memcmp ( ida, idb, la ) );
+}
+
+/**
+ * @brief Halt the selected card, so that the next list passes it by
+ */
+static void
+ned_halt ( nfc_device* dev )
+{
+  int64_t t;
+  int     res;
+
+  t = trace_begin();
+  res = nfcd_device_deselect ( dev );
+  trace_end(TRACE_LIBNFC, "nfc_initiator_deselect_target", t, res);
+}
+
+/**
+ * @brief Add @a target to the @a n cards in @a found, unless it is there already
+ */
+static void
+ned_add_target ( nfc_target found[NFCD_MAX_CARDS], int *n, const nfc_target *target )
+{
+  int     i;
+
+  for ( i = 0; i < *n; i++ ) {
+    if ( same_target ( &found[i], target ) )
+      return;
+  }
+  if ( *n < NFCD_MAX_CARDS )
+    found[( *n )++] = *target;
+}
+
+/* A card that does not answer, or answers along with another, is no reader failure */
+static bool
+ned_card_error ( int res )
+{
+  return ( res == NFC_ETIMEOUT ) || ( res == NFC_ERFTRANS );
+}
+
+/**
+ * @brief Wake an ISO14443A card, and select it by its UID
+ * @param halt Halt it again once it answered, so that lists pass it by
+ *
+ * The reader's own select starts with REQA, which a halted card ignores:
+ * the card is woken with WUPA, then selected one cascade level at a time,
+ * in raw frames.
+ *
+ * @return 1 if the card answered, 0 if not, -1 if the reader failed
+ */
+static int
+ned_wake_card ( nfc_device* dev, const nfc_target* tag, bool halt )
+{
+  const uint8_t wupa = 0x52;
+  const uint8_t hlta[2] = { 0x50, 0x00 };
+  const uint8_t* uid = tag->nti.nai.abtUid;
+  const size_t len = tag->nti.nai.szUidLen;
+  uint8_t sel[7], rx[3];
+  size_t  off;
+  int64_t t;
+  int     res;
+
+  if ( ( len != 4 ) && ( len != 7 ) && ( len != 10 ) )
+    return 0;
+  if ( ( nfcd_device_set_property_bool ( dev, NP_EASY_FRAMING, false ) < 0 ) ||
+       ( nfcd_device_set_property_bool ( dev, NP_HANDLE_CRC, false ) < 0 ) )
+    return -1;
+  t = trace_begin();
+  res = nfcd_device_transceive_bits ( dev, &wupa, 7, rx, sizeof ( rx ) );
+  trace_end(TRACE_LIBNFC, "nfc_initiator_transceive_bits: wupa", t, res);
+  if ( nfcd_device_set_property_bool ( dev, NP_HANDLE_CRC, true ) < 0 )
+    return -1;
+  /* a collision of several answers may still hide this card */
+  for ( off = 0; ( ( res >= 0 ) || ( res == NFC_ERFTRANS ) ) && ( off < len ); ) {
+    sel[0] = 0x93 + 2 * ( off / 3 );
+    sel[1] = 0x70;
+    if ( len - off > 4 ) {
+      /* cascade tag, the UID goes on at the next level */
+      sel[2] = 0x88;
+      memcpy ( sel + 3, uid + off, 3 );
+      off += 3;
+    } else {
+      memcpy ( sel + 2, uid + off, 4 );
+      off += 4;
+    }
+    sel[6] = sel[2] ^ sel[3] ^ sel[4] ^ sel[5];
+    t = trace_begin();
+    res = nfcd_device_transceive ( dev, sel, sizeof ( sel ), rx, sizeof ( rx ), WAKE_TIMEOUT );
+    trace_end(TRACE_LIBNFC, "nfc_initiator_transceive_bytes: select", t, res);
+    /* anything but a SAK, the card is not there */
+    if ( res > 0 )
+      res = ( res == 1 ) ? 0 : NFC_ETIMEOUT;
+  }
+  if ( ( res == 0 ) && halt ) {
+    /* no answer to HLTA */
+    t = trace_begin();
+    nfcd_device_transceive ( dev, hlta, sizeof ( hlta ), rx, sizeof ( rx ), WAKE_TIMEOUT );
+    trace_end(TRACE_LIBNFC, "nfc_initiator_transceive_bytes: hlta", t, 0);
+  }
+  if ( nfcd_device_set_property_bool ( dev, NP_EASY_FRAMING, true ) < 0 )
+    return -1;
+  if ( res == 0 )
+    return 1;
+  return ned_card_error ( res ) ? 0 : -1;
+}
+
+/**
+ * @brief The card of the field @a t is, NULL for a new one
+ */
+static field_card *
+ned_known_card ( const nfc_target *t )
+{
+  size_t  j;
+
+  for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+    if ( field[j].present && same_target ( &field[j].target, t ) )
+      return &field[j];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Leave each ISO14443A card halted once read, and answering the reader otherwise
+ *
+ * A list halts every card it finds but the last, and lists pass the cards
+ * already read by.  The cards just listed and the known ones the list did
+ * not find are woken, selected by their UID, then halted again unless they
+ * are still to be read.  A known card that answers is added to the @a n
+ * cards of @a found.
+ *
+ * @return 0, -1 if the reader failed
+ */
+static int
+ned_wake_field ( nfc_device* dev, nfc_target found[NFCD_MAX_CARDS], int *n )
+{
+  const int listed = *n;
+  field_card *c;
+  size_t  j;
+  int     k, res;
+
+  for ( k = 0; k < listed; k++ ) {
+    if ( found[k].nm.nmt != NMT_ISO14443A )
+      continue;
+    c = ned_known_card ( &found[k] );
+    if ( ned_wake_card ( dev, &found[k], c && !c->read_pending ) < 0 )
+      return -1;
+  }
+  for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+    c = &field[j];
+    if ( !c->present || ( c->target.nm.nmt != NMT_ISO14443A ) )
+      continue;
+    for ( k = 0; ( k < listed ) && !same_target ( &found[k], &c->target ); k++ )
+      ;
+    if ( k < listed )
+      continue;
+    if ( ( res = ned_wake_card ( dev, &c->target, !c->read_pending ) ) < 0 )
+      return -1;
+    if ( res > 0 )
+      ned_add_target ( found, n, &c->target );
+  }
+  return 0;
+}
+
+/**
+ * @brief Enumerate the cards in the field
+ * @param polled Card the reader just polled and left selected, or NULL
+ *
+ * Each modulation is listed, then the ISO14443A cards are checked by their
+ * UID, as a card halted once read ignores the lists.  The cards of other
+ * modulations a list halts only answer again after a field cycle, which the
+ * next scan does; otherwise the field is only cycled to recover from a
+ * failed scan, as that resets every card.
+ *
+ * @return Number of targets stored in @a found, -1 if the reader failed
+ */
+static int
+ned_scan_field(nfc_device* dev, const nfc_target* polled, nfc_target found[NFCD_MAX_CARDS])
+{
+  const int64_t start = timer_now();
+  nfc_target listed[NFCD_MAX_CARDS];
+  size_t  i, j;
+  int64_t t;
+  int     n = 0, res = 0;
+
+  if ( field_reset ) {
+    nfcd_device_set_property_bool ( dev, NP_ACTIVATE_FIELD, false );
+    nfcd_device_set_property_bool ( dev, NP_ACTIVATE_FIELD, true );
+    field_reset = false;
+  }
+  if ( polled )
+    found[n++] = *polled;
+  for ( i = 0; ( res >= 0 ) && ( i < conf.num_modulations ); i++ ) {
+    metrics_inc(METRIC_POLLS);
+    t = trace_begin();
+    res = nfcd_device_list ( dev, conf.modulations[i], listed, NFCD_MAX_CARDS );
+    trace_end(TRACE_LIBNFC, "nfc_initiator_list_passive_targets", t, res);
+    for ( j = 0; ( int ) j < res; j++ )
+      ned_add_target ( found, &n, &listed[j] );
+    /* while the reader still frames type A */
+    if ( ( res >= 0 ) && ( conf.modulations[i].nmt == NMT_ISO14443A ) )
+      res = ned_wake_field ( dev, found, &n );
+    else if ( res > 1 )
+      field_reset = true;
+  }
+  if ( res < 0 ) {
+    /* no telling which cards are there: leave the field as it was, and start afresh next time */
+    field_reset = true;
+    return -1;
+  }
+  /* next check poll_interval after this one started, however long reads take */
+  if ( ( n > 0 ) || ned_field_present() )
+    timer_add ( &wheel, &presence_timer, conf.poll_interval - ( timer_now() - start ) );
+  presence_due = false;
+  return n;
+}
+
+/**
+ * @brief Fire timers until @a timer sets @a flag, or a signal is to be handled
+ */
+static void
+ned_wait_for ( nfcd_timer *timer, bool *flag )
+{
+  while ( !*flag && timer_pending ( timer ) && !ned_stopping() && !signals_reload_pending() ) {
+    signals_sleep ( timer_next ( &wheel ) );
+    timer_run ( &wheel );
+  }
+  *flag = false;
+}
+
+/**
+ * @brief Wait for the next look at the field, then enumerate the cards in it
+ * @param present Cards were in the field at the last scan
+ * @param reading A read is due, check the field without waiting
+ * @return Number of targets stored in @a found, -1 if the reader failed
+ */
+static int
+ned_poll_field(nfc_device* dev, bool present, bool reading, nfc_target found[NFCD_MAX_CARDS])
 {
-  uint8_t uiPollNr;
   const uint8_t uiPeriod = 2; /* 2 x 150 ms = 300 ms */
-  const nfc_modulation nm[1] = { { .nmt = NMT_ISO14443A, .nbr = NBR_106 } };
+  uint8_t uiPollNr = 0xff;
+  nfc_target target;
+  int64_t t;
+  int     n, res, next;
+
+  if ( present ) {
+    /* We are checking the cards we know of */
+    /* In this case, to prevent for intensive polling we wait for the presence check deadline */
+    if ( !reading && !replay_active ( capture ) )
+        ned_wait_for ( &presence_timer, &presence_due );
+    return ned_scan_field ( dev, NULL, found );
+  }
+
+  if ( conf.poll_mode == NFC_POLL_SOFTWARE ) {
+    /* Short scans, spaced by an interval adapted to the traffic */
+    while ( !ned_stopping() && !signals_reload_pending() ) {
+      if ( ( n = ned_scan_field ( dev, NULL, found ) ) != 0 ) {
+        if ( n > 0 )
+          sw_poll_adapt ( true );
+        return n;
+      }
+      sw_poll_adapt ( false );
+      if ( replay_active ( capture ) )
+          continue;
+      timer_add ( &wheel, &probe_timer, sw_poll.interval );
+      ned_wait_for ( &probe_timer, &probe_due );
+    }
+    return 0;
+  }
+
+  /* We endless poll for a new tag, or until the next deadline, then look for the other cards next to it */
+  if ( ( next = timer_next ( &wheel ) ) >= 0 && !replay_active ( capture ) ) {
+    /* the reader polls in rounds, one period per modulation */
+    next /= 150 * uiPeriod * conf.num_modulations;
+    if ( next < 1 ) {
+      /* not even one round left before the deadline */
+      signals_sleep ( timer_next ( &wheel ) );
+      return 0;
+    }
+    uiPollNr = ( next > 0xfe ) ? 0xfe : next;
+  }
+  metrics_inc(METRIC_POLLS);
+  t = trace_begin();
+  res = nfcd_session_poll ( &session, conf.modulations, conf.num_modulations, uiPollNr, uiPeriod, &target );
+  trace_end(TRACE_LIBNFC, "nfc_initiator_poll_target", t, res);
+  if ( ned_stopping() )
+    return 0;
+  if ( res <= 0 )
+    return ( res < 0 ) ? -1 : 0;
+  return ned_scan_field ( dev, &target, found );
+}
+
+static void
+ned_remove_card ( nfc_device* dev, size_t j )
+{
+  timer_cancel ( &wheel, &field[j].gone );
+  DBG ( "Event detected: tag removed (card %zu)", j );
+  execute_event ( dev, NFCD_SLOT(0, j), &field[j].target, EVENT_TAG_REMOVED );
+  field[j].present = false;
+  if ( !ned_field_present() ) {
+    /* nothing to check any more, and an empty field expires */
+    timer_cancel ( &wheel, &presence_timer );
+    if ( conf.expire_time )
+      timer_add ( &wheel, &expire_timer, conf.expire_time );
+  }
+}
+
+static void
+card_gone ( nfcd_timer *timer, void *user )
+{
+  ned_remove_card ( session.dev.pnd, (field_card *) user - field );
+}
+
+static void
+field_expired ( nfcd_timer *timer, void *user )
+{
+  DBG ( "%s", "Timeout on tag removed " );
+  execute_event ( session.dev.pnd, NFCD_SLOT(0, 0), NULL, EVENT_EXPIRE_TIME );
+  timer_add ( &wheel, timer, conf.expire_time ); /*restart timer */
+}
+
+static void
+deadline_reached ( nfcd_timer *timer, void *user )
+{
+  *(bool *) user = true;
+}
+
+/**
+ * @brief Turn a scan into insert and remove events
+ *
+ * A card missing from the scan is only reported removed once it has been
+ * missing for debounce_time.
+ */
+static void
+ned_update_field ( nfc_device* dev, const nfc_target found[], int n )
+{
+  bool    seen[NFCD_MAX_CARDS] = { false };
+  field_card *c;
+  size_t  i, j;
+
+  for ( i = 0; i < (size_t) n; i++ ) {
+    if ( ( c = ned_known_card ( &found[i] ) ) != NULL ) {
+      seen[c - field] = true;
+      timer_cancel ( &wheel, &c->gone );
+      continue;
+    }
+    for ( j = 0; ( j < NFCD_MAX_CARDS ) && field[j].present; j++ )
+      ;
+    if ( j == NFCD_MAX_CARDS )
+      break;
+    timer_cancel ( &wheel, &expire_timer );
+    memset ( &field[j], 0, sizeof ( field[j] ) );
+    timer_init ( &field[j].gone, card_gone, &field[j] );
+    field[j].present = true;
+    field[j].target = found[i];
+    field[j].read_pending = true;
+    seen[j] = true;
+    DBG ( "Event detected: tag inserted (card %zu)", j );
+    execute_event ( dev, NFCD_SLOT(0, j), &field[j].target, EVENT_TAG_INSERTED );
+  }
+  for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+    if ( !field[j].present || seen[j] || timer_pending ( &field[j].gone ) )
+      continue;
+    if ( conf.debounce_time )
+      timer_add ( &wheel, &field[j].gone, conf.debounce_time );
+    else
+      ned_remove_card ( dev, j );
+  }
+}
+
+/**
+ * @brief Whether a card waits to be read now
+ */
+static bool
+ned_read_due ( void )
+{
+  size_t  j;
+
+  for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+    if ( field[j].present && field[j].read_pending && ( field[j].read_wait == 0 ) )
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Debit the configured value block of a MIFARE Classic card
+ *
+ * Runs right after the read, on the session it left open, so the debit
+ * completes in the same tap.
+ */
+static void
+ned_debit ( nfcd_session* ps, nfc_target* tag )
+{
+  mifare_classic_value_op ops[2] = {
+    { .mc = MC_DECREMENT, .ui8Block = conf.debit_block, .ui8Dest = conf.debit_block, .uiAmount = conf.debit_amount },
+    /* a copy of the new balance, telling which one is right if the tag leaves halfway */
+    { .mc = MC_STORE, .ui8Block = conf.debit_block, .ui8Dest = conf.debit_backup_block },
+  };
+  mifare_classic_value_status status;
+  int64_t t;
 
-  if( tag != NULL ) {
-    /* We are looking for a previous tag */
-    /* In this case, to prevent for intensive polling we add a sleeping time */
-    sleep ( polling_time );
-    uiPollNr = 3; /* Polling duration : btPollNr * szTargetTypes * btPeriod * 150 = btPollNr * 300 = 900 */
+  if ( ( tag->nm.nmt != NMT_ISO14443A ) || !( tag->nti.nai.btSak & 0x08 ) )
+    return;
+  t = trace_begin();
+  status = mifare_classic_value_apply ( ps, tag, NULL, ops, conf.debit_backup_block ? 2 : 1 );
+  trace_end ( TRACE_NFCD, "mifare_classic_value_apply", t, status );
+  if ( status == MC_VALUE_OK ) {
+    metrics_inc ( METRIC_DEBITS_OK );
+    printf ( "Debit: %d from block %d, balance %d\n", conf.debit_amount, conf.debit_block, ops[0].iAfter );
   } else {
-    /* We are looking for any tag */
-    uiPollNr = 0xff; /* We endless poll for a new tag */
+    metrics_inc ( METRIC_DEBITS_FAILED );
+    printf ( "Debit failed: %s\n", mifare_classic_value_status_name ( status ) );
   }
+}
 
-  nfc_target target;
-  int res = nfc_initiator_poll_target (dev, nm, 1, uiPollNr, uiPeriod, &target);
-  if (res > 0) {
-    if ( (tag != NULL) && (0 == memcmp(tag->nti.nai.abtUid, target.nti.nai.abtUid, target.nti.nai.szUidLen)) ) {
-      return tag;
+/**
+ * @brief Read one of the cards waiting, taking turns between them
+ *
+ * One read per scan: with several cards in the field a read may fail on
+ * collisions, so a failed card waits twice as many scans each time before the
+ * next attempt, and the others get their turn meanwhile.
+ */
+static void
+ned_read_next ( nfcd_session* ps )
+{
+  size_t  i, j, present = 0;
+  bool    read;
+
+  for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+    if ( field[j].present )
+      present++;
+    if ( field[j].present && field[j].read_pending && field[j].read_wait )
+      field[j].read_wait--;
+  }
+  mifare_classic_set_field_shared ( ps, present > 1 );
+  for ( i = 0; i < NFCD_MAX_CARDS; i++ ) {
+    field_card *c = &field[( next_read + i ) % NFCD_MAX_CARDS];
+
+    if ( !c->present || !c->read_pending || c->read_wait )
+      continue;
+    j = ( next_read + i ) % NFCD_MAX_CARDS;
+    next_read = j + 1;
+    read = ned_read_tag ( ps, NFCD_SLOT(0, j), &c->target );
+    if ( read ) {
+      c->read_pending = false;
+    } else if ( ++c->read_failures >= READ_ATTEMPTS ) {
+      WARN ( "Giving up reading card %zu after %u attempts", j, c->read_failures );
+      c->read_pending = false;
     } else {
-      nfc_target* rv = malloc(sizeof(nfc_target));
-      memcpy(rv, &target, sizeof(nfc_target));
-      nfc_initiator_deselect_target ( dev );
-      return rv;
+      c->read_wait = 1u << c->read_failures;
     }
-  } else {
-    return NULL;
+    /* no sector rule matched what could be read */
+    if ( !c->read_pending && ( c->verdict == ACL_PENDING ) )
+      ned_decide ( NFCD_SLOT(0, j), acl_default(), false );
+    /* charge a card only once it was read, and judged on what was read */
+    if ( read && conf.debit_block && ( c->verdict != ACL_DENY ) )
+      ned_debit ( ps, &c->target );
+    /* out of the way of the next list, until a scan wakes it */
+    if ( !c->read_pending )
+      ned_halt ( ps->dev.pnd );
+    return;
+  }
+}
+
+/**
+ * @brief Give up on a reader that stopped answering, and schedule its reopening
+ */
+static void
+ned_reader_down ( void )
+{
+  WARN ( "NFC device %s stopped answering, reopening it", conf.device[0] ? conf.device : "(default)" );
+  execute_event ( session.dev.pnd, NFCD_SLOT(0, 0), NULL, EVENT_READER_DOWN );
+  nfcd_device_close ( &session.dev );
+  reader_up = false;
+  reader_backoff = RETRY_MIN;
+  timer_add ( &wheel, &retry_timer, 0 );
+}
+
+/**
+ * @brief Wait for the next reopen attempt, then reopen and initialize the reader
+ */
+static void
+ned_reader_reopen ( void )
+{
+  ned_wait_for ( &retry_timer, &retry_due );
+  if ( timer_pending ( &retry_timer ) )
+    /* interrupted by a signal */
+    return;
+  if ( nfcd_device_open ( &session.dev, context, conf.device ) < 0 ) {
+    metrics_inc ( METRIC_READER_REOPEN_FAILURES );
+    DBG ( "NFC device still not answering, next attempt in %d ms", reader_backoff );
+    timer_add ( &wheel, &retry_timer, reader_backoff );
+    reader_backoff = ( reader_backoff > conf.reader_retry_max / 2 ) ? conf.reader_retry_max : 2 * reader_backoff;
+    return;
   }
+  INFO ( "Reconnected to NFC device: %s", nfcd_device_get_name ( session.dev.pnd ) );
+  reader_up = true;
+  execute_event ( session.dev.pnd, NFCD_SLOT(0, 0), NULL, EVENT_READER_UP );
 }
 
 int
 main ( int argc, char *argv[] ) {
-    nfc_target* old_tag = NULL;
-    nfc_target* new_tag;
+    nfc_target found[NFCD_MAX_CARDS];
+    size_t  j;
+    int     n;
 
-    int expire_count = 0;
+    nfcd_session_init ( &session, NULL );
+    switch ( conf_load ( &conf, argc, argv ) ) {
+        case 0:
+            break;
+        case 1:
+            exit(EXIT_SUCCESS);
+        default:
+            exit(EXIT_FAILURE);
+    }
+    if ( apply_config ( &conf ) < 0 )
+        exit(EXIT_FAILURE);
 
     /* put my self into background if flag is set */
-    if ( daemonize ) {
+    if ( conf.daemonize ) {
         DBG ( "%s", "Going to be daemon..." );
-        if ( daemon ( 0, debug ) < 0 ) {
+        if ( daemon ( 0, conf.debug ) < 0 ) {
             ERR ( "Error in daemon() call: %s", strerror ( errno ) );
             return 1;
         }
@@ -175,72 +1240,126 @@ main ( int argc, char *argv[] ) {
      * so the way we proceed is to look for an tag
      * Any ideas will be welcomed
      */
-    signal(SIGINT, stop_polling);
-    signal(SIGTERM, stop_polling);
+    if ( signals_init() < 0 )
+        exit(EXIT_FAILURE);
+    mifare_classic_set_abort_handler ( &session, engine_abort );
+    nfcd_session_set_poll_watch ( &session, engine_poll_watch );
+    signals_set_dump_handler ( trace_dump );
+    trace_thread_name ( "poll loop" );
+    apply_journal ( &conf, NULL );
+    apply_metrics ( &conf, NULL );
+    if ( ( capture = capture_new() ) == NULL ) {
+        ERR ( "%s", "Out of memory" );
+        exit(EXIT_FAILURE);
+    }
+    session.dev.pCapture = capture;
+    if ( conf.replay_file[0] && ( replay_start ( capture, conf.replay_file ) < 0 ) )
+        exit(EXIT_FAILURE);
+    apply_capture ( &conf, NULL );
+    apply_acl ( &conf, NULL );
+    apply_ring ( &conf, NULL );
+    metrics_set_gauge ( METRIC_JOURNAL_UNSYNCED, journal_unsynced_bytes );
+    if ( conf.ubus && ( rpc_init() < 0 ) )
+        WARN ( "%s", "ubus interface disabled" );
 
     nfc_init(&context);
     if (context == NULL) {
       ERR( "Unable to init libnfc (malloc)" );
       exit(EXIT_FAILURE);
     }
-    // Try to open the NFC device
-    if ( device == NULL ) device = nfc_open( context, NULL );
-    if ( device == NULL ) {
+    // Try to open the NFC device, initiator mode with our property profile
+    if ( nfcd_device_open ( &session.dev, context, conf.device ) < 0 ) {
         ERR( "%s", "NFC device not found" );
+        nfc_exit(context);
         exit(EXIT_FAILURE);
     }
-    nfc_initiator_init ( device );
-
-    // Drop the field for a while
-    nfc_device_set_property_bool ( device, NP_ACTIVATE_FIELD, false );
-    nfc_device_set_property_bool ( device, NP_INFINITE_SELECT, false );
-
-    // Configure the CRC and Parity settings
-    nfc_device_set_property_bool ( device, NP_HANDLE_CRC, true );
-    nfc_device_set_property_bool ( device, NP_HANDLE_PARITY, true );
-
-    // Enable field so more power consuming cards can power themselves up
-    nfc_device_set_property_bool ( device, NP_ACTIVATE_FIELD, true );
-
-    INFO( "Connected to NFC device: %s", nfc_device_get_name(device) );
-
-    do {
-detect:
-        new_tag = ned_poll_for_tag(device, old_tag);
-
-        if ( old_tag == new_tag ) { /* state unchanged */
-            /* on card not present, increase and check expire time */
-            if (( !quit_flag ) && ( expire_time == 0 )) goto detect;
-            if (( !quit_flag ) && ( new_tag != NULL )) goto detect;
-            expire_count += polling_time;
-            if ( expire_count >= expire_time ) {
-                DBG ( "%s", "Timeout on tag removed " );
-                execute_event ( device, new_tag, EVENT_EXPIRE_TIME );
-                expire_count = 0; /*restart timer */
-            }
-        } else { /* state changed; parse event */
-            expire_count = 0;
-            if ( new_tag == NULL ) {
-                DBG ( "%s", "Event detected: tag removed" );
-                execute_event ( device, old_tag, EVENT_TAG_REMOVED );
-                free(old_tag);
+
+    INFO( "Connected to NFC device: %s", nfcd_device_get_name(session.dev.pnd) );
+
+    timer_wheel_init ( &wheel );
+    timer_init ( &expire_timer, field_expired, NULL );
+    timer_init ( &presence_timer, deadline_reached, &presence_due );
+    timer_init ( &probe_timer, deadline_reached, &probe_due );
+    timer_init ( &retry_timer, deadline_reached, &retry_due );
+    reader_up = true;
+    if ( conf.expire_time )
+        timer_add ( &wheel, &expire_timer, conf.expire_time );
+
+    while ( !ned_stopping() ) {
+        if ( signals_reload_requested() ) {
+            nfcd_conf new_conf;
+
+            INFO( "%s", "Reloading configuration" );
+            if ( ( conf_reload ( &new_conf ) == 0 ) && ( apply_config ( &new_conf ) == 0 ) ) {
+                /* a reader down is reopened with the new settings */
+                if ( reader_up && ( nfcd_device_reload ( &session.dev, context, new_conf.device ) < 0 ) ) {
+                    ERR ( "%s", "Unable to switch device, reopening previous one" );
+                    strcpy ( new_conf.device, conf.device );
+                    if ( nfcd_device_reload ( &session.dev, context, conf.device ) < 0 )
+                        ned_reader_down();
+                }
+                if ( strcmp ( new_conf.device, conf.device ) != 0 ) {
+                    /* tags were on another reader */
+                    for ( j = 0; j < NFCD_MAX_CARDS; j++ ) {
+                        if ( field[j].present )
+                            ned_remove_card ( session.dev.pnd, j );
+                    }
+                }
+                if ( !ned_field_present() && ( new_conf.expire_time != conf.expire_time ) ) {
+                    timer_cancel ( &wheel, &expire_timer );
+                    if ( new_conf.expire_time )
+                        timer_add ( &wheel, &expire_timer, new_conf.expire_time );
+                }
+                apply_journal ( &new_conf, &conf );
+                apply_metrics ( &new_conf, &conf );
+                apply_capture ( &new_conf, &conf );
+                apply_acl ( &new_conf, &conf );
+                apply_ring ( &new_conf, &conf );
+                conf = new_conf;
             } else {
-                DBG ( "%s", "Event detected: tag inserted " );
-                execute_event ( device, new_tag, EVENT_TAG_INSERTED );
+                ERR ( "%s", "Configuration reload failed, keeping previous settings" );
             }
-            old_tag = new_tag;
+            continue;
+        }
+
+        if ( !reader_up ) {
+            ned_reader_reopen();
+            continue;
+        }
+
+        n = ned_poll_field ( session.dev.pnd, ned_field_present(), ned_read_due(), found );
+        if ( ned_stopping() ) {
+            /* polling was aborted, the result means nothing */
+            break;
         }
-    } while ( !quit_flag );
 
-    if ( device != NULL ) {
-        nfc_close(device);
-        DBG ( "NFC device (0x%08x) is disconnected", device );
-        device = NULL;
+        if ( n >= 0 )
+            ned_update_field ( session.dev.pnd, found, n );
+        timer_run ( &wheel );
+        if ( n >= 0 )
+            ned_read_next ( &session );
+
+        if ( !replay_active ( capture ) && !nfcd_device_healthy ( &session.dev, conf.reader_max_errors ) ) {
+            ned_reader_down();
+        } else if ( ( n < 0 ) && !replay_active ( capture ) ) {
+            /* let a glitch pass before the next attempt */
+            timer_add ( &wheel, &retry_timer, RETRY_MIN );
+            ned_wait_for ( &retry_timer, &retry_due );
+        }
     }
 
-    /* If we get here means that an error or exit status occurred */
+    if ( session.dev.pnd != NULL )
+        DBG ( "%s", "NFC device is disconnected" );
+    nfcd_session_free ( &session );
+
     DBG ( "%s", "Exited from main loop" );
+    latency_print();
+    replay_report ( capture );
+    capture_free ( capture );
+    ring_close();
+    metrics_stop();
+    rpc_stop();
+    journal_close();
     nfc_exit(context);
-    exit ( EXIT_FAILURE );
+    exit ( ned_stopping() ? EXIT_SUCCESS : EXIT_FAILURE );
 } /* main */
-
@@ -0,0 +1,328 @@
+/*
+ * NFC Event Daemon
+ * Shared memory event ring
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file ring.c
+ * @brief Tag events broadcast to local processes through shared memory
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <nfc/nfc.h>
+
+#include "ring.h"
+#include "state.h"
+#include "nfc-utils.h"
+#include "debug.h"
+
+#define RING_MAX_CAPACITY 65536
+
+/* Written by the poll loop only */
+static ring_header *header = NULL;
+static ring_record *records;
+static size_t ring_size;
+static char ring_name[NAME_MAX];
+
+static int
+futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout)
+{
+  return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+int
+ring_open(const char *name, unsigned capacity)
+{
+  void   *map;
+  size_t  size;
+  int     fd;
+
+  ring_close();
+  if ((capacity < 2) || (capacity > RING_MAX_CAPACITY) || (capacity & (capacity - 1))) {
+    ERR("Ring capacity must be a power of two from 2 to %d", RING_MAX_CAPACITY);
+    return -1;
+  }
+  if (strlen(name) >= sizeof(ring_name)) {
+    ERR("Ring name too long: %s", name);
+    return -1;
+  }
+
+  // Readers of a ring left behind by a crash keep it mapped, it is theirs
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660)) < 0) {
+    ERR("Unable to create ring %s: %s", name, strerror(errno));
+    return -1;
+  }
+  size = sizeof(ring_header) + (size_t) capacity * sizeof(ring_record);
+  if ((fchmod(fd, 0660) < 0) || (ftruncate(fd, size) < 0)) {
+    ERR("Unable to size ring %s: %s", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ERR("Unable to map ring %s: %s", name, strerror(errno));
+    shm_unlink(name);
+    return -1;
+  }
+
+  // ftruncate() zero filled it: head 0, no record complete yet
+  records = (ring_record *) ((uint8_t *) map + sizeof(ring_header));
+  ring_size = size;
+  strcpy(ring_name, name);
+  ((ring_header *) map)->version = RING_VERSION;
+  ((ring_header *) map)->record_size = sizeof(ring_record);
+  ((ring_header *) map)->capacity = capacity;
+  __atomic_store_n(&((ring_header *) map)->magic, RING_MAGIC, __ATOMIC_RELEASE);
+  header = map;
+  DBG("Event ring %s: %u records", name, capacity);
+  return 0;
+}
+
+void
+ring_close(void)
+{
+  if (header == NULL)
+    return;
+  __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+  futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+  munmap(header, ring_size);
+  shm_unlink(ring_name);
+  header = NULL;
+}
+
+/**
+ * @brief Append a record, waking the readers up if some are sleeping
+ */
+static void
+ring_append(ring_record_type type, int slot, const nfc_target *pnt, int verdict)
+{
+  const uint32_t seq = header->head;
+  ring_record *r = &records[seq & (header->capacity - 1)];
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  // Odd one out while we write: readers expecting seq will not take it
+  __atomic_store_n(&r->seq, seq - 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r->type = type;
+  r->slot = slot;
+  r->time = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->verdict = verdict;
+  r->nmt = r->nbr = r->szUidLen = r->btSak = 0;
+  memset(r->abtUid, 0, sizeof(r->abtUid));
+  memset(r->abtAtqa, 0, sizeof(r->abtAtqa));
+  if (pnt) {
+    r->nmt = pnt->nm.nmt;
+    r->nbr = pnt->nm.nbr;
+    if (pnt->nm.nmt == NMT_ISO14443A) {
+      r->szUidLen = pnt->nti.nai.szUidLen;
+      memcpy(r->abtUid, pnt->nti.nai.abtUid, r->szUidLen);
+      memcpy(r->abtAtqa, pnt->nti.nai.abtAtqa, 2);
+      r->btSak = pnt->nti.nai.btSak;
+    }
+  }
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->head, seq + 1, __ATOMIC_RELEASE);
+
+  // Pairs with the waiters increment in ring_read(): either we see the
+  // sleeper, or it sees the new futex value and does not sleep
+  __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST))
+    futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void
+ring_tag_inserted(int slot, const nfc_target *pnt, int verdict)
+{
+  if (header)
+    ring_append(RING_TAG_INSERTED, slot, pnt, verdict);
+}
+
+void
+ring_tag_removed(int slot)
+{
+  if (header)
+    ring_append(RING_TAG_REMOVED, slot, NULL, 0);
+}
+
+void
+ring_tag_expired(int slot)
+{
+  if (header)
+    ring_append(RING_TAG_EXPIRED, slot, NULL, 0);
+}
+
+void
+ring_tag_verdict(int slot, int verdict)
+{
+  if (header)
+    ring_append(RING_TAG_VERDICT, slot, NULL, verdict);
+}
+
+void
+ring_reader_status(int reader, bool up)
+{
+  if (header)
+    ring_append(up ? RING_READER_UP : RING_READER_DOWN, NFCD_SLOT(reader, 0), NULL, 0);
+}
+
+int
+ring_reader_open(ring_reader *prr, const char *name)
+{
+  ring_header h;
+  struct stat st;
+  void   *map;
+  int     fd;
+
+  memset(prr, 0, sizeof(*prr));
+  if ((fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) < 0) {
+    ERR("Unable to open ring %s: %s", name, strerror(errno));
+    return -1;
+  }
+  if ((fstat(fd, &st) < 0) || ((size_t) st.st_size < sizeof(h)) ||
+      (pread(fd, &h, sizeof(h), 0) != sizeof(h)) || (h.magic != RING_MAGIC) ||
+      (h.version != RING_VERSION) || (h.record_size != sizeof(ring_record)) ||
+      ((size_t) st.st_size < sizeof(h) + (size_t) h.capacity * sizeof(ring_record))) {
+    ERR("Not a ring, or not one of this version: %s", name);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ERR("Unable to map ring %s: %s", name, strerror(errno));
+    return -1;
+  }
+  prr->header = map;
+  prr->records = (const ring_record *) ((const uint8_t *) map + sizeof(ring_header));
+  prr->size = st.st_size;
+  prr->next = __atomic_load_n(&prr->header->head, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+/**
+ * @brief Take the next record if there is one
+ * @return true if @a record was filled
+ */
+static bool
+ring_take(ring_reader *prr, ring_record *record)
+{
+  const uint32_t mask = prr->header->capacity - 1;
+
+  for (;;) {
+    const uint32_t head = __atomic_load_n(&prr->header->head, __ATOMIC_ACQUIRE);
+    const ring_record *r;
+    uint32_t seq;
+
+    if (head == prr->next)
+      return false;
+    if (head - prr->next > mask + 1) {
+      // Lapped: skip to the oldest record still there
+      prr->lost += head - prr->next - (mask + 1);
+      prr->next = head - (mask + 1);
+    }
+    r = &prr->records[prr->next & mask];
+    seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    memcpy(record, r, sizeof(*record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq == prr->next) && (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq)) {
+      record->seq = seq;
+      prr->next++;
+      return true;
+    }
+    // Overwritten while we copied it, the head has moved on: look again
+  }
+}
+
+int
+ring_read(ring_reader *prr, ring_record *record, int timeout)
+{
+  struct timespec deadline, now, left;
+
+  if (timeout > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  for (;;) {
+    uint32_t val;
+
+    if (ring_take(prr, record))
+      return 1;
+    if (__atomic_load_n(&prr->header->closed, __ATOMIC_ACQUIRE))
+      return -1;
+    if (timeout == 0)
+      return 0;
+
+    __atomic_add_fetch(&prr->header->waiters, 1, __ATOMIC_SEQ_CST);
+    val = __atomic_load_n(&prr->header->futex, __ATOMIC_SEQ_CST);
+    if ((__atomic_load_n(&prr->header->head, __ATOMIC_SEQ_CST) == prr->next) &&
+        !__atomic_load_n(&prr->header->closed, __ATOMIC_ACQUIRE)) {
+      if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = deadline.tv_sec - now.tv_sec;
+        left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0) {
+          left.tv_sec--;
+          left.tv_nsec += 1000000000L;
+        }
+        if (left.tv_sec < 0) {
+          __atomic_sub_fetch(&prr->header->waiters, 1, __ATOMIC_SEQ_CST);
+          return 0;
+        }
+      }
+      // Shared between processes: no FUTEX_PRIVATE_FLAG
+      futex(&prr->header->futex, FUTEX_WAIT, val, (timeout > 0) ? &left : NULL);
+    }
+    __atomic_sub_fetch(&prr->header->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void
+ring_reader_close(ring_reader *prr)
+{
+  if (prr->header)
+    munmap(prr->header, prr->size);
+  memset(prr, 0, sizeof(*prr));
+}
@@ -0,0 +1,137 @@
+/*
+ * NFC Event Daemon
+ * Shared memory event ring
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file ring.h
+ * @brief Tag events broadcast to local processes through shared memory
+ *
+ * The poll loop writes every tag event into a POSIX shared memory object
+ * (shm_open(), mode 0660) as a fixed size record, the moment it happens.
+ * Any number of processes map it and read at their own pace, each keeping
+ * its own next sequence number; nothing waits for them, so a reader that
+ * falls more than a ring behind loses the oldest records and is told how
+ * many.
+ *
+ * The object holds a ring_header, then ring_header.capacity ring_records
+ * (a power of two), in host byte order.  Sequence numbers are 32 bit and
+ * wrap around; compare them by difference.  Record n lives at index
+ * n & (capacity - 1); its seq field is a seqlock: it reads n - 1 while
+ * the record is being written and n once it is complete, so a copy taken
+ * between two equal reads of seq is consistent.
+ *
+ * Readers that run out of records sleep on the futex word, which is bumped
+ * after every record; the writer only makes the wake up system call when
+ * the waiters count says someone sleeps.  Reading never needs a system call.
+ *
+ * ring_reader_open() and ring_read() implement the reader side.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nfc/nfc-types.h>
+
+#define RING_MAGIC 0x5243464e       /* "NFCR" */
+#define RING_VERSION 1
+
+typedef enum {
+  RING_TAG_INSERTED = 1,
+  RING_TAG_REMOVED,
+  RING_TAG_EXPIRED,
+  RING_TAG_VERDICT,             /* a pending access verdict was settled */
+  RING_READER_DOWN,             /* slot of card 0 of the reader */
+  RING_READER_UP,
+} ring_record_type;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;         /* sizeof(ring_record) */
+  uint32_t capacity;            /* records, a power of two */
+  uint32_t closed;              /* the writer is gone, reopen the ring */
+  uint8_t pad0[44];
+  /* written for every record, on a cache line of its own */
+  uint32_t head;                /* sequence number of the next record */
+  uint32_t futex;               /* bumped after every record */
+  uint32_t waiters;             /* readers sleeping on futex */
+  uint8_t pad1[52];
+} ring_header;
+
+typedef struct {
+  uint32_t seq;
+  uint16_t type;                /* ring_record_type */
+  uint16_t slot;                /* state slot of the card, see NFCD_SLOT() */
+  int64_t time;                 /* nanoseconds, CLOCK_MONOTONIC */
+  uint8_t nmt;                  /* nfc_modulation_type */
+  uint8_t nbr;                  /* nfc_baud_rate */
+  uint8_t szUidLen;
+  uint8_t abtUid[10];
+  uint8_t abtAtqa[2];
+  uint8_t btSak;
+  uint8_t verdict;              /* acl_verdict */
+  uint8_t pad[31];
+} ring_record;
+
+typedef struct {
+  ring_header *header;
+  const ring_record *records;
+  size_t  size;
+  uint32_t next;                /* sequence number to read next */
+  uint32_t lost;                /* records overwritten before they were read */
+} ring_reader;
+
+/**
+ * @brief Create the ring @a name (e.g. "/nfcd") with @a capacity records
+ * @return 0 on success, -1 on error
+ */
+int     ring_open(const char *name, unsigned capacity);
+
+/**
+ * @brief Mark the ring closed, wake its readers up and remove it
+ */
+void    ring_close(void);
+
+void    ring_tag_inserted(int slot, const nfc_target *pnt, int verdict);
+void    ring_tag_removed(int slot);
+void    ring_tag_expired(int slot);
+void    ring_tag_verdict(int slot, int verdict);
+void    ring_reader_status(int reader, bool up);
+
+/**
+ * @brief Map the ring @a name for reading, starting with the next record
+ * @return 0 on success, -1 on error
+ */
+int     ring_reader_open(ring_reader *prr, const char *name);
+
+/**
+ * @brief Copy the next record, waiting up to @a timeout ms for one (-1: forever)
+ *
+ * Records lost in between are added to prr->lost.
+ *
+ * @return 1 if @a record was filled, 0 on timeout, -1 if the ring was closed
+ */
+int     ring_read(ring_reader *prr, ring_record *record, int timeout);
+
+void    ring_reader_close(ring_reader *prr);
+
+#endif /* __RING_H__ */
@@ -0,0 +1,550 @@
+/*
+ * NFC Event Daemon
+ * ubus interface
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file rpc.c
+ * @brief ubus object "nfcd"
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <libubus.h>
+
+#include <nfc/nfc.h>
+
+#include "rpc.h"
+#include "state.h"
+#include "nfc-utils.h"
+#include "mifare.h"
+#include "journal.h"
+#include "metrics.h"
+#include "acl.h"
+
+#define RECONNECT_INTERVAL 1000 /* ms */
+
+static struct ubus_context *ctx = NULL;
+static struct blob_buf b;
+static pthread_t rpc_thread_id;
+static bool rpc_running = false;
+static int rpc_stopping = 0;
+
+/* Written by other threads to wake the uloop up */
+static int notify_pipe[2] = { -1, -1 };
+static struct uloop_fd notify_fd;
+static uint64_t notified_seq = 0;
+static unsigned long notified_low = 0;  /* its low bits, for the metrics thread */
+
+static void
+blobmsg_add_hex(struct blob_buf *buf, const char *name, const uint8_t *data, size_t len)
+{
+  char    hex[2 * NFCD_SECTOR_DATA + 1];
+  size_t  i;
+
+  if (len > NFCD_SECTOR_DATA)
+    len = NFCD_SECTOR_DATA;
+  for (i = 0; i < len; i++)
+    sprintf(hex + 2 * i, "%02x", data[i]);
+  hex[2 * len] = '\0';
+  blobmsg_add_string(buf, name, hex);
+}
+
+static void
+add_reader_state(struct blob_buf *buf, const char *name, int slot, const nfcd_reader_state *s)
+{
+  void   *t = blobmsg_open_table(buf, name);
+  char    hash[17];
+
+  blobmsg_add_u32(buf, "reader", NFCD_SLOT_READER(slot));
+  blobmsg_add_u32(buf, "card", NFCD_SLOT_CARD(slot));
+  blobmsg_add_bool(buf, "present", s->present);
+  if (s->present) {
+    blobmsg_add_string(buf, "type", str_nfc_modulation_type(s->nm.nmt));
+    blobmsg_add_hex(buf, "uid", s->abtUid, s->szUidLen);
+    blobmsg_add_hex(buf, "atqa", s->abtAtqa, 2);
+    blobmsg_add_hex(buf, "sak", &s->btSak, 1);
+    blobmsg_add_u64(buf, "inserted", (uint64_t) s->inserted);
+    if (s->image_hash) {
+      snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) s->image_hash);
+      blobmsg_add_string(buf, "image_hash", hash);
+      blobmsg_add_bool(buf, "image_complete", s->image_complete);
+    }
+    if (s->verdict != ACL_NONE)
+      blobmsg_add_string(buf, "verdict", acl_verdict_name(s->verdict));
+  }
+  blobmsg_add_u64(buf, "seq", s->seq);
+  blobmsg_close_table(buf, t);
+}
+
+static void
+add_snapshot(struct blob_buf *buf, int only_reader)
+{
+  nfcd_reader_state states[NFCD_MAX_SLOTS];
+  uint64_t seq = state_snapshot(states);
+  void   *a;
+  int     i;
+
+  blobmsg_add_u64(buf, "seq", seq);
+  a = blobmsg_open_array(buf, "readers");
+  for (i = 0; i < NFCD_MAX_SLOTS; i++) {
+    if ((only_reader >= 0) && (NFCD_SLOT_READER(i) != only_reader))
+      continue;
+    // The first slot of a reader is always listed, the others while in use
+    if ((NFCD_SLOT_CARD(i) != 0) && !states[i].present)
+      continue;
+    add_reader_state(buf, NULL, i, &states[i]);
+  }
+  blobmsg_close_array(buf, a);
+}
+
+static uint64_t
+blobmsg_get_seq(struct blob_attr *attr)
+{
+  switch (blobmsg_type(attr)) {
+    case BLOBMSG_TYPE_INT64:
+      return blobmsg_get_u64(attr);
+    case BLOBMSG_TYPE_INT32:
+      return blobmsg_get_u32(attr);
+    default:
+      return 0;
+  }
+}
+
+enum {
+  STATE_READER,
+  __STATE_MAX
+};
+
+static const struct blobmsg_policy state_policy[__STATE_MAX] = {
+  [STATE_READER] = { .name = "reader", .type = BLOBMSG_TYPE_INT32 },
+};
+
+static int
+rpc_state(struct ubus_context *uctx, struct ubus_object *obj,
+          struct ubus_request_data *req, const char *method,
+          struct blob_attr *msg)
+{
+  struct blob_attr *tb[__STATE_MAX];
+  int     reader = -1;
+
+  blobmsg_parse(state_policy, __STATE_MAX, tb, blob_data(msg), blob_len(msg));
+  if (tb[STATE_READER]) {
+    reader = blobmsg_get_u32(tb[STATE_READER]);
+    if ((reader < 0) || (reader >= NFCD_MAX_READERS))
+      return UBUS_STATUS_INVALID_ARGUMENT;
+  }
+
+  blob_buf_init(&b, 0);
+  add_snapshot(&b, reader);
+  ubus_send_reply(uctx, req, b.head);
+  return UBUS_STATUS_OK;
+}
+
+enum {
+  DELTAS_SINCE,
+  __DELTAS_MAX
+};
+
+static const struct blobmsg_policy deltas_policy[__DELTAS_MAX] = {
+  [DELTAS_SINCE] = { .name = "since", .type = BLOBMSG_TYPE_UNSPEC },
+};
+
+static void
+add_delta(struct blob_buf *buf, const char *name, const nfcd_state_delta *d)
+{
+  void   *t = name ? blobmsg_open_table(buf, name) : NULL;
+
+  blobmsg_add_u64(buf, "seq", d->seq);
+  blobmsg_add_string(buf, "event", state_change_name(d->change));
+  add_reader_state(buf, "state", d->slot, &d->state);
+  if (d->change == STATE_TAG_SECTOR) {
+    void   *s = blobmsg_open_table(buf, "sector");
+
+    blobmsg_add_u32(buf, "number", d->sector.number);
+    blobmsg_add_string(buf, "status", mifare_classic_sector_status_name(d->sector.status));
+    blobmsg_add_hex(buf, "data", d->sector.abtData, d->sector.szData);
+    blobmsg_close_table(buf, s);
+  }
+  if (t)
+    blobmsg_close_table(buf, t);
+}
+
+static int
+rpc_deltas(struct ubus_context *uctx, struct ubus_object *obj,
+           struct ubus_request_data *req, const char *method,
+           struct blob_attr *msg)
+{
+  struct blob_attr *tb[__DELTAS_MAX];
+  nfcd_state_delta deltas[32];
+  uint64_t since;
+  int     n;
+  void   *a;
+
+  blobmsg_parse(deltas_policy, __DELTAS_MAX, tb, blob_data(msg), blob_len(msg));
+  if (!tb[DELTAS_SINCE])
+    return UBUS_STATUS_INVALID_ARGUMENT;
+  since = blobmsg_get_seq(tb[DELTAS_SINCE]);
+
+  blob_buf_init(&b, 0);
+  if ((n = state_deltas(since, deltas, sizeof(deltas) / sizeof(deltas[0]))) < 0) {
+    blobmsg_add_bool(&b, "resync", true);
+    add_snapshot(&b, -1);
+  } else {
+    blobmsg_add_bool(&b, "resync", false);
+    a = blobmsg_open_array(&b, "deltas");
+    while (n > 0) {
+      int     i;
+
+      for (i = 0; i < n; i++)
+        add_delta(&b, NULL, &deltas[i]);
+      since = deltas[n - 1].seq;
+      n = state_deltas(since, deltas, sizeof(deltas) / sizeof(deltas[0]));
+    }
+    blobmsg_close_array(&b, a);
+    blobmsg_add_u64(&b, "seq", since);
+  }
+  ubus_send_reply(uctx, req, b.head);
+  return UBUS_STATUS_OK;
+}
+
+enum {
+  JOURNAL_SINCE,
+  JOURNAL_MAX,
+  __JOURNAL_MAX
+};
+
+static const struct blobmsg_policy journal_policy[__JOURNAL_MAX] = {
+  [JOURNAL_SINCE] = { .name = "since", .type = BLOBMSG_TYPE_UNSPEC },
+  [JOURNAL_MAX]   = { .name = "max", .type = BLOBMSG_TYPE_INT32 },
+};
+
+#define JOURNAL_MAX_RECORDS 128
+
+static void
+add_journal_record(struct blob_buf *buf, const journal_record *jr)
+{
+  void   *t = blobmsg_open_table(buf, NULL);
+  char    hash[17];
+
+  blobmsg_add_u64(buf, "seq", jr->seq);
+  blobmsg_add_u64(buf, "time", (uint64_t) jr->time);
+  blobmsg_add_u32(buf, "reader", NFCD_SLOT_READER(jr->slot));
+  blobmsg_add_u32(buf, "card", NFCD_SLOT_CARD(jr->slot));
+  blobmsg_add_string(buf, "event", journal_record_type_name(jr->type));
+  if ((jr->type == JOURNAL_TAG_INSERTED) && (jr->len >= sizeof(journal_tag))) {
+    journal_tag jt;
+
+    memcpy(&jt, jr->payload, sizeof(jt));
+    blobmsg_add_string(buf, "type", str_nfc_modulation_type(jt.nmt));
+    blobmsg_add_hex(buf, "uid", jt.abtUid, (jt.szUidLen <= sizeof(jt.abtUid)) ? jt.szUidLen : sizeof(jt.abtUid));
+    blobmsg_add_hex(buf, "atqa", jt.abtAtqa, 2);
+    blobmsg_add_hex(buf, "sak", &jt.btSak, 1);
+  } else if ((jr->type == JOURNAL_TAG_IMAGE) && (jr->len >= sizeof(journal_image))) {
+    journal_image ji;
+
+    memcpy(&ji, jr->payload, sizeof(ji));
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) ji.hash);
+    blobmsg_add_string(buf, "image_hash", hash);
+    blobmsg_add_bool(buf, "image_complete", ji.complete);
+    blobmsg_add_string(buf, "image_format", journal_image_format_name(ji.format));
+    blobmsg_add_u32(buf, "image_size", ji.size);
+    if (ji.szUidLen)
+      blobmsg_add_hex(buf, "uid", ji.abtUid, (ji.szUidLen <= sizeof(ji.abtUid)) ? ji.szUidLen : sizeof(ji.abtUid));
+  } else if ((jr->type == JOURNAL_TAG_VERDICT) && (jr->len >= sizeof(journal_verdict))) {
+    journal_verdict jv;
+
+    memcpy(&jv, jr->payload, sizeof(jv));
+    blobmsg_add_string(buf, "verdict", acl_verdict_name(jv.verdict));
+  }
+  blobmsg_close_table(buf, t);
+}
+
+static int
+rpc_journal(struct ubus_context *uctx, struct ubus_object *obj,
+            struct ubus_request_data *req, const char *method,
+            struct blob_attr *msg)
+{
+  struct blob_attr *tb[__JOURNAL_MAX];
+  char    dir[PATH_MAX];
+  journal_cursor jc;
+  journal_record jr;
+  uint64_t since = 0;
+  int     max = 32;
+  int     n = 0;
+  bool    gap = false;
+  void   *a;
+
+  blobmsg_parse(journal_policy, __JOURNAL_MAX, tb, blob_data(msg), blob_len(msg));
+  if (tb[JOURNAL_SINCE])
+    since = blobmsg_get_seq(tb[JOURNAL_SINCE]);
+  if (tb[JOURNAL_MAX])
+    max = blobmsg_get_u32(tb[JOURNAL_MAX]);
+  if ((max <= 0) || (max > JOURNAL_MAX_RECORDS))
+    return UBUS_STATUS_INVALID_ARGUMENT;
+  if (!journal_get_dir(dir, sizeof(dir)))
+    return UBUS_STATUS_NOT_FOUND;
+  if (journal_cursor_open(&jc, dir, since + 1) < 0)
+    return UBUS_STATUS_UNKNOWN_ERROR;
+
+  blob_buf_init(&b, 0);
+  a = blobmsg_open_array(&b, "records");
+  while ((n < max) && (journal_cursor_next(&jc, &jr) > 0)) {
+    // Records in between were rotated out
+    if ((n == 0) && (jr.seq > since + 1))
+      gap = true;
+    add_journal_record(&b, &jr);
+    since = jr.seq;
+    n++;
+  }
+  blobmsg_close_array(&b, a);
+  blobmsg_add_bool(&b, "gap", gap);
+  blobmsg_add_u64(&b, "seq", since);
+  blobmsg_add_bool(&b, "more", (n == max) && (journal_cursor_next(&jc, &jr) > 0));
+  journal_cursor_close(&jc);
+  ubus_send_reply(uctx, req, b.head);
+  return UBUS_STATUS_OK;
+}
+
+enum {
+  IMAGE_SEQ,
+  __IMAGE_MAX
+};
+
+static const struct blobmsg_policy image_policy[__IMAGE_MAX] = {
+  [IMAGE_SEQ] = { .name = "seq", .type = BLOBMSG_TYPE_UNSPEC },
+};
+
+static int
+rpc_image(struct ubus_context *uctx, struct ubus_object *obj,
+          struct ubus_request_data *req, const char *method,
+          struct blob_attr *msg)
+{
+  struct blob_attr *tb[__IMAGE_MAX];
+  uint8_t image[JOURNAL_IMAGE_MAX];
+  char    dir[PATH_MAX];
+  char    hash[17];
+  journal_image ji;
+  uint64_t seq;
+  int     len, off;
+  void   *a;
+
+  blobmsg_parse(image_policy, __IMAGE_MAX, tb, blob_data(msg), blob_len(msg));
+  if (!tb[IMAGE_SEQ] || ((seq = blobmsg_get_seq(tb[IMAGE_SEQ])) == 0))
+    return UBUS_STATUS_INVALID_ARGUMENT;
+  if (!journal_get_dir(dir, sizeof(dir)))
+    return UBUS_STATUS_NOT_FOUND;
+  if ((len = journal_image_read(dir, seq, &ji, image, sizeof(image))) < 0)
+    return UBUS_STATUS_UNKNOWN_ERROR;
+  if (len == 0)
+    return UBUS_STATUS_NOT_FOUND;
+
+  blob_buf_init(&b, 0);
+  blobmsg_add_u64(&b, "seq", seq);
+  if (ji.szUidLen)
+    blobmsg_add_hex(&b, "uid", ji.abtUid, (ji.szUidLen <= sizeof(ji.abtUid)) ? ji.szUidLen : sizeof(ji.abtUid));
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) ji.hash);
+  blobmsg_add_string(&b, "image_hash", hash);
+  blobmsg_add_bool(&b, "image_complete", ji.complete);
+  a = blobmsg_open_array(&b, "blocks");
+  for (off = 0; off < len; off += JOURNAL_IMAGE_BLOCK)
+    blobmsg_add_hex(&b, NULL, image + off, (len - off < JOURNAL_IMAGE_BLOCK) ? len - off : JOURNAL_IMAGE_BLOCK);
+  blobmsg_close_array(&b, a);
+  ubus_send_reply(uctx, req, b.head);
+  return UBUS_STATUS_OK;
+}
+
+static const struct ubus_method nfcd_methods[] = {
+  UBUS_METHOD("state", rpc_state, state_policy),
+  UBUS_METHOD("deltas", rpc_deltas, deltas_policy),
+  UBUS_METHOD("journal", rpc_journal, journal_policy),
+  UBUS_METHOD("image", rpc_image, image_policy),
+};
+
+static struct ubus_object_type nfcd_object_type = UBUS_OBJECT_TYPE("nfcd", nfcd_methods);
+
+static struct ubus_object nfcd_object = {
+  .name = "nfcd",
+  .type = &nfcd_object_type,
+  .methods = nfcd_methods,
+  .n_methods = ARRAY_SIZE(nfcd_methods),
+};
+
+static void
+set_notified(uint64_t seq)
+{
+  notified_seq = seq;
+  __atomic_store_n(&notified_low, (unsigned long) seq, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief State changes not broadcast yet, called from the metrics thread
+ */
+static long
+rpc_backlog(void)
+{
+  nfcd_reader_state states[NFCD_MAX_SLOTS];
+
+  return (long)((unsigned long) state_snapshot(states) - __atomic_load_n(&notified_low, __ATOMIC_RELAXED));
+}
+
+static void
+rpc_broadcast_deltas(void)
+{
+  nfcd_state_delta deltas[32];
+  int     n, i;
+
+  while ((n = state_deltas(notified_seq, deltas, sizeof(deltas) / sizeof(deltas[0]))) != 0) {
+    if (n < 0) {
+      // We fell behind the history, subscribers must resynchronise
+      nfcd_reader_state states[NFCD_MAX_SLOTS];
+      uint64_t seq = state_snapshot(states);
+
+      metrics_add(METRIC_DROPPED_UBUS, seq - notified_seq);
+      set_notified(seq);
+      blob_buf_init(&b, 0);
+      blobmsg_add_u64(&b, "seq", notified_seq);
+      ubus_notify(ctx, &nfcd_object, "resync", b.head, -1);
+      continue;
+    }
+    for (i = 0; i < n; i++) {
+      blob_buf_init(&b, 0);
+      add_delta(&b, NULL, &deltas[i]);
+      ubus_notify(ctx, &nfcd_object, (deltas[i].change == STATE_TAG_SECTOR) ? "sector" : "tag", b.head, -1);
+      set_notified(deltas[i].seq);
+    }
+  }
+}
+
+static void
+rpc_notify_cb(struct uloop_fd *u, unsigned int events)
+{
+  char    buf[64];
+
+  while (read(u->fd, buf, sizeof(buf)) > 0)
+    ;
+  if (__atomic_load_n(&rpc_stopping, __ATOMIC_ACQUIRE)) {
+    uloop_end();
+    return;
+  }
+  rpc_broadcast_deltas();
+}
+
+static void
+rpc_wakeup(void)
+{
+  const char c = 0;
+
+  if (write(notify_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+    ERR("Unable to wake up ubus thread: %s", strerror(errno));
+}
+
+static void
+rpc_connection_lost(struct ubus_context *uctx)
+{
+  uloop_end();
+}
+
+static void *
+rpc_thread(void *arg)
+{
+  (void) arg;
+
+  uloop_init();
+  notify_fd.fd = notify_pipe[0];
+  notify_fd.cb = rpc_notify_cb;
+
+  while (!__atomic_load_n(&rpc_stopping, __ATOMIC_ACQUIRE)) {
+    if ((ctx = ubus_connect(NULL)) == NULL) {
+      // ubusd not (yet) running; rpc_stop() interrupts the wait
+      struct pollfd pfd = { .fd = notify_pipe[0], .events = POLLIN };
+
+      poll(&pfd, 1, RECONNECT_INTERVAL);
+      continue;
+    }
+    ctx->connection_lost = rpc_connection_lost;
+    ubus_add_uloop(ctx);
+    if (ubus_add_object(ctx, &nfcd_object) != 0) {
+      ERR("%s", "Unable to publish ubus object");
+      ubus_free(ctx);
+      ctx = NULL;
+      break;
+    }
+    DBG("%s", "Connected to ubus");
+
+    // Do not replay history to a fresh bus connection
+    {
+      nfcd_reader_state states[NFCD_MAX_SLOTS];
+      set_notified(state_snapshot(states));
+    }
+    uloop_fd_add(&notify_fd, ULOOP_READ);
+    uloop_run();
+    uloop_fd_delete(&notify_fd);
+
+    ubus_free(ctx);
+    ctx = NULL;
+  }
+
+  uloop_done();
+  blob_buf_free(&b);
+  return NULL;
+}
+
+int
+rpc_init(void)
+{
+  int     res;
+
+  if (pipe2(notify_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    ERR("pipe: %s", strerror(errno));
+    return -1;
+  }
+  state_set_listener(rpc_wakeup);
+  if ((res = pthread_create(&rpc_thread_id, NULL, rpc_thread, NULL)) != 0) {
+    ERR("pthread_create: %s", strerror(res));
+    state_set_listener(NULL);
+    return -1;
+  }
+  rpc_running = true;
+  metrics_set_gauge(METRIC_UBUS_BACKLOG, rpc_backlog);
+  return 0;
+}
+
+void
+rpc_stop(void)
+{
+  if (!rpc_running)
+    return;
+  state_set_listener(NULL);
+  metrics_set_gauge(METRIC_UBUS_BACKLOG, NULL);
+  __atomic_store_n(&rpc_stopping, 1, __ATOMIC_RELEASE);
+  rpc_wakeup();
+  pthread_join(rpc_thread_id, NULL);
+  rpc_running = false;
+}
@@ -0,0 +1,48 @@
+/*
+ * NFC Event Daemon
+ * ubus interface
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file rpc.h
+ * @brief ubus object "nfcd"
+ *
+ * Methods:
+ *   state  { "reader": n }   current state of one or all readers, one entry
+ *                            per card in the field ("card" numbers them)
+ *   deltas { "since": seq }  changes after seq, or a full snapshot with
+ *                            "resync": true when seq is too old
+ *   journal { "since": seq, "max": n }  journal records after seq
+ *   image  { "seq": seq }    card image held by a journal record
+ *
+ * With an access list loaded, the state of a card carries its "verdict":
+ * allow, deny, or pending until the sectors it depends on are read.
+ *
+ * Every state change is also broadcast as a "tag" notification carrying its
+ * sequence number, so a subscriber can detect gaps and call "deltas".
+ *
+ * ubus runs its own uloop in a dedicated thread; the poll loop never blocks
+ * on it.
+ */
+
+#ifndef __RPC_H__
+#define __RPC_H__
+
+int     rpc_init(void);
+void    rpc_stop(void);
+
+#endif /* __RPC_H__ */
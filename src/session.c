@@ -0,0 +1,78 @@
+/*
+ * NFC Event Daemon
+ * Card engine sessions
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file session.c
+ * @brief Everything the card engine keeps about one reader
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "session.h"
+#include "capture.h"
+
+void
+nfcd_session_init(nfcd_session *ps, void *pvUser)
+{
+  memset(ps, 0, sizeof(*ps));
+  ps->pvUser = pvUser;
+  mifare_classic_load_keys(ps, NULL);
+}
+
+void
+nfcd_session_free(nfcd_session *ps)
+{
+  nfcd_device_close(&ps->dev);
+  // Back to the built-in dictionary, which frees one loaded from a file
+  mifare_classic_load_keys(ps, NULL);
+  ps->pfnAbort = NULL;
+  ps->pfnKeyProvider = NULL;
+  ps->pfnPollWatch = NULL;
+}
+
+void
+nfcd_session_set_poll_watch(nfcd_session *ps, void (*watch)(void *pvUser, nfc_device *pnd, bool bWatch))
+{
+  ps->pfnPollWatch = watch;
+}
+
+int
+nfcd_session_poll(nfcd_session *ps, const nfc_modulation *pnmModulations, const size_t szModulations,
+                  const uint8_t uiPollNr, const uint8_t uiPeriod, nfc_target *pnt)
+{
+  const bool bWatch = ps->pfnPollWatch && !replay_active(ps->dev.pCapture);
+  int     res;
+
+  // A stop may abort the poll, and nothing else; one requested just before is not missed
+  if (bWatch)
+    ps->pfnPollWatch(ps->pvUser, ps->dev.pnd, true);
+  if (ps->pfnAbort && ps->pfnAbort(ps->pvUser))
+    res = NFC_EOPABORTED;
+  else
+    res = nfcd_device_poll(ps->dev.pnd, pnmModulations, szModulations, uiPollNr, uiPeriod, pnt);
+  if (bWatch)
+    ps->pfnPollWatch(ps->pvUser, ps->dev.pnd, false);
+  return res;
+}
@@ -0,0 +1,106 @@
+/*
+ * NFC Event Daemon
+ * Card engine sessions
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file session.h
+ * @brief Everything the card engine keeps about one reader
+ *
+ * The card engine (libnfcd) is the code that talks to cards: the device
+ * layer, MIFARE Classic and Ultralight reads, value operations, ISO14443-4
+ * and NDEF decoding.  What it keeps between calls about a reader belongs
+ * to an nfcd_session, one per reader, so several readers can be driven from
+ * as many threads: the key dictionary, the key provider, the abort and poll
+ * hooks, the card sizes learnt, the receive buffer, and the capture or
+ * replay of its device (capture.h).
+ *
+ * What stays process wide is shared on purpose and safe to share: the
+ * device table (locked), trace and metrics (per thread shards), the learnt
+ * timeouts of latency.h (per thread).  Signals and the master key of kdf.h
+ * are the daemon's: a caller stops the engine through the hooks of its
+ * sessions, and hands it derived keys through their key provider.
+ *
+ * A session is only used by one thread at a time.
+ */
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "device.h"
+#include "mifare.h"
+
+#define NFCD_SESSION_MAX_FRAME 264
+#define NFCD_SESSION_SIZE_CACHE 64
+
+/* Size of a card found by RATS, so a card pays for the field cycle once and not at every tap */
+typedef struct {
+  uint8_t  abtUid[10];
+  size_t   szUidLen;
+  uint8_t  uiBlocks;
+} nfcd_size_cache_entry;
+
+struct nfcd_session {
+  nfcd_device dev;
+  const uint8_t *pbtKeys;           /* dictionary, 6 bytes per key */
+  size_t   szKeys;
+  bool   (*pfnAbort)(void *pvUser); /* polled at every sector boundary, and before each poll */
+  bool   (*pfnKeyProvider)(void *pvUser, const uint8_t *pbtUid, size_t szUidLen, uint8_t ui8Sector,
+                           mifare_cmd mc, uint8_t abtKey[6]);
+  void   (*pfnPollWatch)(void *pvUser, nfc_device *pnd, bool bWatch); /* as the device enters and leaves a poll */
+  void    *pvUser;                  /* handed to all three */
+  nfcd_size_cache_entry asc[NFCD_SESSION_SIZE_CACHE];
+  size_t   szSizeCacheUsed;
+  size_t   szSizeCacheNext;         /* oldest entry, replaced next once full */
+  bool     bFieldShared;            /* other cards in the field: no RATS, its field cycle resets them */
+  uint8_t  abtRx[NFCD_SESSION_MAX_FRAME];
+};
+
+typedef struct nfcd_session nfcd_session;
+
+/**
+ * @brief Start a session with the built-in key dictionary, no device opened yet
+ * @param pvUser Handed to the abort predicate and the key provider
+ */
+void    nfcd_session_init(nfcd_session *ps, void *pvUser);
+
+/**
+ * @brief Close the device and release what the session holds
+ */
+void    nfcd_session_free(nfcd_session *ps);
+
+/**
+ * @brief Install the function told when the device enters a blocking poll, and when it leaves it
+ *
+ * Another thread may abort the poll with nfc_abort_command() in between, and
+ * nothing else the device sends.  It is not called while replaying, the
+ * device is then no libnfc device.
+ */
+void    nfcd_session_set_poll_watch(nfcd_session *ps, void (*watch)(void *pvUser, nfc_device *pnd, bool bWatch));
+
+/**
+ * @brief nfcd_device_poll() on the device of the session, watched as set above
+ * @return NFC_EOPABORTED without polling when the abort predicate already holds
+ */
+int     nfcd_session_poll(nfcd_session *ps, const nfc_modulation *pnmModulations, const size_t szModulations,
+                          const uint8_t uiPollNr, const uint8_t uiPeriod, nfc_target *pnt);
+
+#endif /* __SESSION_H__ */
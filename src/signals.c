@@ -0,0 +1,255 @@
+/*
+ * NFC Event Daemon
+ * Signal handling
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file signals.c
+ * @brief Signal handling outside of signal context
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+
+#include "signals.h"
+#include "nfc-utils.h"
+#include "debug.h"
+
+#define MAX_WATCHED_DEVICES 8
+#define DEF_SHUTDOWN_TIMEOUT 500  /* ms */
+
+static int stop_flag = 0;
+static int reload_flag = 0;
+static int shutdown_timeout = DEF_SHUTDOWN_TIMEOUT;
+static void (*dump_handler)(void) = NULL;
+
+static int signal_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static nfc_device *watched[MAX_WATCHED_DEVICES];
+
+static void
+abort_watched_devices(void)
+{
+  size_t  i;
+
+  pthread_mutex_lock(&watch_lock);
+  for (i = 0; i < MAX_WATCHED_DEVICES; i++) {
+    if (watched[i] != NULL)
+      nfc_abort_command(watched[i]);
+  }
+  pthread_mutex_unlock(&watch_lock);
+}
+
+static void
+wake_sleepers(void)
+{
+  const char c = 0;
+
+  if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+    ERR("Unable to wake up main loop: %s", strerror(errno));
+}
+
+static void *
+signal_thread(void *arg)
+{
+  struct timespec deadline = { 0, 0 };
+  (void) arg;
+
+  for (;;) {
+    struct pollfd pfd = { .fd = signal_fd, .events = POLLIN };
+    struct signalfd_siginfo si;
+    int     timeout = -1;
+
+    if (__atomic_load_n(&stop_flag, __ATOMIC_ACQUIRE)) {
+      struct timespec now;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timeout = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+      if (timeout <= 0) {
+        ERR("Shutdown did not complete within %d ms, exiting", shutdown_timeout);
+        _exit(EXIT_FAILURE);
+      }
+    }
+
+    if (poll(&pfd, 1, timeout) <= 0)
+      continue;
+    if (read(signal_fd, &si, sizeof(si)) != sizeof(si))
+      continue;
+
+    switch (si.ssi_signo) {
+      case SIGINT:
+      case SIGTERM:
+        if (__atomic_exchange_n(&stop_flag, 1, __ATOMIC_ACQ_REL)) {
+          ERR("%s", "Second stop request, exiting now");
+          _exit(EXIT_FAILURE);
+        }
+        DBG("Stop polling... (sig:%d)", si.ssi_signo);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += shutdown_timeout / 1000;
+        deadline.tv_nsec += (shutdown_timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+        break;
+      case SIGHUP:
+        DBG("Reload requested... (sig:%d)", si.ssi_signo);
+        __atomic_store_n(&reload_flag, 1, __ATOMIC_RELEASE);
+        // Picked up between two polls: a poll in progress is left to end
+        wake_sleepers();
+        continue;
+      case SIGUSR1:
+        {
+          void (*handler)(void) = __atomic_load_n(&dump_handler, __ATOMIC_ACQUIRE);
+
+          if (handler)
+            handler();
+        }
+        // Nothing to interrupt
+        continue;
+      default:
+        continue;
+    }
+    // Only a blocking poll is cut short, a card command always completes
+    abort_watched_devices();
+    wake_sleepers();
+  }
+  return NULL;
+}
+
+int
+signals_init(void)
+{
+  sigset_t mask;
+  pthread_t thread;
+  int     res;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  if ((res = pthread_sigmask(SIG_BLOCK, &mask, NULL)) != 0) {
+    ERR("pthread_sigmask: %s", strerror(res));
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if ((signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+    ERR("signalfd: %s", strerror(errno));
+    return -1;
+  }
+  if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    ERR("pipe: %s", strerror(errno));
+    return -1;
+  }
+  if ((res = pthread_create(&thread, NULL, signal_thread, NULL)) != 0) {
+    ERR("pthread_create: %s", strerror(res));
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void
+signals_set_dump_handler(void (*handler)(void))
+{
+  __atomic_store_n(&dump_handler, handler, __ATOMIC_RELEASE);
+}
+
+void
+signals_set_shutdown_timeout(int ms)
+{
+  shutdown_timeout = ms;
+}
+
+void
+signals_watch_device(nfc_device *pnd)
+{
+  size_t  i;
+
+  pthread_mutex_lock(&watch_lock);
+  for (i = 0; i < MAX_WATCHED_DEVICES; i++) {
+    if (watched[i] == NULL) {
+      watched[i] = pnd;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&watch_lock);
+}
+
+void
+signals_unwatch_device(nfc_device *pnd)
+{
+  size_t  i;
+
+  pthread_mutex_lock(&watch_lock);
+  for (i = 0; i < MAX_WATCHED_DEVICES; i++) {
+    if (watched[i] == pnd)
+      watched[i] = NULL;
+  }
+  pthread_mutex_unlock(&watch_lock);
+}
+
+bool
+signals_stop_requested(void)
+{
+  return __atomic_load_n(&stop_flag, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool
+signals_reload_requested(void)
+{
+  return __atomic_exchange_n(&reload_flag, 0, __ATOMIC_ACQ_REL) != 0;
+}
+
+bool
+signals_reload_pending(void)
+{
+  return __atomic_load_n(&reload_flag, __ATOMIC_ACQUIRE) != 0;
+}
+
+void
+signals_sleep(int ms)
+{
+  struct pollfd pfd = { .fd = wake_pipe[0], .events = POLLIN };
+  char    buf[16];
+
+  if (signals_stop_requested() || __atomic_load_n(&reload_flag, __ATOMIC_ACQUIRE))
+    return;
+  if (poll(&pfd, 1, ms) > 0) {
+    while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+      ;
+  }
+}
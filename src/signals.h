@@ -0,0 +1,87 @@
+/*
+ * NFC Event Daemon
+ * Signal handling
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file signals.h
+ * @brief Signal handling outside of signal context
+ *
+ * SIGINT, SIGTERM, SIGHUP and SIGUSR1 are blocked in every thread and consumed
+ * from a signalfd by a dedicated thread.  That thread only sets atomic flags, aborts
+ * the polls in progress and wakes up sleepers, so nothing is ever run from an
+ * asynchronous signal handler.
+ *
+ * A stop only aborts a device while it waits in a poll: a card command, a
+ * sector read or a value operation between its operation and its transfer,
+ * always completes, and reads stop at the next sector boundary through their
+ * abort predicate.  A reload aborts nothing, it is handled between two polls.
+ *
+ * Once a stop is requested the process is given a bounded amount of time to
+ * exit cleanly, after which it is terminated.
+ */
+
+#ifndef __SIGNALS_H__
+#define __SIGNALS_H__
+
+#include <stdbool.h>
+
+#include <nfc/nfc.h>
+
+/**
+ * @brief Block the handled signals and start the signal thread
+ * @note Must be called before any other thread is created so they inherit the mask.
+ */
+int     signals_init(void);
+
+/**
+ * @brief Time granted between a stop request and forced termination
+ */
+void    signals_set_shutdown_timeout(int ms);
+
+/**
+ * @brief Function run from the signal thread on SIGUSR1
+ */
+void    signals_set_dump_handler(void (*handler)(void));
+
+/**
+ * @brief Register a device entering a blocking poll, which a stop aborts
+ *
+ * Unregistered as soon as the poll returns, so nothing else it sends is ever
+ * aborted.
+ */
+void    signals_watch_device(nfc_device *pnd);
+void    signals_unwatch_device(nfc_device *pnd);
+
+bool    signals_stop_requested(void);
+
+/**
+ * @brief Returns true once per SIGHUP received
+ */
+bool    signals_reload_requested(void);
+
+/**
+ * @brief Whether a SIGHUP is waiting to be handled, without consuming it
+ */
+bool    signals_reload_pending(void);
+
+/**
+ * @brief Sleep for @a ms, returning early on stop or reload request
+ */
+void    signals_sleep(int ms);
+
+#endif /* __SIGNALS_H__ */
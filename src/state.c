@@ -0,0 +1,245 @@
+/*
+ * NFC Event Daemon
+ * Current tag state per slot
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file state.c
+ * @brief Current tag state per slot, with numbered deltas
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <string.h>
+#include <pthread.h>
+
+#include "state.h"
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static nfcd_reader_state slots[NFCD_MAX_SLOTS];
+static nfcd_state_delta history[NFCD_STATE_HISTORY];
+static uint64_t last_seq = 0;
+static void (*state_listener)(void) = NULL;
+
+static const char *change_names[] = {
+  [STATE_TAG_INSERTED] = "inserted",
+  [STATE_TAG_REMOVED]  = "removed",
+  [STATE_TAG_IMAGE]    = "image",
+  [STATE_TAG_SECTOR]   = "sector",
+  [STATE_TAG_VERDICT]  = "verdict",
+  [STATE_READER_DOWN]  = "reader_down",
+  [STATE_READER_UP]    = "reader_up",
+};
+
+/* Must be called with state_lock held */
+static nfcd_state_delta *
+state_commit(int slot, nfcd_state_change change)
+{
+  nfcd_state_delta *d;
+
+  slots[slot].seq = ++last_seq;
+  d = &history[last_seq % NFCD_STATE_HISTORY];
+  d->seq = last_seq;
+  d->slot = slot;
+  d->change = change;
+  d->state = slots[slot];
+  d->sector.szData = 0;
+  return d;
+}
+
+static void
+state_notify(void)
+{
+  void (*listener)(void) = __atomic_load_n(&state_listener, __ATOMIC_ACQUIRE);
+
+  if (listener)
+    listener();
+}
+
+void
+state_tag_inserted(int slot, const nfc_target *pnt, int verdict)
+{
+  nfcd_reader_state *r;
+
+  if ((slot < 0) || (slot >= NFCD_MAX_SLOTS))
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  r = &slots[slot];
+  memset(r, 0, sizeof(*r));
+  r->present = true;
+  r->nm = pnt->nm;
+  r->inserted = time(NULL);
+  if (pnt->nm.nmt == NMT_ISO14443A) {
+    r->szUidLen = pnt->nti.nai.szUidLen;
+    memcpy(r->abtUid, pnt->nti.nai.abtUid, r->szUidLen);
+    memcpy(r->abtAtqa, pnt->nti.nai.abtAtqa, 2);
+    r->btSak = pnt->nti.nai.btSak;
+  }
+  r->verdict = verdict;
+  state_commit(slot, STATE_TAG_INSERTED);
+  pthread_mutex_unlock(&state_lock);
+  state_notify();
+}
+
+void
+state_tag_removed(int slot)
+{
+  if ((slot < 0) || (slot >= NFCD_MAX_SLOTS))
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  memset(&slots[slot], 0, sizeof(slots[slot]));
+  state_commit(slot, STATE_TAG_REMOVED);
+  pthread_mutex_unlock(&state_lock);
+  state_notify();
+}
+
+void
+state_tag_verdict(int slot, int verdict)
+{
+  if ((slot < 0) || (slot >= NFCD_MAX_SLOTS))
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  if (slots[slot].present) {
+    slots[slot].verdict = verdict;
+    state_commit(slot, STATE_TAG_VERDICT);
+  }
+  pthread_mutex_unlock(&state_lock);
+  state_notify();
+}
+
+void
+state_reader_status(int reader, bool up)
+{
+  if ((reader < 0) || (reader >= NFCD_MAX_READERS))
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  state_commit(NFCD_SLOT(reader, 0), up ? STATE_READER_UP : STATE_READER_DOWN);
+  pthread_mutex_unlock(&state_lock);
+  state_notify();
+}
+
+uint64_t
+state_image_hash(const void *image, size_t len)
+{
+  const uint8_t *p = image;
+  uint64_t hash = 0xcbf29ce484222325ULL;    /* FNV-1a 64 */
+  size_t  i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void
+state_tag_image(int slot, const void *image, size_t len, bool complete)
+{
+  uint64_t hash;
+
+  if ((slot < 0) || (slot >= NFCD_MAX_SLOTS))
+    return;
+
+  hash = state_image_hash(image, len);
+
+  pthread_mutex_lock(&state_lock);
+  if (!slots[slot].present) {
+    pthread_mutex_unlock(&state_lock);
+    return;
+  }
+  slots[slot].image_hash = hash;
+  slots[slot].image_complete = complete;
+  state_commit(slot, STATE_TAG_IMAGE);
+  pthread_mutex_unlock(&state_lock);
+  state_notify();
+}
+
+void
+state_tag_sector(int slot, const nfcd_sector *sector)
+{
+  if ((slot < 0) || (slot >= NFCD_MAX_SLOTS))
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  if (!slots[slot].present) {
+    pthread_mutex_unlock(&state_lock);
+    return;
+  }
+  state_commit(slot, STATE_TAG_SECTOR)->sector = *sector;
+  pthread_mutex_unlock(&state_lock);
+  state_notify();
+}
+
+uint64_t
+state_get(int slot, nfcd_reader_state *state)
+{
+  uint64_t seq;
+
+  pthread_mutex_lock(&state_lock);
+  *state = slots[slot];
+  seq = last_seq;
+  pthread_mutex_unlock(&state_lock);
+  return seq;
+}
+
+uint64_t
+state_snapshot(nfcd_reader_state states[NFCD_MAX_SLOTS])
+{
+  uint64_t seq;
+
+  pthread_mutex_lock(&state_lock);
+  memcpy(states, slots, sizeof(slots));
+  seq = last_seq;
+  pthread_mutex_unlock(&state_lock);
+  return seq;
+}
+
+int
+state_deltas(uint64_t since, nfcd_state_delta *deltas, size_t max)
+{
+  size_t  n = 0;
+
+  pthread_mutex_lock(&state_lock);
+  if ((since > last_seq) || (last_seq - since > NFCD_STATE_HISTORY)) {
+    pthread_mutex_unlock(&state_lock);
+    return -1;
+  }
+  while ((since + n < last_seq) && (n < max)) {
+    deltas[n] = history[(since + n + 1) % NFCD_STATE_HISTORY];
+    n++;
+  }
+  pthread_mutex_unlock(&state_lock);
+  return n;
+}
+
+void
+state_set_listener(void (*listener)(void))
+{
+  __atomic_store_n(&state_listener, listener, __ATOMIC_RELEASE);
+}
+
+const char *
+state_change_name(nfcd_state_change change)
+{
+  return change_names[change];
+}
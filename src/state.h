@@ -0,0 +1,139 @@
+/*
+ * NFC Event Daemon
+ * Current tag state per reader
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file state.h
+ * @brief Current tag state per reader, with numbered deltas
+ *
+ * The poll loop updates one slot per card in the field of a reader as events
+ * happen: NFCD_MAX_CARDS slots per reader, the first card to arrive taking the
+ * first free one.  Every update
+ * gets the next sequence number and is also appended to a bounded history,
+ * so a consumer that knows the last sequence number it saw can fetch only
+ * what changed, and one that is too far behind can take a full snapshot.
+ */
+
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <nfc/nfc-types.h>
+
+#define NFCD_MAX_READERS 8
+#define NFCD_MAX_CARDS 4          /* cards tracked at once in the field of one reader */
+#define NFCD_MAX_SLOTS (NFCD_MAX_READERS * NFCD_MAX_CARDS)
+#define NFCD_SLOT(reader, card) ((reader) * NFCD_MAX_CARDS + (card))
+#define NFCD_SLOT_READER(slot) ((slot) / NFCD_MAX_CARDS)
+#define NFCD_SLOT_CARD(slot) ((slot) % NFCD_MAX_CARDS)
+#define NFCD_STATE_HISTORY 256
+#define NFCD_SECTOR_DATA 240      /* data blocks of a 16 block sector */
+
+typedef enum {
+  STATE_TAG_INSERTED,
+  STATE_TAG_REMOVED,
+  STATE_TAG_IMAGE,
+  STATE_TAG_SECTOR,
+  STATE_TAG_VERDICT,
+  STATE_READER_DOWN,            /* slot: NFCD_SLOT(reader, 0) */
+  STATE_READER_UP,
+} nfcd_state_change;
+
+typedef struct {
+  bool    present;
+  nfc_modulation nm;
+  uint8_t abtUid[10];
+  size_t  szUidLen;
+  uint8_t abtAtqa[2];
+  uint8_t btSak;
+  time_t  inserted;               /* wall clock time of insertion */
+  uint64_t image_hash;            /* FNV-1a of the last image read, 0 if none */
+  bool    image_complete;         /* false if some sectors could not be read */
+  uint8_t verdict;                /* acl_verdict */
+  uint64_t seq;                   /* sequence number of the last change */
+} nfcd_reader_state;
+
+/* One sector of a card, as soon as it has been read */
+typedef struct {
+  uint8_t number;
+  uint8_t status;                 /* mifare_classic_sector_status */
+  uint8_t abtData[NFCD_SECTOR_DATA]; /* data blocks, the trailer is never published */
+  size_t  szData;
+} nfcd_sector;
+
+typedef struct {
+  uint64_t seq;
+  int     slot;
+  nfcd_state_change change;
+  nfcd_reader_state state;        /* slot state right after the change */
+  nfcd_sector sector;             /* STATE_TAG_SECTOR only */
+} nfcd_state_delta;
+
+void    state_tag_inserted(int slot, const nfc_target *pnt, int verdict);
+void    state_tag_removed(int slot);
+void    state_tag_image(int slot, const void *image, size_t len, bool complete);
+void    state_tag_sector(int slot, const nfcd_sector *sector);
+
+/**
+ * @brief Record the access verdict of a card that was pending
+ */
+void    state_tag_verdict(int slot, int verdict);
+
+/**
+ * @brief Record that a reader stopped answering, or came back
+ *
+ * The cards in its field keep their state until the reader is back and
+ * has looked at them again.
+ */
+void    state_reader_status(int reader, bool up);
+
+/**
+ * @brief Hash identifying an image, as published in image_hash
+ */
+uint64_t state_image_hash(const void *image, size_t len);
+
+/**
+ * @brief Copy the state of one slot
+ * @return The current global sequence number
+ */
+uint64_t state_get(int slot, nfcd_reader_state *state);
+
+/**
+ * @brief Copy the state of all slots atomically
+ * @return The global sequence number the snapshot corresponds to
+ */
+uint64_t state_snapshot(nfcd_reader_state states[NFCD_MAX_SLOTS]);
+
+/**
+ * @brief Copy up to @a max changes with a sequence number greater than @a since
+ * @return The number of deltas copied, or -1 if some of them are no longer
+ * in the history and the caller has to resynchronise with a snapshot
+ */
+int     state_deltas(uint64_t since, nfcd_state_delta *deltas, size_t max);
+
+/**
+ * @brief Register a function called (outside of any lock) after each change
+ */
+void    state_set_listener(void (*listener)(void));
+
+const char *state_change_name(nfcd_state_change change);
+
+#endif /* __STATE_H__ */
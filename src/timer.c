@@ -0,0 +1,219 @@
+/*
+ * NFC Event Daemon
+ * Timer wheel
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file timer.c
+ * @brief Hierarchical timer wheel on the monotonic clock
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define LEVEL_SHIFT(level) (TIMER_SLOT_BITS * (level))
+/* Furthest a timer can be placed from the current tick */
+#define MAX_DELTA (((int64_t) 1 << LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+int64_t
+timer_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+timer_wheel_init(timer_wheel *w)
+{
+  memset(w, 0, sizeof(*w));
+  w->now = timer_now();
+}
+
+void
+timer_init(nfcd_timer *t, void (*fn)(nfcd_timer *timer, void *user), void *user)
+{
+  memset(t, 0, sizeof(*t));
+  t->fn = fn;
+  t->user = user;
+}
+
+bool
+timer_pending(const nfcd_timer *t)
+{
+  return t->pprev != NULL;
+}
+
+static void
+timer_link(nfcd_timer **head, nfcd_timer *t)
+{
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+static void
+timer_unlink(nfcd_timer *t)
+{
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+/**
+ * @brief Put a timer in the slot covering its expiry, at the finest level that reaches it
+ */
+static void
+timer_place(timer_wheel *w, nfcd_timer *t)
+{
+  int64_t key = (t->expires < w->now) ? w->now : t->expires;
+  int     level;
+
+  if (key - w->now > MAX_DELTA)
+    key = w->now + MAX_DELTA;     // carried over on the next cascade
+  for (level = 0; level < TIMER_LEVELS - 1; level++) {
+    if (key - w->now < ((int64_t) 1 << LEVEL_SHIFT(level + 1)))
+      break;
+  }
+  timer_link(&w->slots[level][(key >> LEVEL_SHIFT(level)) & SLOT_MASK], t);
+}
+
+void
+timer_add(timer_wheel *w, nfcd_timer *t, int64_t delay)
+{
+  if (timer_pending(t))
+    timer_cancel(w, t);
+  t->expires = timer_now() + ((delay > 0) ? delay : 0);
+  timer_place(w, t);
+  w->pending++;
+}
+
+void
+timer_cancel(timer_wheel *w, nfcd_timer *t)
+{
+  if (!timer_pending(t))
+    return;
+  timer_unlink(t);
+  w->pending--;
+}
+
+/**
+ * @brief Move the timers of a slot one level down, now that they are close enough
+ */
+static void
+timer_cascade(timer_wheel *w, int level, int index)
+{
+  nfcd_timer *list = w->slots[level][index];
+  nfcd_timer *t;
+
+  w->slots[level][index] = NULL;
+  while ((t = list) != NULL) {
+    list = t->next;
+    t->next = NULL;
+    timer_place(w, t);
+  }
+}
+
+int
+timer_next(const timer_wheel *w)
+{
+  const int64_t now = timer_now();
+  int64_t next = INT64_MAX;
+  int     level, k;
+
+  if (w->pending == 0)
+    return -1;
+
+  // Level 0 holds the next TIMER_SLOTS ms, one per slot
+  for (k = 0; k < TIMER_SLOTS; k++) {
+    if (w->slots[0][(w->now + k) & SLOT_MASK]) {
+      next = w->now + k;
+      break;
+    }
+  }
+  // A coarser slot is due when it is cascaded, at the start of its range
+  for (level = 1; level < TIMER_LEVELS; level++) {
+    const int shift = LEVEL_SHIFT(level);
+    const int64_t base = w->now >> shift;
+    const bool boundary = (w->now & (((int64_t) 1 << shift) - 1)) == 0;
+
+    for (k = boundary ? 0 : 1; k <= TIMER_SLOTS; k++) {
+      if (w->slots[level][(base + k) & SLOT_MASK]) {
+        if (((base + k) << shift) < next)
+          next = (base + k) << shift;
+        break;
+      }
+    }
+  }
+
+  if (next <= now)
+    return 0;
+  return (next - now > INT_MAX) ? INT_MAX : (int)(next - now);
+}
+
+unsigned
+timer_run(timer_wheel *w)
+{
+  const int64_t target = timer_now();
+  unsigned fired = 0;
+
+  if (w->pending == 0) {
+    if (w->now <= target)
+      w->now = target + 1;
+    return 0;
+  }
+
+  while (w->now <= target) {
+    const int index = w->now & SLOT_MASK;
+    nfcd_timer *due = NULL;
+    nfcd_timer *t;
+    int     level;
+
+    for (level = 1; (level < TIMER_LEVELS) && ((w->now & ((1 << LEVEL_SHIFT(level)) - 1)) == 0); level++)
+      timer_cascade(w, level, (w->now >> LEVEL_SHIFT(level)) & SLOT_MASK);
+
+    // Detach the slot first: a callback may add or cancel timers, this one included
+    if (w->slots[0][index]) {
+      due = w->slots[0][index];
+      w->slots[0][index] = NULL;
+      due->pprev = &due;
+    }
+    w->now++;
+    while ((t = due) != NULL) {
+      timer_unlink(t);
+      w->pending--;
+      t->fn(t, t->user);
+      fired++;
+    }
+  }
+  return fired;
+}
@@ -0,0 +1,96 @@
+/*
+ * NFC Event Daemon
+ * Timer wheel
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file timer.h
+ * @brief Hierarchical timer wheel on the monotonic clock
+ *
+ * Deadlines (expiry, debounce, presence checks) of any number of readers and
+ * cards are kept in a wheel of TIMER_LEVELS levels of 64 slots, 1 ms per slot
+ * at the first level and 64 times coarser at each next one.  Adding and
+ * cancelling a timer are O(1); a timer is moved down a level at most
+ * TIMER_LEVELS - 1 times before it fires, so it fires on the millisecond it
+ * is due however long the delay.  Delays beyond the last level (about 4.6
+ * hours) are carried over.
+ *
+ * A wheel is driven by the thread that owns it, typically:
+ *
+ *   signals_sleep(timer_next(&wheel));
+ *   timer_run(&wheel);
+ *
+ * Timers are embedded in the structure they belong to; no allocation.  Not
+ * thread safe: a wheel and its timers are only used by the owning thread.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef struct nfcd_timer {
+  struct nfcd_timer *next;
+  struct nfcd_timer **pprev;      /* NULL when not pending */
+  int64_t expires;                /* ms, CLOCK_MONOTONIC */
+  void    (*fn)(struct nfcd_timer *timer, void *user);
+  void   *user;
+} nfcd_timer;
+
+typedef struct {
+  int64_t now;                    /* next ms to process */
+  unsigned pending;
+  nfcd_timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel;
+
+/**
+ * @brief Milliseconds on CLOCK_MONOTONIC
+ */
+int64_t timer_now(void);
+
+void    timer_wheel_init(timer_wheel *w);
+
+/**
+ * @brief Prepare a timer, calling @a fn from timer_run() when it fires
+ */
+void    timer_init(nfcd_timer *t, void (*fn)(nfcd_timer *timer, void *user), void *user);
+
+/**
+ * @brief Arm @a t to fire in @a delay ms, re-arming it if pending
+ */
+void    timer_add(timer_wheel *w, nfcd_timer *t, int64_t delay);
+void    timer_cancel(timer_wheel *w, nfcd_timer *t);
+
+bool    timer_pending(const nfcd_timer *t);
+
+/**
+ * @brief Milliseconds until a timer may fire, 0 if one is due, -1 if none is pending
+ */
+int     timer_next(const timer_wheel *w);
+
+/**
+ * @brief Fire the timers that are due
+ * @return Number of timers fired
+ */
+unsigned timer_run(timer_wheel *w);
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,238 @@
+/*
+ * NFC Event Daemon
+ * Trace recorder
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file trace.c
+ * @brief Timeline of libnfc calls and event dispatch
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <nfc/nfc.h>
+
+#include "trace.h"
+#include "nfc-utils.h"
+#include "debug.h"
+
+#ifndef PATH_MAX
+#  define PATH_MAX 4096
+#endif
+
+#define TRACE_MIN_EVENTS 64
+#define TRACE_MAX_EVENTS (1024 * 1024)
+
+typedef struct {
+  int64_t start;                /* us, CLOCK_MONOTONIC */
+  int64_t dur;                  /* us */
+  const char *cat;
+  const char *name;
+  int     res;
+} trace_event;
+
+/*
+ * Spans of one thread.  The owner fills the slot, then publishes it by
+ * advancing head; a dump copies the slots and re-reads head to drop the ones
+ * that were overwritten meanwhile.
+ */
+typedef struct trace_ring {
+  struct trace_ring *next;
+  long    tid;
+  char    name[32];
+  unsigned long mask;
+  unsigned long head;           /* spans recorded so far */
+  trace_event events[];
+} trace_ring;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char trace_path[PATH_MAX];    /* protected by trace_lock */
+static int trace_enabled = 0;
+static unsigned long ring_events = 8192;
+static trace_ring *rings = NULL;
+
+static __thread trace_ring *local = NULL;
+static __thread char local_name[32];
+
+void
+trace_configure(const char *path, size_t events)
+{
+  unsigned long n = TRACE_MIN_EVENTS;
+
+  while ((n < events) && (n < TRACE_MAX_EVENTS))
+    n *= 2;
+  pthread_mutex_lock(&trace_lock);
+  snprintf(trace_path, sizeof(trace_path), "%s", path);
+  __atomic_store_n(&ring_events, n, __ATOMIC_RELAXED);
+  __atomic_store_n(&trace_enabled, path[0] != '\0', __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static trace_ring *
+local_ring(void)
+{
+  const unsigned long n = __atomic_load_n(&ring_events, __ATOMIC_RELAXED);
+  trace_ring *r;
+
+  if (local)
+    return local;
+  if ((r = calloc(1, sizeof(*r) + n * sizeof(trace_event))) == NULL)
+    return NULL;
+  r->tid = syscall(SYS_gettid);
+  if (local_name[0])
+    snprintf(r->name, sizeof(r->name), "%s", local_name);
+  else
+    snprintf(r->name, sizeof(r->name), "thread %ld", r->tid);
+  r->mask = n - 1;
+  pthread_mutex_lock(&trace_lock);
+  r->next = rings;
+  __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+  return local = r;
+}
+
+static int64_t
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+trace_thread_name(const char *name)
+{
+  snprintf(local_name, sizeof(local_name), "%s", name);
+}
+
+int64_t
+trace_begin(void)
+{
+  if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+    return 0;
+  return now();
+}
+
+void
+trace_end(const char *cat, const char *name, int64_t start, int res)
+{
+  trace_ring *r;
+  trace_event *e;
+  unsigned long head;
+
+  if ((start == 0) || ((r = local_ring()) == NULL))
+    return;
+  head = r->head;
+  e = &r->events[head & r->mask];
+  e->start = start;
+  e->dur = now() - start;
+  e->cat = cat;
+  e->name = name;
+  e->res = res;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Copy the spans still in a ring, oldest first
+ * @return Number of spans copied to @a out (which holds the whole ring)
+ */
+static unsigned long
+ring_copy(const trace_ring *r, trace_event *out)
+{
+  const unsigned long size = r->mask + 1;
+  unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  unsigned long n = (head < size) ? head : size;
+  unsigned long first = head - n;
+  unsigned long i, overwritten;
+
+  for (i = 0; i < n; i++)
+    out[i] = r->events[(first + i) & r->mask];
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  // Slots the owner reused while we were copying
+  overwritten = __atomic_load_n(&r->head, __ATOMIC_RELAXED) - head;
+  if (overwritten >= n)
+    return 0;
+  memmove(out, out + overwritten, (n - overwritten) * sizeof(*out));
+  return n - overwritten;
+}
+
+void
+trace_dump(void)
+{
+  char    path[PATH_MAX];
+  char    tmp[PATH_MAX + 8];
+  const trace_ring *r;
+  trace_event *events = NULL;
+  unsigned long n, i, spans = 0;
+  const long pid = getpid();
+  bool    first = true;
+  FILE   *f;
+
+  pthread_mutex_lock(&trace_lock);
+  snprintf(path, sizeof(path), "%s", trace_path);
+  pthread_mutex_unlock(&trace_lock);
+  if (!path[0]) {
+    WARN("%s", "Tracing is disabled, nothing to dump");
+    return;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((f = fopen(tmp, "w")) == NULL) {
+    ERR("Unable to write trace %s: %s", tmp, strerror(errno));
+    return;
+  }
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",", pid, r->tid, r->name);
+    first = false;
+    free(events);
+    if ((events = malloc((r->mask + 1) * sizeof(*events))) == NULL)
+      continue;
+    n = ring_copy(r, events);
+    for (i = 0; i < n; i++) {
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+              "\"pid\":%ld,\"tid\":%ld,\"args\":{\"res\":%d}}",
+              events[i].name, events[i].cat, (long long) events[i].start, (long long) events[i].dur,
+              pid, r->tid, events[i].res);
+    }
+    spans += n;
+  }
+  free(events);
+  fprintf(f, "\n]}\n");
+  if ((fclose(f) != 0) || (rename(tmp, path) < 0)) {
+    ERR("Unable to write trace %s: %s", path, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+  INFO("Trace of %lu spans written to %s", spans, path);
+}
@@ -0,0 +1,79 @@
+/*
+ * NFC Event Daemon
+ * Trace recorder
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file trace.h
+ * @brief Timeline of libnfc calls and event dispatch
+ *
+ * When enabled, every traced call is recorded as a span (start, duration,
+ * result) in a ring owned by the calling thread: recording takes no lock and
+ * only the owner writes to a ring.  trace_dump() writes the spans still in
+ * the rings as Chrome trace event JSON, which chrome://tracing and Perfetto
+ * load as is; it is run from the signal thread on SIGUSR1.
+ *
+ * Usage around a call:
+ *
+ *   int64_t t = trace_begin();
+ *   res = nfc_initiator_poll_target(...);
+ *   trace_end(TRACE_LIBNFC, "nfc_initiator_poll_target", t, res);
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_LIBNFC "libnfc"
+#define TRACE_NFCD   "nfcd"
+
+/**
+ * @brief Enable or disable recording
+ * @param path File trace_dump() writes to, empty string to disable tracing
+ * @param events Spans kept per thread, rounded up to a power of two; only
+ * applies to threads that record their first span afterwards
+ */
+void    trace_configure(const char *path, size_t events);
+
+/**
+ * @brief Start a span
+ * @return Start time to pass to trace_end(), 0 when tracing is disabled
+ */
+int64_t trace_begin(void);
+
+/**
+ * @brief Record the span started at @a start
+ * @param cat Category, one of the TRACE_* strings
+ * @param name Static string naming the span
+ * @param res Result of the call, shown as an argument
+ */
+void    trace_end(const char *cat, const char *name, int64_t start, int res);
+
+/**
+ * @brief Name the calling thread in the trace
+ */
+void    trace_thread_name(const char *name);
+
+/**
+ * @brief Write the recorded spans to the configured file
+ */
+void    trace_dump(void);
+
+#endif /* __TRACE_H__ */
@@ -26,7 +26,9 @@
 typedef enum {
   EVENT_TAG_INSERTED,
   EVENT_TAG_REMOVED,
-  EVENT_EXPIRE_TIME
+  EVENT_EXPIRE_TIME,
+  EVENT_READER_DOWN,
+  EVENT_READER_UP
 } nem_event_t;
 
 #endif